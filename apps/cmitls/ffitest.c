@@ -0,0 +1,486 @@
+// Behaviour tests of the miTLS FFI entry points, over local socket pairs
+// or in memory, between a client and a server of this process:
+//
+//   ffitest.exe [template|engine|receive_into|sendv|cork|read-ahead]
+//
+// Each mode checks the application data received byte for byte, and the
+// number of send and recv callbacks where the entry point promises fewer.
+// Runs every mode without an argument; exits nonzero on the first failure.
+//
+// Linux and macOS only (pthreads, socketpair).
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <mitlsffi.h>
+#include <mipki.h>
+
+static const char *option_cert = "../../data/server-ecdsa.crt";
+static const char *option_key = "../../data/server-ecdsa.key";
+static const char *option_cafile = "../../data/CAFile.pem";
+
+#define CHECK(e) \
+  do { if (!(e)) { printf("  FAILED at line %d: %s\n", __LINE__, #e); return 0; } } while (0)
+
+typedef struct {
+  int fd;
+  int writes; // calls to SendCallback
+  int reads;  // calls to RecvCallback
+  int read_ahead;
+} callback_context;
+
+// One end of a connection over a socket pair
+typedef struct {
+  mitls_state *state;
+  callback_context ctx;
+  int is_server;
+  int ok;
+} endpoint;
+
+static void* certificate_select(void *cbs, mitls_version ver, const unsigned char *sni, size_t sni_len, const unsigned char *alpn, size_t alpn_len, const mitls_signature_scheme *sigalgs, size_t sigalgs_len, mitls_signature_scheme *selected)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  return (void*)mipki_select_certificate(st, (char*)sni, sni_len, sigalgs, sigalgs_len, selected);
+}
+
+static size_t certificate_format(void *cbs, const void *cert_ptr, unsigned char *buffer)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  return mipki_format_chain(st, (mipki_chain)cert_ptr, (char*)buffer, MAX_CHAIN_LEN);
+}
+
+static size_t certificate_chain(void *cbs, const void *cert_ptr, const unsigned char *const **certs, const size_t **certs_len)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  return mipki_get_chain_der(st, (mipki_chain)cert_ptr, (const char *const **)certs, certs_len);
+}
+
+static size_t certificate_sign(void *cbs, const void *cert_ptr, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, unsigned char *sig)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  size_t ret = MAX_SIGNATURE_LEN;
+  if(mipki_sign_verify(st, cert_ptr, sigalg, (char*)tbs, tbs_len, (char*)sig, &ret, MIPKI_SIGN))
+    return ret;
+  return 0;
+}
+
+static int certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  mipki_chain chain = mipki_parse_chain(st, (char*)chain_bytes, chain_len);
+  if(chain == NULL) return 0;
+  size_t slen = sig_len;
+  int r = mipki_sign_verify(st, chain, sigalg, (char*)tbs, tbs_len, (char*)sig, &slen, MIPKI_VERIFY);
+  mipki_free_chain(st, chain);
+  return r;
+}
+
+static mitls_cert_cb cert_callbacks = {
+  .select = certificate_select,
+  .format = certificate_format,
+  .sign = certificate_sign,
+  .verify = certificate_verify
+};
+
+static int SendCallback(void *pv, const unsigned char *buffer, size_t buffer_size)
+{
+  callback_context *ctx = (callback_context*)pv;
+  size_t sent = 0;
+  ctx->writes++;
+  while (sent < buffer_size) {
+    ssize_t r = send(ctx->fd, buffer + sent, buffer_size - sent, 0);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    sent += r;
+  }
+  return (int)sent;
+}
+
+static int RecvCallback(void *pv, unsigned char *buffer, size_t buffer_size)
+{
+  callback_context *ctx = (callback_context*)pv;
+  ssize_t r;
+  ctx->reads++;
+  do {
+    // without read-ahead, miTLS asks for exactly the bytes it needs
+    r = recv(ctx->fd, buffer, buffer_size, ctx->read_ahead ? 0 : MSG_WAITALL);
+  } while (r < 0 && errno == EINTR);
+  return (int)r;
+}
+
+static mipki_state *pki;
+
+static mitls_state *Configure(mitls_config_template *tmpl)
+{
+  mitls_state *state = NULL;
+  if (tmpl) return FFI_mitls_configure_from_template(&state, tmpl, NULL) ? state : NULL;
+  if (!FFI_mitls_configure(&state, "1.3", "localhost")) return NULL;
+  if (!FFI_mitls_configure_cert_callbacks(state, pki, &cert_callbacks)
+      || !FFI_mitls_configure_cert_chain_callback(state, certificate_chain)) {
+    FFI_mitls_close(state);
+    return NULL;
+  }
+  return state;
+}
+
+static mitls_config_template *CreateTemplate(void)
+{
+  mitls_config_template *tmpl = NULL;
+  mitls_state *state = Configure(NULL);
+  if (state == NULL || !FFI_mitls_configure_template(&tmpl, state)) return NULL;
+  return tmpl;
+}
+
+static void *HandshakeThread(void *arg)
+{
+  endpoint *e = (endpoint*)arg;
+  e->ok = e->is_server
+    ? FFI_mitls_accept_connected(&e->ctx, SendCallback, RecvCallback, e->state)
+    : FFI_mitls_connect(&e->ctx, SendCallback, RecvCallback, e->state);
+  if (!e->ok) {
+    shutdown(e->ctx.fd, SHUT_RDWR); // unblock the peer
+  }
+  return NULL;
+}
+
+// Connect c and s, configured, over a fresh socket pair; the server runs
+// on a second thread. The callback counters start at 0 once connected.
+static int Connect(endpoint *c, endpoint *s)
+{
+  int fds[2];
+  pthread_t server;
+
+  if (c->state == NULL || s->state == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 0;
+  c->ctx.fd = fds[0];
+  s->ctx.fd = fds[1];
+  c->is_server = 0;
+  s->is_server = 1;
+  pthread_create(&server, NULL, HandshakeThread, s);
+  HandshakeThread(c);
+  pthread_join(server, NULL);
+  c->ctx.writes = c->ctx.reads = s->ctx.writes = s->ctx.reads = 0;
+  return c->ok && s->ok;
+}
+
+static void Close(endpoint *e)
+{
+  FFI_mitls_close(e->state);
+  e->state = NULL;
+  if (e->ctx.fd >= 0) close(e->ctx.fd);
+  e->ctx.fd = -1;
+}
+
+static void Fill(unsigned char *b, size_t len, unsigned seed)
+{
+  for (size_t i = 0; i < len; i++) b[i] = (unsigned char)(seed + i * 7 + (i >> 8));
+}
+
+// Receive exactly len bytes with FFI_mitls_receive_into, chunk bytes at a
+// time, and compare them with expected
+static int ReceiveInto(endpoint *e, const unsigned char *expected, size_t len, size_t chunk)
+{
+  unsigned char *buf = malloc(chunk);
+  size_t done = 0;
+  int ok = (buf != NULL);
+  while (ok && done < len) {
+    size_t n;
+    ok = FFI_mitls_receive_into(e->state, buf, chunk, &n) && n > 0 && n <= chunk
+      && n <= len - done && memcmp(buf, expected + done, n) == 0;
+    done += n;
+  }
+  free(buf);
+  return ok;
+}
+
+// Templates: connections configured from a template, from the handshake
+// to application data both ways, outliving the caller's reference
+static int TestTemplate(void)
+{
+  unsigned char msg[1000], back[1000];
+  mitls_config_template *ctmpl = CreateTemplate(), *stmpl = CreateTemplate();
+  CHECK(ctmpl != NULL && stmpl != NULL);
+
+  for (int i = 0; i < 3; i++) {
+    endpoint c = { .state = Configure(ctmpl) }, s = { .state = Configure(stmpl) };
+    CHECK(Connect(&c, &s));
+    if (i == 2) {
+      // The last connections hold the last references
+      FFI_mitls_template_free(ctmpl);
+      FFI_mitls_template_free(stmpl);
+    }
+    Fill(msg, sizeof(msg), i);
+    Fill(back, sizeof(back), 100 + i);
+    CHECK(FFI_mitls_send(c.state, msg, sizeof(msg)));
+    CHECK(ReceiveInto(&s, msg, sizeof(msg), sizeof(msg)));
+    CHECK(FFI_mitls_send(s.state, back, sizeof(back)));
+    CHECK(ReceiveInto(&c, back, sizeof(back), sizeof(back)));
+    Close(&c);
+    Close(&s);
+  }
+
+  // A state with a stack for its certificate callbacks, turned into a template
+  mitls_config_template *tmpl = NULL;
+  mitls_state *state = Configure(NULL);
+  CHECK(state != NULL && FFI_mitls_configure_async_cert_callbacks(state));
+  CHECK(FFI_mitls_configure_template(&tmpl, state));
+  endpoint c = { .state = Configure(tmpl) }, s = { .state = Configure(stmpl = CreateTemplate()) };
+  FFI_mitls_template_free(tmpl);
+  FFI_mitls_template_free(stmpl);
+  CHECK(Connect(&c, &s));
+  Close(&c);
+  Close(&s);
+  return 1;
+}
+
+typedef struct {
+  mitls_state *state;
+  unsigned char *inbox; // ciphertext received from the peer, not yet consumed
+  size_t inbox_len;
+  unsigned char *data;  // application data received
+  size_t data_len;
+  uint16_t flags;
+} engine_end;
+
+static int Append(unsigned char **b, size_t *len, const unsigned char *p, size_t n)
+{
+  unsigned char *r = realloc(*b, *len + n + 1);
+  if (r == NULL) return 0;
+  memcpy(r + *len, p, n);
+  *b = r;
+  *len += n;
+  return 1;
+}
+
+// Run e until it wants more input, passing its output to peer; plaintext
+// is deliberately smaller than a record
+static int EngineStep(engine_end *e, engine_end *peer)
+{
+  unsigned char out[4096], plaintext[4096];
+  mitls_process_ctx ctx;
+
+  do {
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.input = e->inbox;
+    ctx.input_len = e->inbox_len;
+    ctx.output = out;
+    ctx.output_len = sizeof(out);
+    ctx.plaintext = plaintext;
+    ctx.plaintext_len = sizeof(plaintext);
+    CHECK(FFI_mitls_process(e->state, &ctx));
+    CHECK(!(ctx.flags & TFLAG_CLOSED));
+    CHECK(ctx.consumed_bytes <= e->inbox_len);
+    memmove(e->inbox, e->inbox + ctx.consumed_bytes, e->inbox_len - ctx.consumed_bytes);
+    e->inbox_len -= ctx.consumed_bytes;
+    CHECK(Append(&peer->inbox, &peer->inbox_len, out, ctx.output_len));
+    if (ctx.flags & TFLAG_DATA) {
+      CHECK(ctx.plaintext_len <= sizeof(plaintext));
+      CHECK(Append(&e->data, &e->data_len, plaintext, ctx.plaintext_len));
+    }
+  } while ((ctx.flags & (TFLAG_WANT_WRITE | TFLAG_DATA)) || !(ctx.flags & TFLAG_WANT_READ));
+  e->flags = ctx.flags;
+  return 1;
+}
+
+// The non-blocking API: an in-memory handshake, then records larger than
+// the plaintext buffer both ways
+static int TestEngine(void)
+{
+  static unsigned char msg[40000], back[5000];
+  engine_end c = { 0 }, s = { 0 };
+  int ok;
+
+  c.state = Configure(NULL);
+  s.state = Configure(NULL);
+  CHECK(c.state != NULL && s.state != NULL);
+  CHECK(FFI_mitls_engine_connect(c.state) && FFI_mitls_engine_accept(s.state));
+  for (int i = 0; i < 10 && !((c.flags & s.flags) & TFLAG_COMPLETE); i++) {
+    CHECK(EngineStep(&c, &s) && EngineStep(&s, &c));
+  }
+  CHECK(c.flags & s.flags & TFLAG_COMPLETE);
+  CHECK(c.data_len == 0 && s.data_len == 0);
+
+  Fill(msg, sizeof(msg), 1);
+  Fill(back, sizeof(back), 2);
+  CHECK(FFI_mitls_send(c.state, msg, sizeof(msg)));
+  CHECK(EngineStep(&c, &s) && EngineStep(&s, &c));
+  CHECK(FFI_mitls_send(s.state, back, sizeof(back)));
+  CHECK(EngineStep(&s, &c) && EngineStep(&c, &s));
+
+  ok = s.data_len == sizeof(msg) && memcmp(s.data, msg, sizeof(msg)) == 0
+    && c.data_len == sizeof(back) && memcmp(c.data, back, sizeof(back)) == 0
+    && s.inbox_len == 0 && c.inbox_len == 0;
+  FFI_mitls_close(c.state);
+  FFI_mitls_close(s.state);
+  free(c.inbox);
+  free(s.inbox);
+  free(c.data);
+  free(s.data);
+  CHECK(ok);
+  return 1;
+}
+
+// FFI_mitls_receive_into: records returned across small buffers, and the
+// rest of a record partly received returned first by FFI_mitls_receive
+static int TestReceiveInto(void)
+{
+  static unsigned char msg[40000];
+  unsigned char buf[1000];
+  size_t n;
+  endpoint c = { .state = Configure(NULL) }, s = { .state = Configure(NULL) };
+  CHECK(Connect(&c, &s));
+
+  Fill(msg, sizeof(msg), 3);
+  CHECK(FFI_mitls_send(c.state, msg, sizeof(msg)));
+  CHECK(ReceiveInto(&s, msg, sizeof(msg), sizeof(buf)));
+
+  // 20000 bytes: a full record of 16384 bytes, then 3616
+  CHECK(FFI_mitls_send(c.state, msg, 20000));
+  CHECK(FFI_mitls_receive_into(s.state, buf, sizeof(buf), &n) && n == sizeof(buf));
+  CHECK(memcmp(buf, msg, n) == 0);
+  unsigned char *p = FFI_mitls_receive(s.state, &n);
+  CHECK(p != NULL && n == 16384 - sizeof(buf) && memcmp(p, msg + sizeof(buf), n) == 0);
+  FFI_mitls_free(s.state, p);
+  CHECK(ReceiveInto(&s, msg + 16384, 20000 - 16384, sizeof(buf)));
+
+  // A buffer larger than the record
+  CHECK(FFI_mitls_send(s.state, msg, 10));
+  CHECK(FFI_mitls_receive_into(c.state, buf, sizeof(buf), &n) && n == 10 && memcmp(buf, msg, 10) == 0);
+  Close(&c);
+  Close(&s);
+  return 1;
+}
+
+// FFI_mitls_sendv: records filled across buffers in one send callback, and
+// kept with MITLS_SEND_MORE until the next send
+static int TestSendv(void)
+{
+  static unsigned char msg[20008];
+  endpoint c = { .state = Configure(NULL) }, s = { .state = Configure(NULL) };
+  CHECK(Connect(&c, &s));
+
+  Fill(msg, sizeof(msg), 4);
+  mitls_iovec iov[4] = {
+    { .base = msg, .len = 5 },
+    { .base = msg + 5, .len = 0 },
+    { .base = msg + 5, .len = 20000 },
+    { .base = msg + 20005, .len = 3 }
+  };
+  CHECK(FFI_mitls_sendv(c.state, iov, 4, 0));
+  CHECK(c.ctx.writes == 1);
+  CHECK(ReceiveInto(&s, msg, sizeof(msg), 4096));
+
+  mitls_iovec more = { .base = msg, .len = 100 }, last = { .base = msg + 100, .len = 100 };
+  CHECK(FFI_mitls_sendv(c.state, &more, 1, MITLS_SEND_MORE));
+  CHECK(c.ctx.writes == 1);
+  CHECK(FFI_mitls_sendv(c.state, &last, 1, 0));
+  CHECK(c.ctx.writes == 2);
+  CHECK(ReceiveInto(&s, msg, 200, 4096));
+  Close(&c);
+  Close(&s);
+  return 1;
+}
+
+// FFI_mitls_cork/uncork: the records of several sends in one send
+// callback, when the outermost cork is released
+static int TestCork(void)
+{
+  unsigned char msg[300];
+  endpoint c = { .state = Configure(NULL) }, s = { .state = Configure(NULL) };
+  CHECK(Connect(&c, &s));
+
+  Fill(msg, sizeof(msg), 5);
+  FFI_mitls_cork(c.state);
+  FFI_mitls_cork(c.state);
+  for (int i = 0; i < 3; i++) {
+    CHECK(FFI_mitls_send(c.state, msg + 100 * i, 100));
+  }
+  CHECK(c.ctx.writes == 0);
+  CHECK(FFI_mitls_uncork(c.state));
+  CHECK(c.ctx.writes == 0);
+  CHECK(FFI_mitls_uncork(c.state));
+  CHECK(c.ctx.writes == 1);
+  CHECK(ReceiveInto(&s, msg, sizeof(msg), sizeof(msg)));
+
+  CHECK(FFI_mitls_send(c.state, msg, 100));
+  CHECK(c.ctx.writes == 2);
+  CHECK(ReceiveInto(&s, msg, 100, sizeof(msg)));
+  Close(&c);
+  Close(&s);
+  return 1;
+}
+
+// FFI_mitls_configure_read_ahead: many records taken from one recv callback
+static int TestReadAhead(void)
+{
+  enum { RECORDS = 50, RECORD_LEN = 64 };
+  unsigned char msg[RECORDS * RECORD_LEN];
+  endpoint c = { .state = Configure(NULL) }, s = { .state = Configure(NULL) };
+  CHECK(s.state != NULL && FFI_mitls_configure_read_ahead(s.state, 65536));
+  s.ctx.read_ahead = 1;
+  CHECK(Connect(&c, &s));
+  CHECK(!FFI_mitls_configure_read_ahead(s.state, 65536));
+
+  Fill(msg, sizeof(msg), 6);
+  for (int i = 0; i < RECORDS; i++) {
+    CHECK(FFI_mitls_send(c.state, msg + i * RECORD_LEN, RECORD_LEN));
+  }
+  CHECK(c.ctx.writes == RECORDS);
+  CHECK(ReceiveInto(&s, msg, sizeof(msg), RECORD_LEN));
+  CHECK(s.ctx.reads < RECORDS / 2);
+  Close(&c);
+  Close(&s);
+  return 1;
+}
+
+static const struct {
+  const char *name;
+  int (*run)(void);
+} tests[] = {
+  { "template", TestTemplate },
+  { "engine", TestEngine },
+  { "receive_into", TestReceiveInto },
+  { "sendv", TestSendv },
+  { "cork", TestCork },
+  { "read-ahead", TestReadAhead }
+};
+
+int main(int argc, char **argv)
+{
+  int erridx, found = 0;
+  mipki_config_entry pki_config[1] = {
+    { .cert_file = option_cert, .key_file = option_key, .is_universal = 1 }
+  };
+
+  signal(SIGPIPE, SIG_IGN); // a failed peer shows up as a send error
+  if (!FFI_mitls_init()) {
+    printf("FFI_mitls_init() failed!\n");
+    return 2;
+  }
+  pki = mipki_init(pki_config, 1, NULL, &erridx);
+  if (pki == NULL || !mipki_add_root_file_or_path(pki, option_cafile)) {
+    printf("Failed to initialize the PKI library: errid=%d\n", erridx);
+    return 2;
+  }
+
+  for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    if (argc > 1 && strcmp(argv[1], tests[i].name) != 0) continue;
+    found = 1;
+    printf("%s\n", tests[i].name);
+    if (!tests[i].run()) return 1;
+  }
+  if (!found) {
+    printf("Usage: ffitest.exe [template|engine|receive_into|sendv|cork|read-ahead]\n");
+    return 1;
+  }
+
+  mipki_free(pki);
+  FFI_mitls_cleanup();
+  printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,673 @@
+// Multi-threaded miTLS benchmark.
+//
+// Runs 1..N independent client/server pairs over local socket pairs,
+// each pair driven by its own two threads, and reports how handshake
+// and bulk data throughput scale with the number of concurrent
+// connections:
+//
+//   mitlsbench.exe [-threads N] [-mode handshake|bulk|engine|setup] [-n count] [-size MB]
+//
+// The engine mode runs in-memory handshakes with FFI_mitls_process,
+// many connections per thread, without any socket.  The setup mode only
+// creates connections, sends the ClientHello and closes them, to measure
+// the per-connection setup and teardown cost (see MITLS_REGION_POOL).
+// With -async, the engine mode suspends the handshakes in each certificate
+// callback, and completes them from the loop (see
+// FFI_mitls_configure_async_cert_callbacks).
+//
+// Linux and macOS only (pthreads, socketpair).
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <mitlsffi.h>
+#include <mipki.h>
+
+static const char *option_version = "1.3";
+static const char *option_mode = "handshake";
+static const char *option_cert = "../../data/server-ecdsa.crt";
+static const char *option_key = "../../data/server-ecdsa.key";
+static const char *option_cafile = "../../data/CAFile.pem";
+static const char *option_ciphers;
+static const char *option_groups;  // named groups, and the groups of -keyshares
+static int option_threads = 4;
+static int option_count = 100;     // handshakes per pair
+static int option_size = 64;       // MB sent per pair in bulk mode
+static int option_record = 0;      // bytes per FFI_mitls_send in bulk mode, 0 for BULK_CHUNK
+static int option_inflight = 16;   // concurrent connections per thread in engine mode
+static int option_template = 0;    // create connections from a shared mitls_config_template
+static int option_memstats = 0;    // report allocations per handshake, or per MB in bulk mode
+static int option_keyshares = 0;   // depth of the pools of pre-generated key shares
+static int option_seal_threads = 0; // threads sealing the records of one send, see FFI_mitls_configure_seal_threads
+static int option_read_ahead = 0;  // bytes per recv, see FFI_mitls_configure_read_ahead
+static int option_async = 0;       // pending certificate callbacks in engine mode
+
+enum { MODE_HANDSHAKE, MODE_BULK, MODE_ENGINE, MODE_SETUP };
+
+#define BULK_CHUNK (16*1024)
+#define BULK_SEND_MAX (1024*1024)
+
+typedef struct {
+  int fd;
+  int writes; // calls to SendCallback
+  int reads;  // calls to RecvCallback
+} callback_context;
+
+typedef struct {
+  mipki_state *pki;
+  mitls_config_template *tmpl;
+  int fd;
+  int is_server;
+  size_t bulk_bytes;
+  int failed;
+  double handshake_time; // seconds spent in FFI_mitls_connect/accept_connected
+  int handshake_writes;
+  int bulk_reads;
+} endpoint;
+
+// In-memory, non-blocking handshakes: each thread interleaves
+// option_inflight client/server pairs driven by FFI_mitls_process
+typedef enum { PENDING_NONE, PENDING_SELECT, PENDING_SIGN, PENDING_VERIFY } pending_op;
+
+typedef struct {
+  mitls_state *state;
+  mipki_state *pki;
+  unsigned char *inbox; // ciphertext received from the peer, not yet consumed
+  size_t inbox_len;
+  size_t inbox_cap;
+  int complete;
+
+  // With -async: the suspended callback, and copies of its arguments
+  pending_op pending;
+  unsigned char *sni, *tbs, *chain, *sig;
+  size_t sni_len, tbs_len, chain_len, sig_len;
+  mitls_signature_scheme *sigalgs;
+  size_t sigalgs_len;
+  mitls_signature_scheme sigalg;
+  const void *cert;
+} engine_end;
+
+// The connection in FFI_mitls_process on this thread, with -async
+static __thread engine_end *t_engine;
+
+static unsigned char *CopyArg(const void *b, size_t len)
+{
+  unsigned char *r = malloc(len ? len : 1);
+  if (r != NULL && len) memcpy(r, b, len);
+  return r;
+}
+
+static void* certificate_select(void *cbs, mitls_version ver, const unsigned char *sni, size_t sni_len, const unsigned char *alpn, size_t alpn_len, const mitls_signature_scheme *sigalgs, size_t sigalgs_len, mitls_signature_scheme *selected)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  engine_end *e = t_engine;
+  if (e != NULL) {
+    e->sni = CopyArg(sni, sni_len);
+    e->sni_len = sni_len;
+    e->sigalgs = (mitls_signature_scheme*)CopyArg(sigalgs, sigalgs_len * sizeof(mitls_signature_scheme));
+    e->sigalgs_len = sigalgs_len;
+    e->pending = PENDING_SELECT;
+    return MITLS_SELECT_PENDING;
+  }
+  return (void*)mipki_select_certificate(st, (char*)sni, sni_len, sigalgs, sigalgs_len, selected);
+}
+
+static size_t certificate_format(void *cbs, const void *cert_ptr, unsigned char *buffer)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  return mipki_format_chain(st, (mipki_chain)cert_ptr, (char*)buffer, MAX_CHAIN_LEN);
+}
+
+static size_t certificate_chain(void *cbs, const void *cert_ptr, const unsigned char *const **certs, const size_t **certs_len)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  return mipki_get_chain_der(st, (mipki_chain)cert_ptr, (const char *const **)certs, certs_len);
+}
+
+static size_t certificate_sign(void *cbs, const void *cert_ptr, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, unsigned char *sig)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  size_t ret = MAX_SIGNATURE_LEN;
+  engine_end *e = t_engine;
+  if (e != NULL) {
+    e->cert = cert_ptr;
+    e->sigalg = sigalg;
+    e->tbs = CopyArg(tbs, tbs_len);
+    e->tbs_len = tbs_len;
+    e->pending = PENDING_SIGN;
+    return MITLS_SIGN_PENDING;
+  }
+  if(mipki_sign_verify(st, cert_ptr, sigalg, (char*)tbs, tbs_len, (char*)sig, &ret, MIPKI_SIGN))
+    return ret;
+  return 0;
+}
+
+static int certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len)
+{
+  mipki_state *st = (mipki_state*)cbs;
+  engine_end *e = t_engine;
+  if (e != NULL) {
+    e->chain = CopyArg(chain_bytes, chain_len);
+    e->chain_len = chain_len;
+    e->sigalg = sigalg;
+    e->tbs = CopyArg(tbs, tbs_len);
+    e->tbs_len = tbs_len;
+    e->sig = CopyArg(sig, sig_len);
+    e->sig_len = sig_len;
+    e->pending = PENDING_VERIFY;
+    return MITLS_VERIFY_PENDING;
+  }
+  mipki_chain chain = mipki_parse_chain(st, (char*)chain_bytes, chain_len);
+  if(chain == NULL) return 0;
+  size_t slen = sig_len;
+  int r = mipki_sign_verify(st, chain, sigalg, (char*)tbs, tbs_len, (char*)sig, &slen, MIPKI_VERIFY);
+  mipki_free_chain(st, chain);
+  return r;
+}
+
+static mitls_cert_cb cert_callbacks = {
+  .select = certificate_select,
+  .format = certificate_format,
+  .sign = certificate_sign,
+  .verify = certificate_verify
+};
+
+static int SendCallback(void *pv, const unsigned char *buffer, size_t buffer_size)
+{
+  callback_context *ctx = (callback_context*)pv;
+  size_t sent = 0;
+  ctx->writes++;
+  while (sent < buffer_size) {
+    ssize_t r = send(ctx->fd, buffer + sent, buffer_size - sent, 0);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    sent += r;
+  }
+  return (int)sent;
+}
+
+static int RecvCallback(void *pv, unsigned char *buffer, size_t buffer_size)
+{
+  callback_context *ctx = (callback_context*)pv;
+  ssize_t r;
+  ctx->reads++;
+  do {
+    // without read-ahead, miTLS asks for exactly the bytes it needs
+    r = recv(ctx->fd, buffer, buffer_size, option_read_ahead ? 0 : MSG_WAITALL);
+  } while (r < 0 && errno == EINTR);
+  return (int)r;
+}
+
+static mitls_state *Configure(mipki_state *pki, mitls_config_template *tmpl)
+{
+  mitls_state *state = NULL;
+  if (tmpl) return FFI_mitls_configure_from_template(&state, tmpl, NULL) ? state : NULL;
+  if (!FFI_mitls_configure(&state, option_version, "localhost")) return NULL;
+  if (!FFI_mitls_configure_cert_callbacks(state, pki, &cert_callbacks)) goto fail;
+  if (!FFI_mitls_configure_cert_chain_callback(state, certificate_chain)) goto fail;
+  if (option_ciphers && !FFI_mitls_configure_cipher_suites(state, option_ciphers)) goto fail;
+  if (option_groups && !FFI_mitls_configure_named_groups(state, option_groups)) goto fail;
+  return state;
+fail:
+  FFI_mitls_close(state);
+  return NULL;
+}
+
+// With -template, each thread configures client and server once
+static mitls_config_template *CreateTemplate(mipki_state *pki)
+{
+  mitls_config_template *tmpl = NULL;
+  mitls_state *state;
+  if (!option_template || pki == NULL || (state = Configure(pki, NULL)) == NULL) return NULL;
+  FFI_mitls_configure_template(&tmpl, state);
+  return tmpl;
+}
+
+static int Handshake(mitls_state *state, callback_context *ctx, int is_server)
+{
+  return is_server
+    ? FFI_mitls_accept_connected(ctx, SendCallback, RecvCallback, state)
+    : FFI_mitls_connect(ctx, SendCallback, RecvCallback, state);
+}
+
+static int Bulk(mitls_state *state, int is_server, size_t total)
+{
+  size_t done = 0;
+  if (is_server) {
+    unsigned char buffer[BULK_CHUNK];
+    while (done < total) {
+      size_t len;
+      if (!FFI_mitls_receive_into(state, buffer, sizeof(buffer), &len) || len == 0) return 0;
+      done += len;
+    }
+  } else {
+    static const unsigned char chunk[BULK_SEND_MAX];
+    size_t record = (option_record > 0 && option_record <= BULK_SEND_MAX) ? option_record : BULK_CHUNK;
+    while (done < total) {
+      size_t len = total - done < record ? total - done : record;
+      if (!FFI_mitls_send(state, chunk, len)) return 0;
+      done += len;
+    }
+  }
+  return 1;
+}
+
+static mipki_state *CreatePKI(void)
+{
+  int erridx;
+  mipki_config_entry pki_config[1] = {
+    { .cert_file = option_cert, .key_file = option_key, .is_universal = 1 }
+  };
+  mipki_state *pki = mipki_init(pki_config, 1, NULL, &erridx);
+  if (pki && !mipki_add_root_file_or_path(pki, option_cafile)) {
+    mipki_free(pki);
+    pki = NULL;
+  }
+  return pki;
+}
+
+static double Now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One connection, from configuration to close
+static void *EndpointThread(void *arg)
+{
+  endpoint *e = (endpoint*)arg;
+  callback_context ctx = { .fd = e->fd };
+  mitls_state *state = Configure(e->pki, e->tmpl);
+  double t0 = Now();
+  int ok = (state != NULL
+    && (option_read_ahead == 0 || FFI_mitls_configure_read_ahead(state, option_read_ahead))
+    && Handshake(state, &ctx, e->is_server));
+
+  e->handshake_time = Now() - t0;
+  e->handshake_writes = ctx.writes;
+  int reads = ctx.reads;
+  if (!ok || (e->bulk_bytes && !Bulk(state, e->is_server, e->bulk_bytes))) {
+    e->failed = 1;
+    shutdown(e->fd, SHUT_RDWR); // unblock the peer
+  }
+  e->bulk_reads = ctx.reads - reads;
+  FFI_mitls_close(state);
+  return NULL;
+}
+
+// Run a sequence of connections between one client and one server.
+// Each connection uses a fresh socket pair; the thread running the
+// pair drives the client and a second thread drives the server.
+// Client and server each own their PKI state, so that the benchmark
+// measures miTLS rather than contention in the certificate callbacks.
+typedef struct {
+  int iterations;
+  size_t bulk_bytes;
+  int failed;
+  double server_time; // total server handshake latency
+  int server_writes;
+  int server_reads;   // in bulk mode
+} pair;
+
+static void *PairThread(void *arg)
+{
+  pair *p = (pair*)arg;
+  mipki_state *spki = CreatePKI(), *cpki = CreatePKI();
+  mitls_config_template *stmpl = CreateTemplate(spki), *ctmpl = CreateTemplate(cpki);
+
+  p->failed = (spki == NULL || cpki == NULL || (option_template && (stmpl == NULL || ctmpl == NULL)));
+  for (int i = 0; i < p->iterations && !p->failed; i++) {
+    int fds[2];
+    pthread_t server;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      p->failed = 1;
+      break;
+    }
+    endpoint s = { .pki = spki, .tmpl = stmpl, .fd = fds[0], .is_server = 1, .bulk_bytes = p->bulk_bytes };
+    endpoint c = { .pki = cpki, .tmpl = ctmpl, .fd = fds[1], .is_server = 0, .bulk_bytes = p->bulk_bytes };
+    pthread_create(&server, NULL, EndpointThread, &s);
+    EndpointThread(&c);
+    pthread_join(server, NULL);
+    close(fds[0]);
+    close(fds[1]);
+    p->failed = s.failed || c.failed;
+    p->server_time += s.handshake_time;
+    p->server_writes += s.handshake_writes;
+    p->server_reads += s.bulk_reads;
+  }
+
+  if (stmpl) FFI_mitls_template_free(stmpl);
+  if (ctmpl) FFI_mitls_template_free(ctmpl);
+  if (spki) mipki_free(spki);
+  if (cpki) mipki_free(cpki);
+  return NULL;
+}
+
+// Run the callback that suspended the handshake of e, as the handshake
+// would have, and pass its result to the connection
+static int EngineComplete(engine_end *e)
+{
+  int r = 0;
+  pending_op op = e->pending;
+  e->pending = PENDING_NONE;
+
+  if (op == PENDING_SELECT && e->sni != NULL && e->sigalgs != NULL) {
+    mitls_signature_scheme selected = 0;
+    void *cert = certificate_select(e->pki, TLS_1p3, e->sni, e->sni_len, NULL, 0, e->sigalgs, e->sigalgs_len, &selected);
+    r = FFI_mitls_complete_select(e->state, cert, selected);
+  } else if (op == PENDING_SIGN && e->tbs != NULL) {
+    unsigned char sig[MAX_SIGNATURE_LEN];
+    size_t sig_len = certificate_sign(e->pki, e->cert, e->sigalg, e->tbs, e->tbs_len, sig);
+    r = FFI_mitls_complete_sign(e->state, sig, sig_len);
+  } else if (op == PENDING_VERIFY && e->chain != NULL && e->tbs != NULL && e->sig != NULL) {
+    int valid = certificate_verify(e->pki, e->chain, e->chain_len, e->sigalg, e->tbs, e->tbs_len, e->sig, e->sig_len);
+    r = FFI_mitls_complete_verify(e->state, valid);
+  }
+  free(e->sni);
+  free(e->sigalgs);
+  free(e->tbs);
+  free(e->chain);
+  free(e->sig);
+  e->sni = e->tbs = e->chain = e->sig = NULL;
+  e->sigalgs = NULL;
+  return r;
+}
+
+static int EngineStep(engine_end *e, engine_end *peer)
+{
+  unsigned char out[16384];
+  mitls_process_ctx ctx;
+
+  do {
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.input = e->inbox;
+    ctx.input_len = e->inbox_len;
+    ctx.output = out;
+    ctx.output_len = sizeof(out);
+    t_engine = option_async ? e : NULL;
+    int r = FFI_mitls_process(e->state, &ctx);
+    t_engine = NULL;
+    if (!r) return 0;
+    memmove(e->inbox, e->inbox + ctx.consumed_bytes, e->inbox_len - ctx.consumed_bytes);
+    e->inbox_len -= ctx.consumed_bytes;
+    if (peer->inbox_len + ctx.output_len > peer->inbox_cap) {
+      peer->inbox_cap = 2 * (peer->inbox_len + ctx.output_len);
+      peer->inbox = realloc(peer->inbox, peer->inbox_cap);
+      if (peer->inbox == NULL) return 0;
+    }
+    memcpy(peer->inbox + peer->inbox_len, out, ctx.output_len);
+    peer->inbox_len += ctx.output_len;
+    if ((ctx.flags & TFLAG_PENDING) && !EngineComplete(e)) return 0;
+  } while (ctx.flags & (TFLAG_WANT_WRITE | TFLAG_PENDING));
+  e->complete = (ctx.flags & TFLAG_COMPLETE) != 0;
+  return 1;
+}
+
+static int EngineStart(engine_end *e, mipki_state *pki, mitls_config_template *tmpl, int is_server)
+{
+  e->state = Configure(pki, tmpl);
+  e->pki = pki;
+  e->inbox_len = 0;
+  e->complete = 0;
+  return e->state != NULL
+    && (!option_async || FFI_mitls_configure_async_cert_callbacks(e->state))
+    && (is_server ? FFI_mitls_engine_accept(e->state) : FFI_mitls_engine_connect(e->state));
+}
+
+static void *EngineThread(void *arg)
+{
+  pair *p = (pair*)arg;
+  mipki_state *spki = CreatePKI(), *cpki = CreatePKI();
+  mitls_config_template *stmpl = CreateTemplate(spki), *ctmpl = CreateTemplate(cpki);
+  int inflight = option_inflight;
+  engine_end *c = calloc(inflight, sizeof(engine_end));
+  engine_end *s = calloc(inflight, sizeof(engine_end));
+  int started = 0, done = 0;
+
+  p->failed = (spki == NULL || cpki == NULL || c == NULL || s == NULL
+               || (option_template && (stmpl == NULL || ctmpl == NULL)));
+  for (int i = 0; i < inflight && started < p->iterations && !p->failed; i++, started++) {
+    p->failed = !EngineStart(&c[i], cpki, ctmpl, 0) || !EngineStart(&s[i], spki, stmpl, 1);
+  }
+  while (done < p->iterations && !p->failed) {
+    for (int i = 0; i < inflight && !p->failed; i++) {
+      if (c[i].state == NULL) continue;
+      p->failed = !EngineStep(&c[i], &s[i]) || !EngineStep(&s[i], &c[i]);
+      if (c[i].complete && s[i].complete) {
+        FFI_mitls_close(c[i].state);
+        FFI_mitls_close(s[i].state);
+        c[i].state = s[i].state = NULL;
+        done++;
+        if (started < p->iterations && !p->failed) {
+          p->failed = !EngineStart(&c[i], cpki, ctmpl, 0) || !EngineStart(&s[i], spki, stmpl, 1);
+          started++;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; c && s && i < inflight; i++) {
+    FFI_mitls_close(c[i].state);
+    FFI_mitls_close(s[i].state);
+    free(c[i].inbox);
+    free(s[i].inbox);
+  }
+  free(c);
+  free(s);
+  if (stmpl) FFI_mitls_template_free(stmpl);
+  if (ctmpl) FFI_mitls_template_free(ctmpl);
+  if (spki) mipki_free(spki);
+  if (cpki) mipki_free(cpki);
+  return NULL;
+}
+
+// Short-lived connections: configure a client and a server, pass the
+// ClientHello, and close both
+static void *SetupThread(void *arg)
+{
+  pair *p = (pair*)arg;
+  mipki_state *spki = CreatePKI(), *cpki = CreatePKI();
+  mitls_config_template *stmpl = CreateTemplate(spki), *ctmpl = CreateTemplate(cpki);
+  engine_end c = { 0 }, s = { 0 };
+
+  p->failed = (spki == NULL || cpki == NULL || (option_template && (stmpl == NULL || ctmpl == NULL)));
+  for (int i = 0; i < p->iterations && !p->failed; i++) {
+    p->failed = !EngineStart(&c, cpki, ctmpl, 0) || !EngineStart(&s, spki, stmpl, 1)
+      || !EngineStep(&c, &s);
+    FFI_mitls_close(c.state);
+    FFI_mitls_close(s.state);
+    c.state = s.state = NULL;
+  }
+
+  free(c.inbox);
+  free(s.inbox);
+  if (stmpl) FFI_mitls_template_free(stmpl);
+  if (ctmpl) FFI_mitls_template_free(ctmpl);
+  if (spki) mipki_free(spki);
+  if (cpki) mipki_free(cpki);
+  return NULL;
+}
+
+// Totals of the key share pools of option_groups
+static void GetKeySharePoolStats(uint64_t *hits, uint64_t *misses)
+{
+  const char *g = option_groups;
+  *hits = *misses = 0;
+  while (g && *g) {
+    char name[16];
+    size_t len = strcspn(g, ":");
+    mitls_keyshare_pool_stats s;
+    snprintf(name, sizeof(name), "%.*s", (int)len, g);
+    if (FFI_mitls_get_keyshare_pool_stats(name, &s)) {
+      *hits += s.hits;
+      *misses += s.misses;
+    }
+    g += len + (g[len] == ':');
+  }
+}
+
+static int Run(int threads, int mode)
+{
+  int bulk = (mode == MODE_BULK);
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  pair *pairs = calloc(threads, sizeof(pair));
+  int failed = 0;
+  double server_time = 0;
+  int server_writes = 0;
+  int server_reads = 0;
+  mitls_memory_stats m0, m1;
+  uint64_t hits0, misses0, hits1, misses1;
+
+  FFI_mitls_get_memory_stats(NULL, &m0);
+  GetKeySharePoolStats(&hits0, &misses0);
+  double t0 = Now();
+  for (int i = 0; i < threads; i++) {
+    pairs[i].iterations = bulk ? 1 : option_count;
+    pairs[i].bulk_bytes = bulk ? (size_t)option_size * 1024 * 1024 : 0;
+    pthread_create(&tids[i], NULL,
+      (mode == MODE_ENGINE) ? EngineThread : (mode == MODE_SETUP) ? SetupThread : PairThread, &pairs[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+    failed |= pairs[i].failed;
+    server_time += pairs[i].server_time;
+    server_writes += pairs[i].server_writes;
+    server_reads += pairs[i].server_reads;
+  }
+  double t = Now() - t0;
+  FFI_mitls_get_memory_stats(NULL, &m1);
+  GetKeySharePoolStats(&hits1, &misses1);
+  double units = bulk ? (double)threads * option_size : (double)threads * option_count;
+
+  if (failed) {
+    printf("%7d  FAILED\n", threads);
+  } else if (bulk) {
+    double mb = (double)threads * option_size;
+    printf("%7d  %10.1f MB/s  (%.1f MB/s per connection)", threads, mb / t, mb / t / threads);
+    if (option_record > 0 && option_record <= BULK_CHUNK) {
+      printf("  %.0f records/s, %.2f reads per record", mb * 1024 * 1024 / option_record / t,
+        server_reads / (mb * 1024 * 1024 / option_record));
+    } else {
+      printf("  %.1f reads per MB", server_reads / mb);
+    }
+  } else {
+    double hs = (double)threads * option_count;
+    printf("%7d  %10.1f %s/s  (%.1f per thread)", threads, hs / t,
+      (mode == MODE_SETUP) ? "connections" : "handshakes", hs / t / threads);
+    if (mode == MODE_HANDSHAKE) {
+      printf("  server: %.3f ms, %.1f writes per handshake", server_time * 1000 / hs, server_writes / hs);
+    }
+  }
+  if (!failed && option_memstats) {
+    printf("  memory: %.0f allocations, %.0f bytes per %s, peak %zu bytes",
+      (m1.allocation_count - m0.allocation_count) / units, (m1.total_bytes - m0.total_bytes) / units,
+      bulk ? "MB" : "handshake", m1.peak_bytes);
+  }
+  if (!failed && option_keyshares) {
+    printf("  key shares: %llu from the pool, %llu generated inline",
+      (unsigned long long)(hits1 - hits0), (unsigned long long)(misses1 - misses0));
+  }
+  if (!failed) {
+    printf("\n");
+  }
+
+  free(tids);
+  free(pairs);
+  return failed;
+}
+
+static void PrintUsage(void)
+{
+  printf("Usage: mitlsbench.exe [options]\n"
+         "  -threads N   run 1, 2, 4, ... up to N concurrent connections (default: 4)\n"
+         "  -mode M      handshake | bulk | engine | setup (default: handshake)\n"
+         "  -n C         handshakes (or connections) per thread, except in bulk mode (default: 100)\n"
+         "  -inflight I  concurrent connections per thread in engine mode (default: 16)\n"
+         "  -async       suspend the handshakes in their certificate callbacks (engine mode)\n"
+         "  -size S      megabytes sent per connection in bulk mode (default: 64)\n"
+         "  -record B    bytes per send in bulk mode, one record each up to 16KB (default: 16KB, at most 1MB)\n"
+         "  -seal-threads T  seal the records of each send on T threads (TLS 1.3, bulk mode)\n"
+         "  -read-ahead B    receive up to B bytes per recv callback (default: exactly each record)\n"
+         "  -template    create connections from a shared configuration template\n"
+         "  -memstats    report the allocations per handshake (or per MB in bulk mode)\n"
+         "  -v V         protocol version <1.2 | 1.3> (default: 1.3)\n"
+         "  -ciphers C   colon-separated list of cipher suites\n"
+         "  -groups G    colon-separated list of named groups\n"
+         "  -keyshares D keep D pre-generated key shares for each of the -groups\n"
+         "  -cert F, -key F, -CAFile F  PKI files (default: ../../data/...)\n");
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++) {
+    const char *arg = (i + 1 < argc) ? argv[i+1] : NULL;
+    if (strcmp(argv[i], "-template") == 0) { option_template = 1; continue; }
+    if (strcmp(argv[i], "-memstats") == 0) { option_memstats = 1; continue; }
+    if (strcmp(argv[i], "-async") == 0) { option_async = 1; continue; }
+    if (arg == NULL) { PrintUsage(); return 1; }
+    if (strcmp(argv[i], "-threads") == 0) option_threads = atoi(arg);
+    else if (strcmp(argv[i], "-mode") == 0) option_mode = arg;
+    else if (strcmp(argv[i], "-n") == 0) option_count = atoi(arg);
+    else if (strcmp(argv[i], "-size") == 0) option_size = atoi(arg);
+    else if (strcmp(argv[i], "-record") == 0) option_record = atoi(arg);
+    else if (strcmp(argv[i], "-inflight") == 0) option_inflight = atoi(arg);
+    else if (strcmp(argv[i], "-v") == 0) option_version = arg;
+    else if (strcmp(argv[i], "-ciphers") == 0) option_ciphers = arg;
+    else if (strcmp(argv[i], "-groups") == 0) option_groups = arg;
+    else if (strcmp(argv[i], "-keyshares") == 0) option_keyshares = atoi(arg);
+    else if (strcmp(argv[i], "-seal-threads") == 0) option_seal_threads = atoi(arg);
+    else if (strcmp(argv[i], "-read-ahead") == 0) option_read_ahead = atoi(arg);
+    else if (strcmp(argv[i], "-cert") == 0) option_cert = arg;
+    else if (strcmp(argv[i], "-key") == 0) option_key = arg;
+    else if (strcmp(argv[i], "-CAFile") == 0) option_cafile = arg;
+    else { PrintUsage(); return 1; }
+    i++;
+  }
+
+  int mode;
+  if (strcmp(option_mode, "handshake") == 0) mode = MODE_HANDSHAKE;
+  else if (strcmp(option_mode, "bulk") == 0) mode = MODE_BULK;
+  else if (strcmp(option_mode, "engine") == 0) mode = MODE_ENGINE;
+  else if (strcmp(option_mode, "setup") == 0) mode = MODE_SETUP;
+  else { PrintUsage(); return 1; }
+
+  signal(SIGPIPE, SIG_IGN); // a failed peer shows up as a send error
+
+  if (option_memstats) {
+    FFI_mitls_enable_memory_stats(1);
+  }
+  if (!FFI_mitls_init()) {
+    printf("FFI_mitls_init() failed!\n");
+    return 2;
+  }
+  if (option_keyshares && (option_groups == NULL
+      || !FFI_mitls_configure_keyshare_pool(option_groups, option_keyshares))) {
+    printf("-keyshares requires -groups, with groups among P-256, P-384, P-521 and FFDHE*\n");
+    return 1;
+  }
+  if (option_seal_threads > 1 && !FFI_mitls_configure_seal_threads(option_seal_threads)) {
+    printf("FFI_mitls_configure_seal_threads(%d) failed\n", option_seal_threads);
+    return 1;
+  }
+
+  printf("TLS %s, %s mode", option_version, option_mode);
+  if (option_seal_threads > 1) {
+    printf(", %d sealing threads", option_seal_threads);
+  }
+  printf("\n%7s  %s\n", "threads", "throughput");
+  int r = 0;
+  for (int n = 1; n <= option_threads && !r; n = (n < option_threads && 2*n > option_threads) ? option_threads : 2*n) {
+    r = Run(n, mode);
+  }
+
+  FFI_mitls_cleanup();
+  return r;
+}
@@ -1,5 +1,6 @@
 #define __USE_MINGW_ANSI_STDIO 1
 #include <stdio.h>
+#include <stdlib.h>
 #include <memory.h>
 #include <unistd.h>
 #include <assert.h>
@@ -25,8 +26,10 @@
 // e.g. callbacks, printers, etc.
 #include "quic_common.c"
 
-void half_round(quic_state *my_state, quic_process_ctx *my_ctx, quic_process_ctx *peer_ctx, int *my_r, int *my_w, unsigned char *plain, unsigned char *cipher, size_t *plen, int is_server, int *my_ctr, int *peer_ctr)
+void half_round(connection_state *my_conn, quic_process_ctx *my_ctx, quic_process_ctx *peer_ctx, int *my_r, int *my_w, unsigned char *plain, unsigned char *cipher, size_t *plen, int is_server, int *my_ctr, int *peer_ctr)
 {
+  quic_state *my_state = my_conn->quic_state;
+
   if(*plen && *my_r >= 0)
   {
     quic_raw_key k;
@@ -52,10 +55,20 @@ void half_round(quic_state *my_state, quic_process_ctx *my_ctx, quic_process_ctx
   dump(my_ctx->input, my_ctx->input_len);
 
   size_t old_olen = my_ctx->output_len;
-  if(!FFI_mitls_quic_process(my_state, my_ctx))
+  for(;;)
   {
-    printf("[%c] Error %d returned.\n", is_server?'S':'C', my_ctx->tls_error);
-    exit(my_ctx->tls_error & 255);
+    if(!FFI_mitls_quic_process(my_state, my_ctx))
+    {
+      printf("[%c] Error %d returned.\n", is_server?'S':'C', my_ctx->tls_error);
+      exit(my_ctx->tls_error & 255);
+    }
+    if(!(my_ctx->flags & QFLAG_PENDING)) break;
+
+    // Nothing consumed or written: resume with the same input
+    printf("[%c] Suspended, completing the pending callback\n", is_server?'S':'C');
+    assert(my_ctx->consumed_bytes == 0 && my_ctx->output_len == 0);
+    complete_pending(my_conn);
+    my_ctx->output_len = old_olen;
   }
 
   printf("[%c] Epochs: %d read, %d write\n", is_server?'S':'C',
@@ -124,6 +137,8 @@ int main(int argc, char **argv)
       mode = handshake_0rtt_reject;
     if(!strcasecmp(argv[1], "hrr"))
       mode = handshake_stateless_retry;
+    if(!strcasecmp(argv[1], "async"))
+      mode = handshake_async;
   }
 
   // Server PKI configuration: one ECDSA certificate
@@ -210,9 +225,10 @@ int main(int argc, char **argv)
   reset_ctx(&cctx, &sctx, cbuf, sbuf, cmax, smax);
   
   // GENERIC HANDSHAKE TEST (NO 0RTT)
-  if (mode == handshake_simple)
+  // In async mode, every certificate callback suspends the handshake
+  if (mode == handshake_simple || mode == handshake_async)
   {
-    printf("\n     1-RTT HANDSHAKE TEST\n\n");
+    printf("\n     1-RTT HANDSHAKE TEST%s\n\n", mode == handshake_async ? " (ASYNC CALLBACKS)" : "");
 
     printf("[S] create\n");
     config.callback_state = &server;
@@ -222,6 +238,14 @@ int main(int argc, char **argv)
     printf("[C] create\n");
     config.callback_state = &client;
     assert(FFI_mitls_quic_create(&client.quic_state, &config));
+
+    if (mode == handshake_async)
+    {
+      assert(FFI_mitls_quic_configure_async_cert_callbacks(server.quic_state));
+      assert(FFI_mitls_quic_configure_async_cert_callbacks(client.quic_state));
+      server.async = 1;
+      client.async = 1;
+    }
       
     for(int i = 0, post_hs = 0; post_hs < 2 ; i++)
     {
@@ -231,13 +255,22 @@ int main(int argc, char **argv)
       printf("\n == Round %d ==\n\n", i);
 
       // Client half-round
-      half_round(client.quic_state, &cctx, &sctx, &cr, &cw, plain, cipher, &plen, 0, &cpn, &spn);
+      half_round(&client, &cctx, &sctx, &cr, &cw, plain, cipher, &plen, 0, &cpn, &spn);
 
       // Server half-round
-      half_round(server.quic_state, &sctx, &cctx, &sr, &sw, plain, cipher, &plen, 1, &spn, &cpn);
+      half_round(&server, &sctx, &cctx, &sr, &sw, plain, cipher, &plen, 1, &spn, &cpn);
 
       printf("\n == End round %d [CComplete=%d, SComplete=%d] ==\n\n", i, COMPLETE(cctx), COMPLETE(sctx));
     }
+
+    if (mode == handshake_async)
+    {
+      printf("Suspended: %d select, %d sign, %d verify\n",
+        server.suspended[pending_select], server.suspended[pending_sign], client.suspended[pending_verify]);
+      assert(server.suspended[pending_select] >= 1);
+      assert(server.suspended[pending_sign] >= 1);
+      assert(client.suspended[pending_verify] >= 1);
+    }
   }
   else if(mode == handshake_0rtt || mode == handshake_0rtt_reject)
   {
@@ -260,10 +293,10 @@ int main(int argc, char **argv)
       printf("\n == Round %d ==\n\n", i);
 
       // Client half-round
-      half_round(client.quic_state, &cctx, &sctx, &cr, &cw, plain, cipher, &plen, 0, &cpn, &spn);
+      half_round(&client, &cctx, &sctx, &cr, &cw, plain, cipher, &plen, 0, &cpn, &spn);
 
       // Server half-round
-      half_round(server.quic_state, &sctx, &cctx, &sr, &sw, plain, cipher, &plen, 1, &spn, &cpn);
+      half_round(&server, &sctx, &cctx, &sr, &sw, plain, cipher, &plen, 1, &spn, &cpn);
 
       if(COMPLETE(sctx)) FFI_mitls_quic_send_ticket(server.quic_state, "hello world", 11);
       printf("\n == End round %d [CComplete=%d, SComplete=%d] ==\n\n", i, COMPLETE(cctx), COMPLETE(sctx));
@@ -306,10 +339,10 @@ int main(int argc, char **argv)
       printf("\n == Round %d ==\n\n", i);
 
       // Client half-round
-      half_round(client.quic_state, &cctx, &sctx, &cr, &cw, plain, cipher, &plen, 0, &cpn, &spn);
+      half_round(&client, &cctx, &sctx, &cr, &cw, plain, cipher, &plen, 0, &cpn, &spn);
 
       // Server half-round
-      half_round(server.quic_state, &sctx, &cctx, &sr, &sw, plain, cipher, &plen, 1, &spn, &cpn);
+      half_round(&server, &sctx, &cctx, &sr, &sw, plain, cipher, &plen, 1, &spn, &cpn);
 
       printf("\n == End round %d [CComplete=%d, SComplete=%d] ==\n\n", i, COMPLETE(cctx), COMPLETE(sctx));
     }
@@ -3,14 +3,53 @@ typedef enum {
   handshake_simple,
   handshake_0rtt,
   handshake_0rtt_reject,
-  handshake_stateless_retry
+  handshake_stateless_retry,
+  handshake_async
 } hs_type;
 
+typedef enum {
+  pending_none,
+  pending_select,
+  pending_sign,
+  pending_verify
+} pending_op;
+
 typedef struct {
   quic_state *quic_state;
   mipki_state *pki;
+
+  // With async set, the certificate callbacks return pending, and
+  // complete_pending runs them once the connection is suspended
+  int async;
+  pending_op pending;
+  int suspended[pending_verify + 1]; // per callback
+
+  // Copies of the arguments of the pending callback
+  unsigned char *sni, *tbs, *chain, *sig;
+  size_t sni_len, tbs_len, chain_len, sig_len;
+  mitls_signature_scheme *sigalgs;
+  size_t sigalgs_len;
+  mitls_signature_scheme sigalg;
+  const void *cert;
 } connection_state;
 
+unsigned char *copy_arg(const unsigned char *b, size_t len)
+{
+  unsigned char *r = malloc(len ? len : 1);
+  assert(r != NULL);
+  if(len) memcpy(r, b, len);
+  return r;
+}
+
+void suspend(connection_state *state, pending_op op)
+{
+  assert(state->pending == pending_none);
+  printf(" ~~~~ Suspending the %s callback ~~~~\n",
+    op == pending_select ? "select" : op == pending_sign ? "sign" : "verify");
+  state->pending = op;
+  state->suspended[op]++;
+}
+
 void dump(const char *buffer, size_t len)
 {
   int i;
@@ -110,6 +149,15 @@ void ticket_cb(void *st, const char *sni, const mitls_ticket *ticket)
 void* certificate_select(void *cbs, mitls_version ver, const unsigned char *sni, size_t sni_len, const unsigned char *alpn, size_t alpn_len, const mitls_signature_scheme *sigalgs, size_t sigalgs_len, mitls_signature_scheme *selected)
 {
   connection_state *state = (connection_state*)cbs;
+  if(state->async)
+  {
+    state->sni = copy_arg(sni, sni_len);
+    state->sni_len = sni_len;
+    state->sigalgs = (mitls_signature_scheme*)copy_arg((const unsigned char*)sigalgs, sigalgs_len * sizeof(mitls_signature_scheme));
+    state->sigalgs_len = sigalgs_len;
+    suspend(state, pending_select);
+    return MITLS_SELECT_PENDING;
+  }
   mipki_chain r = mipki_select_certificate(state->pki, sni, sni_len, sigalgs, sigalgs_len, selected);
   return (void*)r;
 }
@@ -126,6 +174,16 @@ size_t certificate_sign(void *cbs, const void *cert_ptr, const mitls_signature_s
   connection_state *state = (connection_state*)cbs;
   size_t ret = MAX_SIGNATURE_LEN;
 
+  if(state->async)
+  {
+    state->cert = cert_ptr;
+    state->sigalg = sigalg;
+    state->tbs = copy_arg(tbs, tbs_len);
+    state->tbs_len = tbs_len;
+    suspend(state, pending_sign);
+    return MITLS_SIGN_PENDING;
+  }
+
   printf("======== TO BE SIGNED <%04x>: (%zd octets) ========\n", sigalg, tbs_len);
   dump(tbs, tbs_len);
   printf("===================================================\n");
@@ -139,6 +197,19 @@ size_t certificate_sign(void *cbs, const void *cert_ptr, const mitls_signature_s
 int certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len)
 {
   connection_state *state = (connection_state*)cbs;
+  if(state->async)
+  {
+    state->chain = copy_arg(chain_bytes, chain_len);
+    state->chain_len = chain_len;
+    state->sigalg = sigalg;
+    state->tbs = copy_arg(tbs, tbs_len);
+    state->tbs_len = tbs_len;
+    state->sig = copy_arg(sig, sig_len);
+    state->sig_len = sig_len;
+    suspend(state, pending_verify);
+    return MITLS_VERIFY_PENDING;
+  }
+
   mipki_chain chain = mipki_parse_chain(state->pki, chain_bytes, chain_len);
 
   if(chain == NULL)
@@ -164,3 +235,47 @@ int certificate_verify(void *cbs, const unsigned char* chain_bytes, size_t chain
   mipki_free_chain(state->pki, chain);
   return 1;
 }
+
+// Run the pending callback of a suspended connection, as the handshake
+// would have, and pass its result to the connection
+void complete_pending(connection_state *state)
+{
+  int async = state->async;
+  state->async = 0;
+
+  switch(state->pending)
+  {
+    case pending_select:
+    {
+      mitls_signature_scheme selected = 0;
+      void *cert = certificate_select(state, TLS_1p3, state->sni, state->sni_len, NULL, 0, state->sigalgs, state->sigalgs_len, &selected);
+      assert(FFI_mitls_quic_complete_select(state->quic_state, cert, selected));
+      free(state->sni);
+      free(state->sigalgs);
+      break;
+    }
+    case pending_sign:
+    {
+      unsigned char sig[MAX_SIGNATURE_LEN];
+      size_t sig_len = certificate_sign(state, state->cert, state->sigalg, state->tbs, state->tbs_len, sig);
+      assert(FFI_mitls_quic_complete_sign(state->quic_state, sig, sig_len));
+      free(state->tbs);
+      break;
+    }
+    case pending_verify:
+    {
+      int valid = certificate_verify(state, state->chain, state->chain_len, state->sigalg, state->tbs, state->tbs_len, state->sig, state->sig_len);
+      assert(FFI_mitls_quic_complete_verify(state->quic_state, valid));
+      free(state->chain);
+      free(state->tbs);
+      free(state->sig);
+      break;
+    }
+    default:
+      printf("ERROR: suspended without a pending callback\n");
+      exit(1);
+  }
+
+  state->pending = pending_none;
+  state->async = async;
+}
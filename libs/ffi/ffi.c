@@ -21,6 +21,7 @@
   MITLS_FFI_ENTRY(Config) \
   MITLS_FFI_ENTRY(SetTicketKey) \
   MITLS_FFI_ENTRY(SetSealingKey) \
+  MITLS_FFI_ENTRY(SessionCacheConfigure) \
   MITLS_FFI_ENTRY(SetCipherSuites) \
   MITLS_FFI_ENTRY(SetSignatureAlgorithms) \
   MITLS_FFI_ENTRY(SetNamedGroups) \
@@ -268,6 +269,31 @@ int MITLS_CALLCONV FFI_mitls_set_sealing_key(const char *alg, const unsigned cha
     return ret;
 }
 
+// The OCaml runtime system must be acquired before calling this
+static int ocaml_configure_session_cache(size_t capacity, uint32_t lifetime)
+{
+    int ret = 1;
+    CAMLparam0();
+    CAMLlocal1(r);
+    r = caml_callback2_exn(*g_mitls_FFI_SessionCacheConfigure, Val_long(capacity), Val_long(lifetime));
+    if (Is_exception_result(r)) {
+      report_caml_exception(r);
+      ret = 0;
+    }
+    CAMLreturnT(int, ret);
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_session_cache(size_t capacity, uint32_t lifetime)
+{
+    int ret;
+    caml_c_thread_register();
+    caml_acquire_runtime_system();
+    ret = ocaml_configure_session_cache(capacity, lifetime);
+    caml_release_runtime_system();
+    caml_c_thread_unregister();
+    return ret;
+}
+
 int MITLS_CALLCONV FFI_mitls_configure_cipher_suites(/* in */ mitls_state *state, const char * cs)
 {
     int ret;
@@ -12,6 +12,7 @@
 
 typedef struct mitls_state mitls_state;
 typedef struct quic_state quic_state;
+typedef struct mitls_config_template mitls_config_template;
 
 typedef struct {
   size_t ticket_len;
@@ -80,17 +81,31 @@ typedef mitls_nego_action (MITLS_CALLCONV *pfn_FFI_nego_cb)(void *cb_state, mitl
 #define MAX_SIGNATURE_LEN 8192
 // Select a certificate based on the given SNI and list of signatures.
 // Signature algorithms are represented as 16-bit integers using the TLS 1.3 RFC code points
+// Returns NULL if none fits, or MITLS_SELECT_PENDING (see FFI_mitls_configure_async_cert_callbacks)
 typedef void* (MITLS_CALLCONV *pfn_FFI_cert_select_cb)(void *cb_state, mitls_version ver, const unsigned char *sni, size_t sni_len, const unsigned char *alpn, size_t alpn_len, const mitls_signature_scheme *sigalgs, size_t sigalgs_len, mitls_signature_scheme *selected);
 // Write the certificate chain to buffer, returning the number of written bytes.
 // The chain should be written by prefixing each certificate by its length encoded over 3 bytes
 typedef size_t (MITLS_CALLCONV *pfn_FFI_cert_format_cb)(void *cb_state, const void *cert_ptr, unsigned char buffer[MAX_CHAIN_LEN]);
+// Optional replacement of format (see FFI_mitls_configure_cert_chain_callback): points certs and certs_len
+// to the DER certificates of the chain, leaf first, and returns their number. The certificates are used
+// in place, so they must not change, or be freed, while cert_ptr is in use
+typedef size_t (MITLS_CALLCONV *pfn_FFI_cert_chain_cb)(void *cb_state, const void *cert_ptr, const unsigned char *const **certs, const size_t **certs_len);
 // Tries to sign and write the signature to sig, returning the signature size or 0 if signature failed
+// or MITLS_SIGN_PENDING (see FFI_mitls_configure_async_cert_callbacks)
 typedef size_t (MITLS_CALLCONV *pfn_FFI_cert_sign_cb)(void *cb_state, const void *cert_ptr, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, unsigned char *sig);
 // Verifies that the chain (given in the same format as above) is valid, and that sig is a valid signature
 // of tbs for sigalg using the public key stored in the leaf of the chain.
+// Returns nonzero if valid, 0 if not, or MITLS_VERIFY_PENDING.
 // N.B. this function must validate the chain (including applcation checks such as hostname matching)
 typedef int (MITLS_CALLCONV *pfn_FFI_cert_verify_cb)(void *cb_state, const unsigned char* chain, size_t chain_len, const mitls_signature_scheme sigalg, const unsigned char *tbs, size_t tbs_len, const unsigned char *sig, size_t sig_len);
 
+// Returned by the select, sign and verify callbacks of a connection configured for
+// asynchronous certificate callbacks, to complete the operation later. The
+// arguments of the callback (sni, alpn, sigalgs, tbs, chain, sig) are only valid during the call.
+#define MITLS_SELECT_PENDING ((void*)-1)
+#define MITLS_SIGN_PENDING ((size_t)-1)
+#define MITLS_VERIFY_PENDING (-1)
+
 typedef struct {
   pfn_FFI_cert_select_cb select;
   pfn_FFI_cert_format_cb format;
@@ -100,6 +115,8 @@ typedef struct {
 
 // Functions exported from libmitls.dll
 //   Functions returning 'int' return 0 for failure, or nonzero for success
+//   Distinct connections may be used concurrently from distinct threads;
+//   calls on the same mitls_state or quic_state must be serialized by the caller
 
 // Redirect debug tracing to a callback function.  This is process-wide and can
 // be called before or after FFI_mitls_init().
@@ -136,6 +153,47 @@ extern int MITLS_CALLCONV FFI_mitls_configure_ticket_callback(mitls_state *state
 extern int MITLS_CALLCONV FFI_mitls_configure_nego_callback(mitls_state *state, void *cb_state, pfn_FFI_nego_cb nego_cb);
 extern int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(mitls_state *state, void *cb_state, mitls_cert_cb *cert_cb);
 
+// Call after FFI_mitls_configure_cert_callbacks to get the server chain from chain rather than
+// format: the handshake then references the certificates of the application instead of
+// formatting and parsing them again for every connection (e.g. mipki_get_chain_der).
+// Configure it before FFI_mitls_configure_template: it is then shared by the template
+extern int MITLS_CALLCONV FFI_mitls_configure_cert_chain_callback(mitls_state *state, pfn_FFI_cert_chain_cb chain);
+
+// Let the select, sign and verify callbacks of a connection driven by FFI_mitls_process
+// return MITLS_SELECT_PENDING, MITLS_SIGN_PENDING or MITLS_VERIFY_PENDING. The handshake is
+// then suspended: FFI_mitls_process returns with TFLAG_PENDING, and keeps returning it
+// until the result is passed to FFI_mitls_complete_select, _sign or _verify; the
+// next call to FFI_mitls_process resumes the handshake. Without this, and for
+// FFI_mitls_connect/accept_connected, a pending result is a failure.
+// Call before the first FFI_mitls_process. Each such connection has a stack of
+// its own for the handshake (256KB, of which little is committed). Not
+// supported in kernel mode, nor where makecontext is missing (e.g. musl).
+extern int MITLS_CALLCONV FFI_mitls_configure_async_cert_callbacks(mitls_state *state);
+
+// Complete the pending select callback: cert is NULL if no certificate fits, otherwise
+// selected is its signature scheme. Returns 0 if no select callback is pending
+extern int MITLS_CALLCONV FFI_mitls_complete_select(mitls_state *state, const void *cert, mitls_signature_scheme selected);
+
+// Complete the pending sign callback: sig_len is 0 if signing failed.
+// Returns 0 if no callback is pending, or sig_len exceeds MAX_SIGNATURE_LEN
+extern int MITLS_CALLCONV FFI_mitls_complete_sign(mitls_state *state, const unsigned char *sig, size_t sig_len);
+
+// Complete the pending verify callback: valid is nonzero if the chain and signature are valid.
+// Returns 0 if no callback is pending
+extern int MITLS_CALLCONV FFI_mitls_complete_verify(mitls_state *state, int valid);
+
+// Configuration templates: a configuration built once, then shared by any
+// number of connections, from any thread, without copying or re-parsing it.
+// Turn a configured mitls_state, not yet connected, into a template. The state
+// is consumed (and freed on failure)
+extern int MITLS_CALLCONV FFI_mitls_configure_template(/* out */ mitls_config_template **tmpl, /* in */ mitls_state *state);
+// Create a mitls_state from a template, in place of FFI_mitls_configure. host_name
+// replaces the template's, unless NULL. Further FFI_mitls_configure_* calls only
+// affect this state
+extern int MITLS_CALLCONV FFI_mitls_configure_from_template(/* out */ mitls_state **state, /* in */ mitls_config_template *tmpl, const char *host_name);
+// Release the caller's reference; the template is freed with the last connection created from it
+extern void MITLS_CALLCONV FFI_mitls_template_free(mitls_config_template *tmpl);
+
 // Close a miTLS session - either after configure or connect
 extern void MITLS_CALLCONV FFI_mitls_close(/* in */ mitls_state *state);
 
@@ -149,6 +207,14 @@ extern int MITLS_CALLCONV FFI_mitls_connect(void *send_recv_ctx, pfn_FFI_send ps
 // Act as a TLS server to a client
 extern int MITLS_CALLCONV FFI_mitls_accept_connected(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state);
 
+// Call before FFI_mitls_connect/accept_connected to read ahead: the recv
+// callback is then asked for up to len bytes at a time (e.g. 65536) and may
+// return fewer, rather than being asked for exactly each record header and
+// body. The records received in one call are processed without further
+// callbacks. Bytes read past the end of the TLS stream are dropped.
+// 0 (the default) disables read-ahead. Returns 0 once connected
+extern int MITLS_CALLCONV FFI_mitls_configure_read_ahead(/* in */ mitls_state *state, size_t len);
+
 // Get the exporter secret (set early to true for the early exporter secret). Returns 1 if a secret was written
 extern int MITLS_CALLCONV FFI_mitls_get_exporter(/* in */ mitls_state *state, int early, /* out */ mitls_secret *secret);
 
@@ -159,13 +225,152 @@ extern void *MITLS_CALLCONV FFI_mitls_get_cert(/* in */ mitls_state *state, /* o
 // Returns -1 for failure, or a TCP packet to be sent then freed with FFI_mitls_free()
 extern int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned char *buffer, size_t buffer_size);
 
-// Receive a message
+typedef struct {
+  const unsigned char *base;
+  size_t len;
+} mitls_iovec;
+
+#define MITLS_SEND_MORE 0x01 // more data follows: keep the last records until the next send
+
+// Send a message gathered from iovcnt buffers, filling records across buffer
+// boundaries and handing them to the send callback in as few calls as possible.
+// Returns 0 for failure, nonzero for success
+extern int MITLS_CALLCONV FFI_mitls_sendv(/* in */ mitls_state *state, const mitls_iovec *iov, size_t iovcnt, int flags);
+
+// Keep the records written by FFI_mitls_send* until FFI_mitls_uncork, then
+// send them in one call; once 64KB are kept, they are sent. Calls nest; corked records are also sent before the
+// connection waits for input. Handshakes are corked internally, so that each
+// flight is sent in one call.
+extern void MITLS_CALLCONV FFI_mitls_cork(/* in */ mitls_state *state);
+
+// Returns 0 for failure (the corked records could not be sent), nonzero for success
+extern int MITLS_CALLCONV FFI_mitls_uncork(/* in */ mitls_state *state);
+
+// Receive a message; the rest of a record partly returned by
+// FFI_mitls_receive_into comes first.
 // Returns NULL for failure, a plaintext packet to be freed with FFI_mitls_free_packet()
 extern unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /* out */ size_t *packet_size);
 
+// Receive application data into a caller-supplied buffer, with no allocation.
+// A record larger than buffer_size is returned across several calls.
+// *received is 0 once the peer has closed the connection.
+// Returns 0 for failure (a fatal alert), nonzero for success
+extern int MITLS_CALLCONV FFI_mitls_receive_into(/* in */ mitls_state *state, unsigned char *buffer, size_t buffer_size, /* out */ size_t *received);
+
 // Free a packet returned FFI_mitls_*() family of APIs
 extern void MITLS_CALLCONV FFI_mitls_free(/* in */ mitls_state *state, void* pv);
 
+typedef struct {
+  size_t current_bytes;       // bytes currently allocated
+  size_t peak_bytes;          // max value of current_bytes
+  size_t total_bytes;         // total of all allocations
+  size_t allocation_count;    // count of allocations made
+  size_t free_count;          // count of frees made
+  size_t allocation_failures; // count of allocation fails due to OOM
+} mitls_memory_stats;
+
+// Keep memory statistics for the connections created from now on (or stop),
+// and for global allocations. Call before FFI_mitls_init() to count global
+// allocations from the start.
+extern void MITLS_CALLCONV FFI_mitls_enable_memory_stats(int enable);
+
+// Get the memory statistics of a connection, or if state is NULL, the totals of
+// the process. Returns 0 if statistics were not enabled when state was created
+extern int MITLS_CALLCONV FFI_mitls_get_memory_stats(/* in */ mitls_state *state, /* out */ mitls_memory_stats *stats);
+
+typedef struct {
+  uint64_t hits;         // lookups that found a live entry
+  uint64_t misses;       // lookups that did not, including expired entries
+  uint64_t insertions;   // entries added or replaced
+  uint64_t evictions;    // least recently used entries dropped when full
+  uint64_t expirations;  // entries dropped after their lifetime
+  size_t entries;        // entries currently cached
+} mitls_session_cache_stats;
+
+// Bound the process-wide caches of TLS 1.3 tickets (by server name, for clients),
+// of the PSKs of these tickets (by ticket) and of TLS 1.2 sessions (by ticket or
+// session ID) used for resumption: at most capacity entries each, dropped
+// lifetime seconds after insertion. Capacity 0 disables the caches; lifetime
+// must not be 0. The defaults are 10000 entries and 24 hours.
+// The caches are emptied. Returns 0 for failure, nonzero for success
+extern int MITLS_CALLCONV FFI_mitls_configure_session_cache(size_t capacity, uint32_t lifetime);
+
+// Get the counters of the caches; any pointer may be NULL
+extern int MITLS_CALLCONV FFI_mitls_get_session_cache_stats(/* out */ mitls_session_cache_stats *tickets, /* out */ mitls_session_cache_stats *ticket_psks, /* out */ mitls_session_cache_stats *sessions12);
+
+typedef struct {
+  uint32_t depth;        // configured depth, 0 if the pool is disabled
+  uint32_t available;    // key pairs currently in the pool
+  uint64_t hits;         // key generations served from the pool
+  uint64_t misses;       // key generations done inline, with the pool empty
+  uint64_t generated;    // key pairs generated by the refill thread
+} mitls_keyshare_pool_stats;
+
+// Keep up to depth pre-generated key pairs for each of a colon-separated list
+// of groups, as for FFI_mitls_configure_named_groups, refilled by a background
+// thread; 0 disables the pools. Only P-256, P-384, P-521 and the FFDHE groups,
+// which are much slower to generate than X25519, are supported.
+// Returns 0 for failure (an unsupported group), nonzero for success
+extern int MITLS_CALLCONV FFI_mitls_configure_keyshare_pool(const char *groups, uint32_t depth);
+
+// Get the counters of the pool of one group. Returns 0 for an unsupported group
+extern int MITLS_CALLCONV FFI_mitls_get_keyshare_pool_stats(const char *group, /* out */ mitls_keyshare_pool_stats *stats);
+
+// Seal the records of large sends on TLS 1.3 connections with this many
+// threads, the calling thread included: the records of one FFI_mitls_send
+// get consecutive sequence numbers up front, are encrypted in parallel, and
+// are sent in order. The threads are shared by all connections; a send that
+// finds them busy seals its records on its own thread. 0 or 1 (the default)
+// disables the pool. Returns 0 for failure, nonzero for success
+extern int MITLS_CALLCONV FFI_mitls_configure_seal_threads(uint32_t threads);
+
+/*************************************************************************
+* Non-blocking TLS API
+*
+* Instead of calling back into the host for I/O, a connection created with
+* FFI_mitls_engine_connect or FFI_mitls_engine_accept (after configuring
+* it with FFI_mitls_configure_*) is driven by FFI_mitls_process: the host
+* passes the ciphertext it received and collects the ciphertext to send
+* and the application data received. FFI_mitls_send may be used once
+* TFLAG_COMPLETE is set; its output is queued and collected by the next
+* call to FFI_mitls_process.
+**************************************************************************/
+
+#define TFLAG_COMPLETE 0x01   // the handshake is complete, FFI_mitls_send may be used
+#define TFLAG_WANT_READ 0x02  // all input was processed, call again when more is received
+#define TFLAG_WANT_WRITE 0x04 // more output is queued (to_be_written), call again to collect it
+#define TFLAG_DATA 0x08       // application data was written to *plaintext
+#define TFLAG_CLOSED 0x10     // the connection is closed, by the peer or by a fatal alert
+#define TFLAG_PENDING 0x20    // a certificate callback is pending, see FFI_mitls_configure_async_cert_callbacks
+
+typedef struct {
+  // Inputs
+  const unsigned char *input; // can be NULL, ciphertext received from the peer
+  size_t input_len; // Size of input buffer (can be 0)
+  unsigned char *output; // can be NULL, a buffer to store ciphertext to send to the peer
+  unsigned char *plaintext; // can be NULL, a buffer to store received application data
+
+  // Input/Output
+  size_t output_len; // In: size of output buffer (can be 0), Out: bytes written to output
+  size_t plaintext_len; // In: size of plaintext buffer (can be 0), Out: bytes written to plaintext
+
+  // Outputs
+  uint16_t tls_error; // alert code of a fatal TLS alert, sent or received
+  size_t consumed_bytes; // how many bytes of the input have been processed - leftover bytes must be passed to the next call
+  size_t to_be_written; // how many bytes of output are left (after writing *output)
+  uint16_t flags; // Bitfield of return flags (see above)
+} mitls_process_ctx;
+
+// Create a non-blocking connection on a configured state; nothing is sent until FFI_mitls_process
+extern int MITLS_CALLCONV FFI_mitls_engine_connect(/* in */ mitls_state *state);
+extern int MITLS_CALLCONV FFI_mitls_engine_accept(/* in */ mitls_state *state);
+
+// Process input and collect output. Stops after delivering one application data record
+// (or the part of it that fits in *plaintext): call again, with the leftover input,
+// until TFLAG_WANT_READ is set. Returns 0 on a fatal error, with tls_error set; the
+// output then carries the alert to be sent.
+extern int MITLS_CALLCONV FFI_mitls_process(/* in */ mitls_state *state, mitls_process_ctx *ctx);
+
 /*************************************************************************
 * QUIC API
 **************************************************************************/
@@ -224,6 +429,7 @@ typedef struct {
 #define QFLAG_APPLICATION_KEY 0x02
 #define QFLAG_POST_HANDSHAKE 0x04
 #define QFLAG_REJECTED_0RTT 0x10
+#define QFLAG_PENDING 0x20 // a certificate callback is pending, see FFI_mitls_quic_configure_async_cert_callbacks
 
 typedef struct {
   // Inputs
@@ -249,10 +455,25 @@ typedef enum {
   QUIC_Reader = 1      
 } quic_direction;
 
-// Creates a new connection state
+// Creates a new connection state. The ticket key of cfg, if any, replaces the global
+// ticket key, unless it is already the last one set by FFI_mitls_quic_create or _template
 extern int MITLS_CALLCONV FFI_mitls_quic_create(quic_state **state, const quic_config *cfg);
+
+// Build a template from cfg, then create connections from it (see FFI_mitls_configure_template).
+// The ticket key, if any, is set once by FFI_mitls_quic_template. host_name replaces cfg->host_name, unless NULL
+extern int MITLS_CALLCONV FFI_mitls_quic_template(/* out */ mitls_config_template **tmpl, const quic_config *cfg);
+extern int MITLS_CALLCONV FFI_mitls_quic_create_from_template(quic_state **state, mitls_config_template *tmpl, const char *host_name);
 extern int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *state, quic_process_ctx *ctx);
 
+// As FFI_mitls_configure_async_cert_callbacks, for a QUIC connection: call before
+// the first FFI_mitls_quic_process. While QFLAG_PENDING is set, nothing is consumed
+// or written; once completed, call FFI_mitls_quic_process again with the same input
+// and an output buffer at least as large, to resume the handshake.
+extern int MITLS_CALLCONV FFI_mitls_quic_configure_async_cert_callbacks(quic_state *state);
+extern int MITLS_CALLCONV FFI_mitls_quic_complete_select(quic_state *state, const void *cert, mitls_signature_scheme selected);
+extern int MITLS_CALLCONV FFI_mitls_quic_complete_sign(quic_state *state, const unsigned char *sig, size_t sig_len);
+extern int MITLS_CALLCONV FFI_mitls_quic_complete_verify(quic_state *state, int valid);
+
 // get_record_secrets can be called after the complete flag is set
 extern int MITLS_CALLCONV FFI_mitls_quic_get_record_key(quic_state *state, quic_raw_key *key, int32_t epoch, quic_direction rw);
 extern int MITLS_CALLCONV FFI_mitls_quic_get_record_secrets(quic_state *state, quic_secret *crs, quic_secret *srs);
@@ -260,6 +481,9 @@ extern int MITLS_CALLCONV FFI_mitls_quic_get_record_secrets(quic_state *state, q
 // Can be called after handshake completes to send a new ticket. Additional ticket data can be read back with get_hello_summary
 extern int MITLS_CALLCONV FFI_mitls_quic_send_ticket(quic_state *state, const unsigned char *ticket_data, size_t ticket_data_len);
 
+// Same as FFI_mitls_get_memory_stats, for a QUIC connection
+extern int MITLS_CALLCONV FFI_mitls_quic_get_memory_stats(quic_state *state, /* out */ mitls_memory_stats *stats);
+
 // N.B. *cookie and *ticket_data must be freed with FFI_mitls_global_free as they are allocated in the global region
 extern int MITLS_CALLCONV FFI_mitls_get_hello_summary(const unsigned char *buffer, size_t buffer_len, int has_record, mitls_hello_summary *summary, unsigned char **cookie, size_t *cookie_len, unsigned char **ticket_data, size_t *ticket_data_len);
 
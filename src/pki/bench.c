@@ -0,0 +1,180 @@
+// Signatures per second of mipki, by key type:
+//
+//   bench.exe [-threads N] [-seconds S] [-batch B]
+//
+// For each key and signature algorithm, N threads sign a TLS 1.3
+// CertificateVerify-sized buffer for S seconds, one mipki_sign_verify
+// per signature, then B signatures per mipki_sign_batch.
+//
+// POSIX only (pthreads).
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mipki.h"
+
+static int option_threads = 1;
+static double option_seconds = 2;
+static int option_batch = 16;
+
+typedef struct {
+  const char *name;
+  const char *cert_file;
+  const char *key_file;
+  mipki_signature sigalg;
+} bench_case;
+
+static const bench_case cases[] = {
+  { "RSA-2048 rsa_pkcs1_sha256", "../../data/server.crt", "../../data/server.key", 0x0401 },
+  { "RSA-2048 rsa_pss_sha256", "../../data/server.crt", "../../data/server.key", 0x0804 },
+  { "P-256 ecdsa_secp256r1_sha256", "../../data/server-ecdsa.crt", "../../data/server-ecdsa.key", 0x0403 },
+};
+
+#define TBS_LEN 130 // 64 spaces, the context string, a SHA-256 hash
+#define SIG_LEN 8192
+
+typedef struct {
+  mipki_state *pki;
+  mipki_chain chain;
+  mipki_signature sigalg;
+  int batch; // 0 for mipki_sign_verify
+  long count;
+  int failed;
+} bench_thread;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run(void *arg)
+{
+  bench_thread *t = (bench_thread*)arg;
+  int n = t->batch ? t->batch : 1;
+  char tbs[TBS_LEN];
+  const char **tbs_list = malloc(n * sizeof(char*));
+  size_t *tbs_len = malloc(n * sizeof(size_t));
+  char **sig = malloc(n * sizeof(char*));
+  size_t *sig_len = malloc(n * sizeof(size_t));
+
+  memset(tbs, ' ', sizeof(tbs));
+  for(int i = 0; i < n; i++)
+  {
+    tbs_list[i] = tbs;
+    tbs_len[i] = sizeof(tbs);
+    sig[i] = malloc(SIG_LEN);
+  }
+
+  double end = now() + option_seconds;
+  while(now() < end && !t->failed)
+  {
+    for(int i = 0; i < n; i++) sig_len[i] = SIG_LEN;
+
+    if(t->batch)
+    {
+      if(mipki_sign_batch(t->pki, t->chain, t->sigalg, tbs_list, tbs_len, sig, sig_len, n) != (size_t)n)
+        t->failed = 1;
+    }
+    else if(!mipki_sign_verify(t->pki, t->chain, t->sigalg, tbs, sizeof(tbs), sig[0], &sig_len[0], MIPKI_SIGN))
+    {
+      t->failed = 1;
+    }
+    t->count += n;
+  }
+
+  // Check the last signature
+  if(!t->failed && !mipki_sign_verify(t->pki, t->chain, t->sigalg, tbs, sizeof(tbs), sig[n-1], &sig_len[n-1], MIPKI_VERIFY))
+    t->failed = 1;
+
+  for(int i = 0; i < n; i++) free(sig[i]);
+  free(tbs_list);
+  free(tbs_len);
+  free(sig);
+  free(sig_len);
+  return NULL;
+}
+
+static int bench(const bench_case *c, int batch)
+{
+  mipki_config_entry config = { .cert_file = c->cert_file, .key_file = c->key_file, .is_universal = 1 };
+  int erridx;
+  mipki_state *pki = mipki_init(&config, 1, NULL, &erridx);
+  mipki_signature selected;
+
+  if(!pki)
+  {
+    printf("%s: failed to load %s\n", c->name, c->key_file);
+    return 0;
+  }
+
+  mipki_chain chain = mipki_select_certificate(pki, "localhost", 9, &c->sigalg, 1, &selected);
+  if(!chain)
+  {
+    printf("%s: the key does not support %04x\n", c->name, c->sigalg);
+    mipki_free(pki);
+    return 0;
+  }
+
+  bench_thread *t = calloc(option_threads, sizeof(bench_thread));
+  pthread_t *tid = malloc(option_threads * sizeof(pthread_t));
+  long total = 0;
+  int failed = 0;
+
+  double start = now();
+  for(int i = 0; i < option_threads; i++)
+  {
+    t[i].pki = pki;
+    t[i].chain = chain;
+    t[i].sigalg = c->sigalg;
+    t[i].batch = batch;
+    pthread_create(&tid[i], NULL, run, &t[i]);
+  }
+  for(int i = 0; i < option_threads; i++)
+  {
+    pthread_join(tid[i], NULL);
+    total += t[i].count;
+    failed |= t[i].failed;
+  }
+  double elapsed = now() - start;
+
+  if(batch)
+    printf("%-30s %2d threads, batches of %-3d %10.0f signatures/s%s\n", c->name, option_threads, batch, total / elapsed, failed ? " FAILED" : "");
+  else
+    printf("%-30s %2d threads, one at a time   %10.0f signatures/s%s\n", c->name, option_threads, total / elapsed, failed ? " FAILED" : "");
+
+  free(t);
+  free(tid);
+  mipki_free(pki);
+  return !failed;
+}
+
+int main(int argc, char **argv)
+{
+  int ok = 1;
+
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strcmp(argv[i], "-threads") && i + 1 < argc) option_threads = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-seconds") && i + 1 < argc) option_seconds = atof(argv[++i]);
+    else if(!strcmp(argv[i], "-batch") && i + 1 < argc) option_batch = atoi(argv[++i]);
+    else
+    {
+      printf("Usage: %s [-threads N] [-seconds S] [-batch B]\n", argv[0]);
+      return 1;
+    }
+  }
+  if(option_threads < 1) option_threads = 1;
+  if(option_batch < 1) option_batch = 1;
+
+  for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+  {
+    ok &= bench(&cases[i], 0);
+    ok &= bench(&cases[i], option_batch);
+  }
+  return ok ? 0 : 1;
+}
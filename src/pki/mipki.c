@@ -10,8 +10,28 @@
 
 #ifndef NO_OPENSSL
 
+#if defined(_WIN32)
+  #define WIN32_LEAN_AND_MEAN // before OpenSSL: wincrypt.h redefines X509_NAME
+  #include <windows.h>
+  typedef CRITICAL_SECTION pki_lock;
+  #define PKI_LOCK_INIT(l)    InitializeCriticalSection(l)
+  #define PKI_LOCK(l)         EnterCriticalSection(l)
+  #define PKI_UNLOCK(l)       LeaveCriticalSection(l)
+  #define PKI_LOCK_DESTROY(l) DeleteCriticalSection(l)
+#else
+  #include <pthread.h>
+  typedef pthread_mutex_t pki_lock;
+  #define PKI_LOCK_INIT(l)    pthread_mutex_init(l, NULL)
+  #define PKI_LOCK(l)         pthread_mutex_lock(l)
+  #define PKI_UNLOCK(l)       pthread_mutex_unlock(l)
+  #define PKI_LOCK_DESTROY(l) pthread_mutex_destroy(l)
+#endif
+
+#include <ctype.h>
+#include <time.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
+#include <openssl/sha.h>
 #include <openssl/x509v3.h>
 
 #include "mipki.h"
@@ -34,8 +54,30 @@ Certificate selection first matches the SNI against the names in the certificate
 then looks at the supported signature algorithms and tries to pick one compatible
 with the private key.
 
+Signing and verifying with a configured key reuse contexts prepared once
+per (certificate, signature algorithm, mode): each holds the key, digest
+and padding settings, and is copied into a working context for each
+operation. Idle contexts are kept in a free list per certificate, so that
+concurrent threads each take one of their own.
+
 */
 
+// The signature algorithms of set_digest, see sigalg_slot
+#define SIGALG_SLOTS 13
+
+// Idle prepared contexts kept per (certificate, algorithm, mode): about
+// the number of threads signing with the same key at the same time
+#define MAX_IDLE_CTX 64
+
+// Signature schemes usable with one key: at most 9, for RSA
+#define MAX_SCHEMES 9
+
+typedef struct prepared_ctx {
+  struct prepared_ctx *next;
+  EVP_MD_CTX *prepared; // NULL for an ephemeral chain, used once
+  EVP_MD_CTX *work;
+} prepared_ctx;
+
 // The parsed representation of chains and private keys
 typedef struct {
   X509* endpoint;
@@ -43,12 +85,63 @@ typedef struct {
   EVP_PKEY* key;
   int is_universal;
   int is_ephemeral;
+
+  // The DER encodings of the endpoint then the intermediates, see get_der
+  char *der;
+  const char **der_certs;
+  size_t *der_lens;
+  size_t der_count;
+
+  // Configured entries only
+  mipki_signature schemes[MAX_SCHEMES]; // supported by the key, see key_schemes
+  size_t schemes_len;
+  pki_lock lock;
+  prepared_ctx *idle[2][SIGALG_SLOTS]; // by mipki_mode and sigalg_slot
+  size_t idle_count[2][SIGALG_SLOTS];
 } config_entry;
 
+#define CHAIN_CACHE_DEFAULT_CAPACITY 1024
+#define CHAIN_CACHE_DEFAULT_LIFETIME 3600 // seconds
+#define NEGATIVE_LIFETIME 60              // seconds, for failed validations
+
+typedef struct chain_result chain_result;
+
+typedef struct {
+  pki_lock lock;
+  chain_result **buckets; // allocated at the first insertion
+  size_t bucket_mask;
+  chain_result *newest, *oldest;
+  size_t count;
+  size_t capacity;        // 0 if disabled
+  time_t lifetime;
+  uint64_t generation;    // of the trust store
+  uint64_t hits, misses;
+} chain_cache;
+
+// A host name of a configured certificate, see build_index
+typedef struct name_entry {
+  struct name_entry *chain; // next in the hash bucket
+  uint64_t hash;
+  size_t index;             // in mipki_state.config
+  char name[];              // lower case
+} name_entry;
+
+typedef struct {
+  name_entry **buckets;
+  size_t bucket_mask;
+} name_index;
+
 typedef struct mipki_state {
   X509_STORE *store;
   config_entry *config; // Flat array
   size_t config_len;
+  chain_cache chain_cache;
+
+  // Built by mipki_init, read-only afterwards
+  name_index exact;     // by DNS name
+  name_index wildcard;  // by the suffix of wildcard names, after the first label
+  size_t *universal;    // indexes of the universal entries, increasing
+  size_t universal_len;
 } mipki_state;
 
 #if DEBUG
@@ -104,6 +197,229 @@ int password_cb(char *buf, int size, int rwflag, void *p)
   return s->cb(buf, size, s->info);
 }
 
+// Encode the chain once: configured entries at mipki_init, ephemeral
+// ones (owned by a single connection) at their first use
+static int encode_chain(config_entry *cfg)
+{
+  size_t count = 1 + sk_X509_num(cfg->intermediates), total = 0;
+
+  for(size_t i = 0; i < count; i++)
+  {
+    X509 *x509 = i ? sk_X509_value(cfg->intermediates, i - 1) : cfg->endpoint;
+    int len = i2d_X509(x509, NULL);
+    if(len <= 0) return 0;
+    total += len;
+  }
+
+  char *der = malloc(total);
+  const char **certs = malloc(count * sizeof(char*));
+  size_t *lens = malloc(count * sizeof(size_t));
+  if(!der || !certs || !lens)
+  {
+    free(der);
+    free(certs);
+    free(lens);
+    return 0;
+  }
+
+  unsigned char *cur = (unsigned char*)der;
+  for(size_t i = 0; i < count; i++)
+  {
+    X509 *x509 = i ? sk_X509_value(cfg->intermediates, i - 1) : cfg->endpoint;
+    certs[i] = (const char*)cur;
+    lens[i] = i2d_X509(x509, &cur); // advances cur
+  }
+
+  cfg->der = der;
+  cfg->der_certs = certs;
+  cfg->der_lens = lens;
+  cfg->der_count = count;
+  return 1;
+}
+
+static int get_der(config_entry *cfg)
+{
+  return cfg->der != NULL || (cfg->is_ephemeral && encode_chain(cfg));
+}
+
+static void free_der(config_entry *cfg)
+{
+  free(cfg->der);
+  free(cfg->der_certs);
+  free(cfg->der_lens);
+}
+
+/*
+ Index of the configured certificates, for mipki_select_certificate.
+
+ Each DNS name of a certificate (its subjectAltName DNS entries, or else
+ the common names of its subject, as for X509_check_host) is added to one
+ of two hash tables: names with a wildcard in their first label by the
+ rest of the name ("*.example.com" under "example.com"), other names as
+ they are. A server name is looked up in the first table as it is, and
+ in the second without its first label; the candidates are then checked
+ with X509_check_host, so that the index only needs to be complete.
+
+ The index is built once all certificates are loaded and never modified:
+ the certificates of a mipki_state are fixed, so it is shared by all
+ threads without a lock.
+*/
+
+// The name may not be NUL-terminated; ASCII case-insensitive
+static uint64_t name_hash(const char *name, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+  for(size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)tolower((unsigned char)name[i])) * 0x100000001b3ULL;
+  return h;
+}
+
+static int name_equal(const char *lower, const char *name, size_t len)
+{
+  for(size_t i = 0; i < len; i++)
+    if(!lower[i] || lower[i] != tolower((unsigned char)name[i]))
+      return 0;
+  return !lower[len];
+}
+
+static int index_add(name_index *ix, const char *name, size_t len, size_t index)
+{
+  name_entry *e = malloc(sizeof(name_entry) + len + 1);
+  if(!e) return 0;
+
+  for(size_t i = 0; i < len; i++)
+    e->name[i] = tolower((unsigned char)name[i]);
+  e->name[len] = 0;
+  e->hash = name_hash(name, len);
+  e->index = index;
+  e->chain = ix->buckets[e->hash & ix->bucket_mask];
+  ix->buckets[e->hash & ix->bucket_mask] = e;
+  return 1;
+}
+
+// Add one name of the certificate at index
+static int index_name(mipki_state *st, const char *name, size_t len, size_t index)
+{
+  const char *dot = memchr(name, '.', len);
+  if(len == 0 || memchr(name, 0, len)) return 1; // never matched
+
+  #if DEBUG
+  printf(" - Indexing <%.*s> for certificate %zu\n", (int)len, name, index);
+  #endif
+
+  if(dot && memchr(name, '*', dot - name))
+    return index_add(&st->wildcard, dot + 1, len - (dot + 1 - name), index);
+  return index_add(&st->exact, name, len, index);
+}
+
+static int index_certificate(mipki_state *st, size_t index)
+{
+  X509 *x509 = st->config[index].endpoint;
+  GENERAL_NAMES *gens = X509_get_ext_d2i(x509, NID_subject_alt_name, NULL, NULL);
+  int ok = 1, dns = 0;
+
+  for(int i = 0; ok && i < sk_GENERAL_NAME_num(gens); i++)
+  {
+    GENERAL_NAME *gen = sk_GENERAL_NAME_value(gens, i);
+    if(gen->type != GEN_DNS) continue;
+    dns = 1;
+    ok = index_name(st, (const char*)ASN1_STRING_get0_data(gen->d.dNSName),
+      ASN1_STRING_length(gen->d.dNSName), index);
+  }
+  GENERAL_NAMES_free(gens);
+
+  // X509_check_host only uses the subject without DNS names
+  X509_NAME *subject = X509_get_subject_name(x509);
+  for(int j = -1; ok && !dns && (j = X509_NAME_get_index_by_NID(subject, NID_commonName, j)) >= 0; )
+  {
+    unsigned char *cn;
+    int len = ASN1_STRING_to_UTF8(&cn, X509_NAME_ENTRY_get_data(X509_NAME_get_entry(subject, j)));
+    if(len < 0) continue;
+    ok = index_name(st, (const char*)cn, len, index);
+    OPENSSL_free(cn);
+  }
+  return ok;
+}
+
+// The signature schemes of the TLS code points accepted for a key, as
+// tested by mipki_select_certificate before it was indexed
+static void key_schemes(config_entry *cfg)
+{
+  static const mipki_signature rsa[] = { 0x0804, 0x0805, 0x0806, 0x0201, 0x0301, 0x0401, 0x0501, 0x0601, 0xFFFF };
+  int curve;
+
+  cfg->schemes_len = 0;
+  switch(EVP_PKEY_type(EVP_PKEY_id(cfg->key)))
+  {
+    case EVP_PKEY_RSA:
+      memcpy(cfg->schemes, rsa, sizeof(rsa));
+      cfg->schemes_len = sizeof(rsa) / sizeof(rsa[0]);
+      break;
+
+    case EVP_PKEY_ED25519:
+      cfg->schemes[cfg->schemes_len++] = 0x0807;
+      break;
+
+    case EVP_PKEY_EC:
+      curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(cfg->key)));
+      if(curve == NID_X9_62_prime256v1) cfg->schemes[cfg->schemes_len++] = 0x0403;
+      if(curve == NID_secp384r1) cfg->schemes[cfg->schemes_len++] = 0x0503;
+      if(curve == NID_secp521r1) cfg->schemes[cfg->schemes_len++] = 0x0603;
+      cfg->schemes[cfg->schemes_len++] = 0x0203;
+      break;
+  }
+}
+
+static int index_init(name_index *ix, size_t count)
+{
+  size_t n = 1;
+  while(n < 2 * count) n <<= 1;
+  ix->buckets = calloc(n, sizeof(name_entry*));
+  ix->bucket_mask = n - 1;
+  return ix->buckets != NULL;
+}
+
+static void index_free(name_index *ix)
+{
+  if(!ix->buckets) return;
+  for(size_t i = 0; i <= ix->bucket_mask; i++)
+    while(ix->buckets[i])
+    {
+      name_entry *e = ix->buckets[i];
+      ix->buckets[i] = e->chain;
+      free(e);
+    }
+  free(ix->buckets);
+  ix->buckets = NULL;
+}
+
+static int build_index(mipki_state *st)
+{
+  if(!index_init(&st->exact, st->config_len) ||
+     !index_init(&st->wildcard, st->config_len) ||
+     !(st->universal = malloc((st->config_len + 1) * sizeof(size_t))))
+    return 0;
+
+  for(size_t i = 0; i < st->config_len; i++)
+  {
+    key_schemes(st->config + i);
+    if(st->config[i].is_universal)
+      st->universal[st->universal_len++] = i;
+    else if(!index_certificate(st, i))
+      return 0;
+  }
+  return 1;
+}
+
+static void flush_cache(chain_cache *c);
+
+static void free_prepared_ctx(prepared_ctx *p)
+{
+  EVP_MD_CTX_free(p->prepared);
+  EVP_MD_CTX_free(p->work);
+  free(p);
+}
+
 void MITLS_CALLCONV mipki_free(mipki_state *st)
 {
   if(!st) return;
@@ -111,11 +427,27 @@ void MITLS_CALLCONV mipki_free(mipki_state *st)
   for(size_t i=0; i<st->config_len; i++)
   {
     config_entry *cfg = st->config + i;
+    for(int m = 0; m < 2; m++)
+      for(int j = 0; j < SIGALG_SLOTS; j++)
+        while(cfg->idle[m][j])
+        {
+          prepared_ctx *p = cfg->idle[m][j];
+          cfg->idle[m][j] = p->next;
+          free_prepared_ctx(p);
+        }
+    PKI_LOCK_DESTROY(&cfg->lock);
+    free_der(cfg);
     X509_free(cfg->endpoint);
     EVP_PKEY_free(cfg->key);
     sk_X509_pop_free(cfg->intermediates, X509_free);
   }
 
+  index_free(&st->exact);
+  index_free(&st->wildcard);
+  free(st->universal);
+  flush_cache(&st->chain_cache);
+  free(st->chain_cache.buckets);
+  PKI_LOCK_DESTROY(&st->chain_cache.lock);
   free(st->config);
   X509_STORE_free(st->store);
   free(st);
@@ -137,6 +469,14 @@ mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t
   st->store = store;
   st->config = c;
   st->config_len = 0;
+  memset(&st->chain_cache, 0, sizeof(st->chain_cache));
+  PKI_LOCK_INIT(&st->chain_cache.lock);
+  st->chain_cache.capacity = CHAIN_CACHE_DEFAULT_CAPACITY;
+  st->chain_cache.lifetime = CHAIN_CACHE_DEFAULT_LIFETIME;
+  memset(&st->exact, 0, sizeof(st->exact));
+  memset(&st->wildcard, 0, sizeof(st->wildcard));
+  st->universal = NULL;
+  st->universal_len = 0;
 
   for(size_t i = 0; i < config_len; i++)
   {
@@ -182,12 +522,30 @@ mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t
         sk_X509_push(chain, x509);
       }
     }
+    BIO_free(bio);
 
     st->config_len++;
     cfg->intermediates = chain;
     cfg->key = sk;
     cfg->is_universal = cur->is_universal;
     cfg->is_ephemeral = 0;
+    cfg->der = NULL;
+    PKI_LOCK_INIT(&cfg->lock);
+    memset(cfg->idle, 0, sizeof(cfg->idle));
+    memset(cfg->idle_count, 0, sizeof(cfg->idle_count));
+
+    if(!encode_chain(cfg))
+    {
+      mipki_free(st);
+      return NULL;
+    }
+  }
+
+  *erridx = -1;
+  if(!build_index(st))
+  {
+    mipki_free(st);
+    return NULL;
   }
 
   return st;
@@ -205,17 +563,71 @@ int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_f
     return 0;
   }
 
+  int r;
   if(S_ISDIR(sb.st_mode)) {
     #if DEBUG
     printf("Adding %s as a root store directory.\n", ca_file);
     #endif
-    return X509_STORE_load_locations(st->store, NULL, ca_file);
+    r = X509_STORE_load_locations(st->store, NULL, ca_file);
+  } else {
+    #if DEBUG
+    printf("Adding %s as a root store file.\n", ca_file);
+    #endif
+    r = X509_STORE_load_locations(st->store, ca_file, NULL);
   }
 
+  // Validation results may change with the new roots
+  PKI_LOCK(&st->chain_cache.lock);
+  st->chain_cache.generation++;
+  flush_cache(&st->chain_cache);
+  PKI_UNLOCK(&st->chain_cache.lock);
+  return r;
+}
+
+// The first of algs supported by the key of cfg, or 0
+static mipki_signature select_scheme(const config_entry *cfg, const mipki_signature *algs, size_t algs_len)
+{
+  for(size_t j = 0; j < algs_len; j++)
+    for(size_t k = 0; k < cfg->schemes_len; k++)
+      if(algs[j] == cfg->schemes[k])
+        return algs[j];
+  return 0;
+}
+
+// Keep the candidate at index if it comes before *best, matches the
+// server name, and supports one of algs
+static void select_candidate(mipki_state *st, size_t index, int check, const char *sni, size_t sni_len,
+  const mipki_signature *algs, size_t algs_len, size_t *best, mipki_signature *selected)
+{
+  config_entry *cfg = st->config + index;
+  mipki_signature alg;
+
+  if(index >= *best) return;
+
   #if DEBUG
-  printf("Adding %s as a root store file.\n", ca_file);
+    char buf[256];
+    X509_NAME_oneline(X509_get_subject_name(cfg->endpoint), buf, 256);
+    printf(" - Testing certificate: %s\n", buf);
   #endif
-  return X509_STORE_load_locations(st->store, ca_file, NULL);
+
+  // Server-side hostname validation to match wildcards, SAN, etc
+  if(check && X509_check_host(cfg->endpoint, sni, sni_len, 0, NULL) != 1) return;
+  if(!(alg = select_scheme(cfg, algs, algs_len))) return;
+
+  #if DEBUG
+    printf(" + Certificate %zu is suitable with alg=%04x\n", index, alg);
+  #endif
+  *best = index;
+  *selected = alg;
+}
+
+static void select_named(mipki_state *st, name_index *ix, const char *name, size_t len, const char *sni, size_t sni_len,
+  const mipki_signature *algs, size_t algs_len, size_t *best, mipki_signature *selected)
+{
+  uint64_t h = name_hash(name, len);
+  for(name_entry *e = ix->buckets[h & ix->bucket_mask]; e; e = e->chain)
+    if(e->hash == h && name_equal(e->name, name, len))
+      select_candidate(st, e->index, 1, sni, sni_len, algs, algs_len, best, selected);
 }
 
 mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char *sni, size_t sni_len, const mipki_signature *algs, size_t algs_len, mipki_signature *selected)
@@ -232,90 +644,29 @@ mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char
     free(sni_str);
   #endif
 
-  for(size_t i = 0; i < st->config_len; i++)
-  {
-    config_entry *cfg = st->config + i;
-
-    #if DEBUG
-      char buf[256];
-      char *peername = NULL;
-      char **peer = &peername;
-      X509_NAME_oneline(X509_get_subject_name(cfg->endpoint), buf, 256);
-      printf(" - Testing certificate: %s\n", buf);
-    #else
-      char **peer = NULL; // save memory
-    #endif
-
-    // Server-side hostname validation to match wildcards, SAN, etc
-    if(cfg->is_universal || X509_check_host(cfg->endpoint, sni, sni_len, 0, peer))
-    {
-      #if DEBUG
-      printf(" - Positive match for <%s>\n", peername);
-      OPENSSL_free(peername);
-      #endif
-
-      int curve, kt = EVP_PKEY_type(EVP_PKEY_id(cfg->key));
-      *selected = 0;
-
-      #if DEBUG
-        switch(kt){
-          case EVP_PKEY_RSA:     printf(" - RSA key\n"); break;
-          case EVP_PKEY_EC:      printf(" - ECDSA key\n"); break;
-          case EVP_PKEY_ED25519: printf(" - EdDSA-25519 key\n"); break;
-        }
-      #endif
-
-      for(size_t j = 0; j < algs_len; j++)
-      {
-        mipki_signature alg = algs[j];
-        uint8_t low = algs[j] & 0xFF;
-        uint8_t high = algs[j] >> 8;
-
-        #if DEBUG
-        printf(" - Testing if <%02x,%02x> is suitable\n", high, low);
-        #endif
+  // The first configured certificate that matches, as the candidates
+  // may come in any order
+  size_t best = st->config_len;
+  *selected = 0;
 
-        switch(kt)
-        {
-          case EVP_PKEY_RSA:
-            if((high == 8 && (low == 4 || low == 5 || low == 6)) || // RSA_PSS
-               (low == 1 && high >= 2 && high <= 6) ||
-               (low == 0xFF && high == 0xFF)) // RSA_PKCS1
-              *selected = alg;
-            break;
-
-          case EVP_PKEY_ED25519:
-            if(high == 8 && low == 7)
-              *selected = alg;
-            break;
-
-          case EVP_PKEY_EC:
-            curve = EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(cfg->key)));
-            if((curve == NID_X9_62_prime256v1 && high == 4 && low == 3) ||
-               (curve == NID_secp384r1 && high == 5 && low == 3) ||
-               (curve == NID_secp521r1 && high == 6 && low == 3) ||
-               (high == 2 && low == 3))
-              *selected = alg;
-            break;
-        }
+  for(size_t i = 0; i < st->universal_len; i++)
+    select_candidate(st, st->universal[i], 0, sni, sni_len, algs, algs_len, &best, selected);
 
-        if(*selected)
-        {
-          #if DEBUG
-            printf(" + Certificate selected with alg=%04x\n", *selected);
-          #endif
-          break;
-        }
-      }
+  // As X509_check_host, ignore one trailing dot
+  size_t len = sni_len;
+  if(len > 1 && sni[len - 1] == '.') len--;
 
-      if(*selected)
-        return (void*)cfg;
-    }
+  if(len > 0)
+  {
+    const char *dot = memchr(sni, '.', len);
+    select_named(st, &st->exact, sni, len, sni, sni_len, algs, algs_len, &best, selected);
+    if(dot)
+      select_named(st, &st->wildcard, dot + 1, len - (dot + 1 - sni), sni, sni_len, algs, algs_len, &best, selected);
   }
 
-  *selected = 0;
-  return NULL;
+  return best < st->config_len ? (mipki_chain)(st->config + best) : NULL;
 }
+
 /*
 int EVP_DigestSignInit(EVP_MD_CTX *ctx, EVP_PKEY_CTX **pctx,
                        const EVP_MD *type, ENGINE *e, EVP_PKEY *pkey);
@@ -376,63 +727,33 @@ static int set_digest(mipki_signature sigalg, DIGEST* md)
 
 typedef int (*pfn_init)(EVP_MD_CTX *ctx, EVP_PKEY_CTX **pctx, const EVP_MD *type, ENGINE *e, EVP_PKEY *pkey);
 
-int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t *sig_len, mipki_mode mode)
+// The index of a signature algorithm of set_digest, or -1
+static int sigalg_slot(mipki_signature sigalg)
 {
-  assert(st != NULL);
-  config_entry *cfg = (config_entry*)cert_ptr;
-  int ret = 0;
-
-  #if DEBUG
-    if(mode == MIPKI_SIGN) {
-      printf("Signing %d bytes of data with %04x\n", tbs_len, sigalg);
-      printf("--- TBS ----\n");
-      dump(tbs, tbs_len);
-      printf("------------\n");
-    } else {
-      printf("Verifying a %d bytes signature of %d bytes of data with %04x\n", *sig_len, tbs_len, sigalg);
-      printf("--- TBS ----\n");
-      dump(tbs, tbs_len);
-      printf("--- SIG ----\n");
-      dump(sig, *sig_len);
-      printf("------------\n");
-    }
-  #endif
-
-  // Special case: MD5+SHA1 signature
-  // we use a different signing interface
-  if(sigalg == 0xffff)
+  switch(sigalg)
   {
-    RSA *rsa = EVP_PKEY_get0_RSA(cfg->key); // doesn't copy, no free
-    unsigned int slen = (unsigned int)*sig_len;
-    if(!rsa) return 0;
-
-    if(mode == MIPKI_SIGN)
-    {
-      if (RSA_sign(NID_md5_sha1, tbs, tbs_len, sig, &slen, rsa) != 1) {
-        #if DEBUG
-          unsigned long err = ERR_peek_last_error();
-          char* err_string = ERR_error_string(err, NULL);
-          printf("RSA MD5_SHA1 signing error: %s\n", err_string);
-        #endif
-        return 0;
-      }
-      *sig_len = slen;
-      #if DEBUG
-      printf("--- SIG ----\n");
-      dump(sig, slen);
-      printf("------------\n");
-      #endif
-      return 1;
-    }
-    else
-    {
-      return RSA_verify(NID_md5_sha1, tbs, tbs_len, sig, slen, rsa);
-    }
+    case 0x0401: return 0;  // rsa_pkcs1_sha256
+    case 0x0501: return 1;  // rsa_pkcs1_sha384
+    case 0x0601: return 2;  // rsa_pkcs1_sha512
+    case 0x0804: return 3;  // rsa_pss_sha256
+    case 0x0805: return 4;  // rsa_pss_sha384
+    case 0x0806: return 5;  // rsa_pss_sha512
+    case 0x0403: return 6;  // ecdsa_secp256r1_sha256
+    case 0x0503: return 7;  // ecdsa_secp384r1_sha384
+    case 0x0603: return 8;  // ecdsa_secp521r1_sha512
+    case 0x0203: return 9;  // ecdsa_sha1
+    case 0x0201: return 10; // rsa_pkcs1_sha1
+    case 0x0807: return 11; // ed25519
+    case 0x0808: return 12; // ed448
   }
+  return -1;
+}
 
+// Initialize ctx for signing or verifying with the key of cfg
+static int init_ctx(EVP_MD_CTX *ctx, config_entry *cfg, const mipki_signature sigalg, mipki_mode mode)
+{
   EVP_PKEY_CTX* key_ctx = NULL;
   DIGEST md = NULL;
-  EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
 
   int kt = EVP_PKEY_type(EVP_PKEY_id(cfg->key));
   if(!set_digest(sigalg, &md)) return 0;
@@ -442,7 +763,7 @@ int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr
   #endif
 
   pfn_init init = (mode == MIPKI_SIGN ? EVP_DigestSignInit : EVP_DigestVerifyInit);
-  if(init(md_ctx, &key_ctx, md, NULL, cfg->key) != 1)
+  if(init(ctx, &key_ctx, md, NULL, cfg->key) != 1)
   {
     #if DEBUG
       printf("mipki_sign_verify: failed to initialize DigestSign\n");
@@ -472,9 +793,160 @@ int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr
     }
   }
 
+  return 1;
+}
+
+// Take an idle prepared context of cfg, or make one
+static prepared_ctx* get_ctx(config_entry *cfg, const mipki_signature sigalg, mipki_mode mode)
+{
+  int slot = sigalg_slot(sigalg);
+  prepared_ctx *p = NULL;
+
+  if(slot < 0) return NULL;
+
+  if(!cfg->is_ephemeral)
+  {
+    PKI_LOCK(&cfg->lock);
+    p = cfg->idle[mode][slot];
+    if(p)
+    {
+      cfg->idle[mode][slot] = p->next;
+      cfg->idle_count[mode][slot]--;
+    }
+    PKI_UNLOCK(&cfg->lock);
+    if(p) return p;
+  }
+
+  p = malloc(sizeof(prepared_ctx));
+  if(!p) return NULL;
+  p->next = NULL;
+  p->prepared = NULL;
+  p->work = EVP_MD_CTX_new();
+
+  if(!cfg->is_ephemeral)
+  {
+    p->prepared = EVP_MD_CTX_new();
+    if(p->prepared && !init_ctx(p->prepared, cfg, sigalg, mode))
+    {
+      EVP_MD_CTX_free(p->prepared);
+      p->prepared = NULL;
+    }
+    if(!p->prepared)
+    {
+      free_prepared_ctx(p);
+      return NULL;
+    }
+  }
+
+  if(!p->work)
+  {
+    free_prepared_ctx(p);
+    return NULL;
+  }
+  return p;
+}
+
+// Give back a context taken by get_ctx
+static void put_ctx(config_entry *cfg, const mipki_signature sigalg, mipki_mode mode, prepared_ctx *p)
+{
+  int slot = sigalg_slot(sigalg);
+
+  if(!cfg->is_ephemeral)
+  {
+    PKI_LOCK(&cfg->lock);
+    if(cfg->idle_count[mode][slot] < MAX_IDLE_CTX)
+    {
+      p->next = cfg->idle[mode][slot];
+      cfg->idle[mode][slot] = p;
+      cfg->idle_count[mode][slot]++;
+      p = NULL;
+    }
+    PKI_UNLOCK(&cfg->lock);
+  }
+
+  if(p) free_prepared_ctx(p);
+}
+
+// Reset the working context of p for a new operation
+static int start_ctx(prepared_ctx *p, config_entry *cfg, const mipki_signature sigalg, mipki_mode mode)
+{
+  // Not all keys support copying a context (e.g. EdDSA before OpenSSL 3)
+  if(p->prepared && EVP_MD_CTX_copy_ex(p->work, p->prepared) == 1)
+    return 1;
+
+  EVP_MD_CTX_reset(p->work);
+  return init_ctx(p->work, cfg, sigalg, mode);
+}
+
+// RSA signature of an MD5+SHA1 hash, with a different signing interface
+static int sign_verify_md5_sha1(config_entry *cfg, const char *tbs, size_t tbs_len, char *sig, size_t *sig_len, mipki_mode mode)
+{
+  RSA *rsa = EVP_PKEY_get0_RSA(cfg->key); // doesn't copy, no free
+  unsigned int slen = (unsigned int)*sig_len;
+  if(!rsa) return 0;
+
   if(mode == MIPKI_SIGN)
   {
-    ret = EVP_DigestSign(md_ctx, sig, sig_len, tbs, tbs_len);
+    if (RSA_sign(NID_md5_sha1, (const unsigned char*)tbs, tbs_len, (unsigned char*)sig, &slen, rsa) != 1) {
+      #if DEBUG
+        unsigned long err = ERR_peek_last_error();
+        char* err_string = ERR_error_string(err, NULL);
+        printf("RSA MD5_SHA1 signing error: %s\n", err_string);
+      #endif
+      return 0;
+    }
+    *sig_len = slen;
+    #if DEBUG
+    printf("--- SIG ----\n");
+    dump(sig, slen);
+    printf("------------\n");
+    #endif
+    return 1;
+  }
+  else
+  {
+    return RSA_verify(NID_md5_sha1, (const unsigned char*)tbs, tbs_len, (const unsigned char*)sig, slen, rsa);
+  }
+}
+
+int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t *sig_len, mipki_mode mode)
+{
+  assert(st != NULL);
+  config_entry *cfg = (config_entry*)cert_ptr;
+  int ret = 0;
+
+  #if DEBUG
+    if(mode == MIPKI_SIGN) {
+      printf("Signing %d bytes of data with %04x\n", tbs_len, sigalg);
+      printf("--- TBS ----\n");
+      dump(tbs, tbs_len);
+      printf("------------\n");
+    } else {
+      printf("Verifying a %d bytes signature of %d bytes of data with %04x\n", *sig_len, tbs_len, sigalg);
+      printf("--- TBS ----\n");
+      dump(tbs, tbs_len);
+      printf("--- SIG ----\n");
+      dump(sig, *sig_len);
+      printf("------------\n");
+    }
+  #endif
+
+  // Special case: MD5+SHA1 signature
+  if(sigalg == 0xffff)
+    return sign_verify_md5_sha1(cfg, tbs, tbs_len, sig, sig_len, mode);
+
+  prepared_ctx *p = get_ctx(cfg, sigalg, mode);
+  if(!p) return 0;
+
+  if(!start_ctx(p, cfg, sigalg, mode))
+  {
+    put_ctx(cfg, sigalg, mode, p);
+    return 0;
+  }
+
+  if(mode == MIPKI_SIGN)
+  {
+    ret = EVP_DigestSign(p->work, (unsigned char*)sig, sig_len, (const unsigned char*)tbs, tbs_len);
     #if DEBUG
     if(ret != 1) {
       unsigned long err = ERR_peek_last_error();
@@ -489,7 +961,7 @@ int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr
   }
   else // MIPKI_VERIFY
   {
-    ret = EVP_DigestVerify(md_ctx, sig, *sig_len, tbs, tbs_len);
+    ret = EVP_DigestVerify(p->work, (const unsigned char*)sig, *sig_len, (const unsigned char*)tbs, tbs_len);
     #if DEBUG
     if(ret != 1) {
       unsigned long err = ERR_peek_last_error();
@@ -499,10 +971,44 @@ int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr
     #endif
   }
 
-  EVP_MD_CTX_free(md_ctx);
+  put_ctx(cfg, sigalg, mode, p);
   return (ret == 1);
 }
 
+size_t MITLS_CALLCONV mipki_sign_batch(mipki_state *st, const mipki_chain cert_ptr, const mipki_signature sigalg, const char **tbs, const size_t *tbs_len, char **sig, size_t *sig_len, size_t count)
+{
+  assert(st != NULL);
+  config_entry *cfg = (config_entry*)cert_ptr;
+  prepared_ctx *p = NULL;
+  size_t signed_count = 0;
+
+  if(sigalg != 0xffff)
+  {
+    p = get_ctx(cfg, sigalg, MIPKI_SIGN);
+    if(!p)
+    {
+      for(size_t i = 0; i < count; i++) sig_len[i] = 0;
+      return 0;
+    }
+  }
+
+  for(size_t i = 0; i < count; i++)
+  {
+    int ok;
+    if(!p)
+      ok = sign_verify_md5_sha1(cfg, tbs[i], tbs_len[i], sig[i], &sig_len[i], MIPKI_SIGN);
+    else
+      ok = start_ctx(p, cfg, sigalg, MIPKI_SIGN) &&
+        EVP_DigestSign(p->work, (unsigned char*)sig[i], &sig_len[i], (const unsigned char*)tbs[i], tbs_len[i]) == 1;
+
+    if(ok) signed_count++;
+    else sig_len[i] = 0;
+  }
+
+  if(p) put_ctx(cfg, sigalg, MIPKI_SIGN, p);
+  return signed_count;
+}
+
 mipki_chain MITLS_CALLCONV mipki_parse_chain(mipki_state *st, const char *chain, size_t chain_len)
 {
   const char *cur = chain;
@@ -626,52 +1132,53 @@ mipki_chain MITLS_CALLCONV mipki_parse_list(mipki_state *st, const char **certs,
     return NULL;
 }
 
+size_t MITLS_CALLCONV mipki_get_chain_der(mipki_state *st, mipki_chain chain, const char *const **certs, const size_t **certs_len)
+{
+  assert(st != NULL);
+  config_entry *cfg = (config_entry*)chain;
+
+  if(!get_der(cfg)) return 0;
+  *certs = cfg->der_certs;
+  *certs_len = cfg->der_lens;
+  return cfg->der_count;
+}
+
 size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chain, char *buffer, size_t buffer_len)
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
   char *cur = buffer;
   char *end = buffer + buffer_len;
-  sk_X509_insert(cfg->intermediates, cfg->endpoint, 0);
 
   #if DEBUG
     printf("Formatting the selected certificate chain.\n");
   #endif
 
-  for(int i = 0; i < sk_X509_num(cfg->intermediates); i++)
+  if(!get_der(cfg))
   {
-    unsigned char *buf = NULL;
-    X509 *x509 = sk_X509_value(cfg->intermediates, i);
-
     #if DEBUG
-      char nb[256];
-      X509_NAME_oneline(X509_get_subject_name(x509), nb, 256);
-      printf(" - Adding: %s\n", nb);
+      printf("mipki_format_chain: i2d_X509 failed.\n");
     #endif
+    return 0;
+  }
 
-    int len = i2d_X509(x509, &buf);
-    if (len <= 0 || buf == NULL || cur + len + 3 > end)
-    {
-      #if DEBUG
-        printf("mipki_format_chain: i2d_X509 failed.\n");
-      #endif
-      sk_X509_shift(cfg->intermediates);
+  for(size_t i = 0; i < cfg->der_count; i++)
+  {
+    size_t len = cfg->der_lens[i];
+    if(end - cur < 3 || len > (size_t)(end - cur - 3))
       return 0;
-    }
 
     *(cur++) = (len >> 16) & 0xFF;
     *(cur++) = (len >> 8) & 0xFF;
     *(cur++) = len & 0xFF;
-    memcpy(cur, buf, len);
+    memcpy(cur, cfg->der_certs[i], len);
     cur += len;
-    OPENSSL_free(buf);
   }
 
   #if DEBUG
     printf("Written %d bytes to chain buffer:\n", cur-buffer);
     dump(buffer, cur - buffer);
   #endif
-  sk_X509_shift(cfg->intermediates);
   return (cur - buffer);
 }
 
@@ -679,31 +1186,21 @@ void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void*
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
-  sk_X509_insert(cfg->intermediates, cfg->endpoint, 0);
   void* list = init;
 
   #if DEBUG
     printf("Formatting the selected certificate chain.\n");
   #endif
 
-  for(int i = 0; i < sk_X509_num(cfg->intermediates); i++)
-  {
-    unsigned char *buf = NULL;
-    X509 *x509 = sk_X509_value(cfg->intermediates, i);
-
-    #if DEBUG
-      char nb[256];
-      X509_NAME_oneline(X509_get_subject_name(x509), nb, 256);
-      printf(" - Adding: %s\n", nb);
-    #endif
+  if(!get_der(cfg)) return;
 
-    size_t len = i2d_X509(x509, NULL);
-    list = cb(list, len, (char**)&buf);
+  for(size_t i = 0; i < cfg->der_count; i++)
+  {
+    char *buf = NULL;
+    list = cb(list, cfg->der_lens[i], &buf);
     assert(buf != NULL);
-    i2d_X509(x509, &buf);
+    memcpy(buf, cfg->der_certs[i], cfg->der_lens[i]);
   }
-
-  sk_X509_shift(cfg->intermediates);
 }
 
 #if DEBUG
@@ -728,18 +1225,251 @@ static void print_stack(STACK_OF(X509)* sk)
 }
 #endif
 
+/*
+ Cache of chain validation results, keyed by the SHA-256 of the DER
+ certificates of the chain and the host name, for the current generation
+ of the trust store. A result is kept for at most the configured lifetime
+ (a failure for at most NEGATIVE_LIFETIME) and never past the expiry of a
+ certificate of the chain. The cache is emptied, and its generation
+ bumped, when a root is added: a validation that started before cannot
+ insert its result.
+*/
+
+typedef struct chain_result {
+  struct chain_result *chain;         // next in the hash bucket
+  struct chain_result *newer, *older; // LRU list
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  time_t expires;
+  int verdict;
+  char host[];
+} chain_result;
+
+static uint64_t bucket_hash(const uint8_t *hash, const char *host)
+{
+  uint64_t h = 0;
+  memcpy(&h, hash, sizeof(h));
+  for(const char *p = host; *p; p++)
+    h = (h ^ (uint8_t)*p) * 0x100000001b3ULL; // FNV-1a
+  return h;
+}
+
+// Called with the cache lock held
+static void unlink_result(chain_cache *c, chain_result *e, uint64_t h)
+{
+  chain_result **p = &c->buckets[h & c->bucket_mask];
+  while(*p != e) p = &(*p)->chain;
+  *p = e->chain;
+
+  if(e->newer) e->newer->older = e->older; else c->newest = e->older;
+  if(e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+  c->count--;
+  free(e);
+}
+
+// Called with the cache lock held
+static void flush_cache(chain_cache *c)
+{
+  while(c->oldest)
+    unlink_result(c, c->oldest, bucket_hash(c->oldest->hash, c->oldest->host));
+}
+
+static chain_result* find_result(chain_cache *c, const uint8_t *hash, const char *host, uint64_t h)
+{
+  if(!c->buckets) return NULL;
+  for(chain_result *e = c->buckets[h & c->bucket_mask]; e; e = e->chain)
+    if(!memcmp(e->hash, hash, sizeof(e->hash)) && !strcmp(e->host, host))
+      return e;
+  return NULL;
+}
+
+// The hash of the DER encoding of every certificate of cfg
+static int chain_hash(config_entry *cfg, uint8_t hash[SHA256_DIGEST_LENGTH])
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len;
+  int ok = 1;
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+  if(!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+    ok = 0;
+
+  for(int i = -1; ok && i < sk_X509_num(cfg->intermediates); i++)
+  {
+    X509 *x509 = (i < 0) ? cfg->endpoint : sk_X509_value(cfg->intermediates, i);
+    ok = X509_digest(x509, EVP_sha256(), md, &md_len) == 1 &&
+      EVP_DigestUpdate(ctx, md, md_len) == 1;
+  }
+
+  if(ok) ok = EVP_DigestFinal_ex(ctx, hash, NULL) == 1;
+  EVP_MD_CTX_free(ctx);
+  return ok;
+}
+
+// Seconds until the first certificate of cfg expires, capped by max
+static time_t chain_lifetime(config_entry *cfg, time_t max)
+{
+  time_t lifetime = max;
+
+  for(int i = -1; i < sk_X509_num(cfg->intermediates); i++)
+  {
+    X509 *x509 = (i < 0) ? cfg->endpoint : sk_X509_value(cfg->intermediates, i);
+    int days, secs;
+    if(!ASN1_TIME_diff(&days, &secs, NULL, X509_get0_notAfter(x509)))
+      return 0;
+    if(days < 0 || secs < 0)
+      return 0;
+    if((time_t)days * 86400 + secs < lifetime)
+      lifetime = (time_t)days * 86400 + secs;
+  }
+  return lifetime;
+}
+
+static int cached_result(mipki_state *st, const uint8_t *hash, const char *host, int *verdict)
+{
+  chain_cache *c = &st->chain_cache;
+  uint64_t h = bucket_hash(hash, host);
+  int found = 0;
+
+  PKI_LOCK(&c->lock);
+  chain_result *e = find_result(c, hash, host, h);
+  if(e && e->expires <= time(NULL))
+  {
+    unlink_result(c, e, h);
+    e = NULL;
+  }
+  if(e)
+  {
+    if(e->newer)
+    {
+      // Move to the head of the LRU list
+      e->newer->older = e->older;
+      if(e->older) e->older->newer = e->newer; else c->oldest = e->newer;
+      e->newer = NULL;
+      e->older = c->newest;
+      c->newest->newer = e;
+      c->newest = e;
+    }
+    *verdict = e->verdict;
+    found = 1;
+    c->hits++;
+  }
+  else if(c->capacity)
+  {
+    c->misses++;
+  }
+  PKI_UNLOCK(&c->lock);
+  return found;
+}
+
+static void cache_result(mipki_state *st, config_entry *cfg, const uint8_t *hash, const char *host, uint64_t generation, int verdict)
+{
+  chain_cache *c = &st->chain_cache;
+  uint64_t h = bucket_hash(hash, host);
+  size_t host_len = strlen(host);
+  chain_result *e = malloc(sizeof(chain_result) + host_len + 1);
+  if(!e) return; // caching is best-effort
+
+  memcpy(e->hash, hash, sizeof(e->hash));
+  memcpy(e->host, host, host_len + 1);
+  e->verdict = verdict;
+  time_t lifetime = chain_lifetime(cfg, verdict == 1 ? (time_t)UINT32_MAX : NEGATIVE_LIFETIME);
+
+  PKI_LOCK(&c->lock);
+  if(lifetime > c->lifetime) lifetime = c->lifetime;
+  if(c->capacity == 0 || generation != c->generation || lifetime <= 0)
+  {
+    PKI_UNLOCK(&c->lock);
+    free(e);
+    return;
+  }
+  e->expires = time(NULL) + lifetime;
+
+  if(!c->buckets)
+  {
+    size_t n = 1;
+    while(n < c->capacity) n <<= 1;
+    c->buckets = calloc(n, sizeof(chain_result*));
+    if(!c->buckets)
+    {
+      PKI_UNLOCK(&c->lock);
+      free(e);
+      return;
+    }
+    c->bucket_mask = n - 1;
+  }
+
+  chain_result *old = find_result(c, hash, host, h);
+  if(old) unlink_result(c, old, h);
+  while(c->oldest && c->count >= c->capacity)
+    unlink_result(c, c->oldest, bucket_hash(c->oldest->hash, c->oldest->host));
+
+  e->chain = c->buckets[h & c->bucket_mask];
+  c->buckets[h & c->bucket_mask] = e;
+  e->newer = NULL;
+  e->older = c->newest;
+  if(c->newest) c->newest->newer = e; else c->oldest = e;
+  c->newest = e;
+  c->count++;
+  PKI_UNLOCK(&c->lock);
+}
+
+void MITLS_CALLCONV mipki_configure_chain_cache(mipki_state *st, size_t capacity, uint32_t lifetime)
+{
+  assert(st != NULL);
+  chain_cache *c = &st->chain_cache;
+
+  PKI_LOCK(&c->lock);
+  flush_cache(c);
+  free(c->buckets);
+  c->buckets = NULL;
+  c->capacity = capacity;
+  if(lifetime) c->lifetime = lifetime;
+  PKI_UNLOCK(&c->lock);
+}
+
+void MITLS_CALLCONV mipki_get_chain_cache_stats(mipki_state *st, mipki_chain_cache_stats *stats)
+{
+  assert(st != NULL);
+  chain_cache *c = &st->chain_cache;
+
+  PKI_LOCK(&c->lock);
+  stats->hits = c->hits;
+  stats->misses = c->misses;
+  stats->entries = c->count;
+  PKI_UNLOCK(&c->lock);
+}
+
 int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain, const char *host)
 {
   assert(st != NULL);
   config_entry *cfg = (config_entry*)chain;
-  X509_STORE_CTX *ctx = X509_STORE_CTX_new();
-  X509_VERIFY_PARAM *param = X509_VERIFY_PARAM_new();
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+  int r = 0;
+
+  if(host == NULL) host = "";
+
+  // Read before validating: see cache_result
+  PKI_LOCK(&st->chain_cache.lock);
+  uint64_t generation = st->chain_cache.generation;
+  int use_cache = st->chain_cache.capacity != 0;
+  PKI_UNLOCK(&st->chain_cache.lock);
 
-  if(!ctx || !param)
+  use_cache = use_cache && chain_hash(cfg, hash);
+  if(use_cache && cached_result(st, hash, host, &r))
+  {
+    #if DEBUG
+      printf("mipki_validate_chain<%s>: cached result %d\n", host, r);
+    #endif
+    return r;
+  }
+
+  X509_STORE_CTX *ctx = X509_STORE_CTX_new();
+  if(!ctx || !X509_STORE_CTX_init(ctx, st->store, cfg->endpoint, cfg->intermediates))
   {
     #if DEBUG
     printf("mipki_validate_chain: failed to initialize certificate validation context");
     #endif
+    X509_STORE_CTX_free(ctx);
     return 0;
   }
 
@@ -754,19 +1484,20 @@ int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain
   //flags |= X509_V_FLAG_CRL_CHECK;
   //flags |= X509_V_FLAG_USE_DELTAS;
 
+  // The parameters of this validation only: the store is shared by all threads
+  X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(ctx);
   X509_VERIFY_PARAM_set_flags(param, flags);
   X509_VERIFY_PARAM_set1_host(param, host, 0);
-  X509_STORE_set1_param(st->store, param);
-  X509_STORE_CTX_init(ctx, st->store, cfg->endpoint, cfg->intermediates);
 
-  int r = X509_verify_cert(ctx);
+  r = X509_verify_cert(ctx);
   #if DEBUG
     const char *err = X509_verify_cert_error_string(X509_STORE_CTX_get_error(ctx));
     printf("mipki_validate_chain = %d [%s]\n", r, err);
   #endif
 
   X509_STORE_CTX_free(ctx);
-  X509_VERIFY_PARAM_free(param);
+  if(use_cache && r >= 0)
+    cache_result(st, cfg, hash, host, generation, r);
   return r;
 }
 
@@ -776,6 +1507,7 @@ void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain)
   config_entry *cfg = (config_entry*)chain;
   if(cfg == NULL || !cfg->is_ephemeral) return;
 
+  free_der(cfg);
   X509_free(cfg->endpoint);
   EVP_PKEY_free(cfg->key);
   sk_X509_pop_free(cfg->intermediates, X509_free);
@@ -799,11 +1531,15 @@ mipki_state* MITLS_CALLCONV mipki_init(const mipki_config_entry config[], size_t
 int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_file) { D(); return 0; }
 mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char *sni, size_t sni_len, const mipki_signature *algs, size_t algs_len, mipki_signature *selected) { D(); return NULL; }
 int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, const mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t *sig_len, mipki_mode mode) { D(); return 0; }
+size_t MITLS_CALLCONV mipki_sign_batch(mipki_state *st, const mipki_chain cert_ptr, const mipki_signature sigalg, const char **tbs, const size_t *tbs_len, char **sig, size_t *sig_len, size_t count) { D(); return 0; }
 mipki_chain MITLS_CALLCONV mipki_parse_chain(mipki_state *st, const char *chain, size_t chain_len) { D(); return NULL; }
 mipki_chain MITLS_CALLCONV mipki_parse_list(mipki_state *st, const char **certs, const size_t* certs_len, size_t chain_len) { D(); return NULL; }
 size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, const mipki_chain chain, char *buffer, size_t buffer_len) { D(); return 0; }
 void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void* init, alloc_callback cb) { D(); }
+size_t MITLS_CALLCONV mipki_get_chain_der(mipki_state *st, mipki_chain chain, const char *const **certs, const size_t **certs_len) { D(); return 0; }
 int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, const mipki_chain chain, const char *host) { D(); return 0; }
+void MITLS_CALLCONV mipki_configure_chain_cache(mipki_state *st, size_t capacity, uint32_t lifetime) { D(); }
+void MITLS_CALLCONV mipki_get_chain_cache_stats(mipki_state *st, mipki_chain_cache_stats *stats) { D(); }
 void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain) { D(); }
 
 #endif
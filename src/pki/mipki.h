@@ -64,6 +64,8 @@ int MITLS_CALLCONV mipki_add_root_file_or_path(mipki_state *st, const char *ca_f
 
 // Find a certificate and signature algorithm compatible with the given SNI and list of offered signature algorithms
 // Returns a pointer to the selected entry or NULL if no certificate is suitable
+// The first suitable entry of the configuration is selected; the certificates are
+// indexed by name by mipki_init, so the cost does not grow with their number
 mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char *sni, size_t sni_len, const mipki_signature *algs, size_t algs_len, mipki_signature *selected);
 
 // A combined signature-and-verify function (depending on m)
@@ -72,6 +74,12 @@ mipki_chain MITLS_CALLCONV mipki_select_certificate(mipki_state *st, const char
 // input signature length.
 int MITLS_CALLCONV mipki_sign_verify(mipki_state *st, mipki_chain cert_ptr, const mipki_signature sigalg, const char *tbs, size_t tbs_len, char *sig, size_t *sig_len, mipki_mode m);
 
+// Sign count buffers with the same certificate and signature algorithm, e.g. the
+// signatures of many handshakes collected by an asynchronous sign callback.
+// sig_len[i] is the size of sig[i] on input, and on output the size of the signature,
+// or 0 if that signature failed. Returns the number of signatures made.
+size_t MITLS_CALLCONV mipki_sign_batch(mipki_state *st, mipki_chain cert_ptr, const mipki_signature sigalg, const char **tbs, const size_t *tbs_len, char **sig, size_t *sig_len, size_t count);
+
 // Parse a chain in TLS network format into an abstract chain object
 // Each certificate in the chain is encoded in DER, prefixed with the size of the
 // DER-encodeded structure over 3 bytes. The returned chain must be freed after use
@@ -86,9 +94,30 @@ size_t MITLS_CALLCONV mipki_format_chain(mipki_state *st, mipki_chain chain, cha
 // Format an abstract chain into a list of buffers allocated with a callback function
 void MITLS_CALLCONV mipki_format_alloc(mipki_state *st, mipki_chain chain, void* init, alloc_callback cb);
 
+// The DER certificates of a chain, endpoint first, without copying them: certs and
+// certs_len point to arrays owned by the chain, valid until it is freed (with its
+// mipki_state for a selected chain). Returns the number of certificates, or 0 on error.
+// The chains selected by mipki_select_certificate are encoded once, by mipki_init
+size_t MITLS_CALLCONV mipki_get_chain_der(mipki_state *st, mipki_chain chain, const char *const **certs, const size_t **certs_len);
+
 // Certificate chain validation. This checks revocation, expiration, and matches the hostname
+// May be called concurrently. Results are cached, see mipki_configure_chain_cache
 int MITLS_CALLCONV mipki_validate_chain(mipki_state *st, mipki_chain chain, const char *host);
 
+// Bound the cache of validation results, by (chain, hostname): at most capacity entries
+// (default 1024, 0 disables the cache), each kept for at most lifetime seconds (default
+// 3600, 0 keeps the current value), a failure for at most 60 seconds, and never past the
+// expiry of a certificate of the chain. The cache is emptied, as when a root is added.
+void MITLS_CALLCONV mipki_configure_chain_cache(mipki_state *st, size_t capacity, uint32_t lifetime);
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t entries;
+} mipki_chain_cache_stats;
+
+void MITLS_CALLCONV mipki_get_chain_cache_stats(mipki_state *st, mipki_chain_cache_stats *stats);
+
 // Free a chain after use.
 void MITLS_CALLCONV mipki_free_chain(mipki_state *st, mipki_chain chain);
 
@@ -14,6 +14,83 @@ static void dump(const unsigned char *buffer, size_t len)
   }
 }
 
+static int check_cache(mipki_state *st, const char *step, uint64_t hits, uint64_t misses, uint64_t entries)
+{
+  mipki_chain_cache_stats stats;
+  mipki_get_chain_cache_stats(st, &stats);
+  if(stats.hits != hits || stats.misses != misses || stats.entries != entries)
+  {
+    printf("Chain cache %s: %llu hits, %llu misses, %llu entries; expected %llu, %llu, %llu\n", step,
+      (unsigned long long)stats.hits, (unsigned long long)stats.misses, (unsigned long long)stats.entries,
+      (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)entries);
+    return 0;
+  }
+  printf("Chain cache %s OK.\n", step);
+  return 1;
+}
+
+// The cache of validation results: a repeated validation is a hit, another
+// host name is a miss, adding a root empties the cache, and so does
+// mipki_configure_chain_cache, which also bounds it. The certificate is
+// self-signed, added as its own root, and does not expire before 2126:
+// the cache never keeps a result past the expiry of the chain.
+static int test_chain_cache(void)
+{
+  mipki_config_entry config[1] = {
+    {
+      .cert_file = "../../data/chain-cache.crt",
+      .key_file = "../../data/chain-cache.key",
+      .is_universal = 0
+    }
+  };
+
+  int erridx;
+  mipki_state *st = mipki_init(config, 1, NULL, &erridx);
+  if(!st)
+  {
+    printf("FAILURE: errid=%d\n", erridx);
+    return 0;
+  }
+  if(!mipki_add_root_file_or_path(st, "../../data/chain-cache.crt"))
+  {
+    printf("Failed to add the chain cache root\n");
+    return 0;
+  }
+
+  mipki_signature selected;
+  mipki_signature offered[1] = {0x0403};
+  mipki_chain s = mipki_select_certificate(st, "localhost", 9, offered, 1, &selected);
+  if(!s)
+  {
+    printf("Certificate selection failed.\n");
+    return 0;
+  }
+
+  int ok = 1;
+  ok = ok && mipki_validate_chain(st, s, "localhost") == 1 && check_cache(st, "miss", 0, 1, 1);
+  ok = ok && mipki_validate_chain(st, s, "localhost") == 1 && check_cache(st, "hit", 1, 1, 1);
+  ok = ok && mipki_validate_chain(st, s, "example.com") == 0 && check_cache(st, "other host", 1, 2, 2);
+  ok = ok && mipki_validate_chain(st, s, "example.com") == 0 && check_cache(st, "cached failure", 2, 2, 2);
+
+  // A validation result may change with the new root
+  ok = ok && mipki_add_root_file_or_path(st, "../../data/ca.crt") && check_cache(st, "new root", 2, 2, 0);
+  ok = ok && mipki_validate_chain(st, s, "localhost") == 1 && check_cache(st, "miss after new root", 2, 3, 1);
+
+  mipki_configure_chain_cache(st, 0, 0);
+  ok = ok && check_cache(st, "disabled", 2, 3, 0);
+  ok = ok && mipki_validate_chain(st, s, "localhost") == 1 && check_cache(st, "not cached", 2, 3, 0);
+
+  // With room for one result, each host evicts the other
+  mipki_configure_chain_cache(st, 1, 0);
+  ok = ok && mipki_validate_chain(st, s, "localhost") == 1 && check_cache(st, "capacity 1", 2, 4, 1);
+  ok = ok && mipki_validate_chain(st, s, "example.com") == 0 && check_cache(st, "eviction", 2, 5, 1);
+  ok = ok && mipki_validate_chain(st, s, "localhost") == 1 && check_cache(st, "evicted", 2, 6, 1);
+
+  mipki_free_chain(st, s);
+  mipki_free(st);
+  return ok;
+}
+
 int main(int argc, char **argv)
 {
   mipki_config_entry config[1] = {
@@ -58,6 +135,12 @@ int main(int argc, char **argv)
   else
     printf("Chain validation OK.\n");
 
+  if(!test_chain_cache())
+  {
+    printf("Chain cache test failed.\n");
+    return 1;
+  }
+
   char *tbs = "Hello World!";
   char *sig = malloc(8192);
   size_t sig_len = 8192;
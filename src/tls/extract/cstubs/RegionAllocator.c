@@ -26,23 +26,48 @@
 
 #include "RegionAllocator.h"
 
-#if REGION_STATISTICS
+#if USE_HEAP_REGIONS || USE_KERNEL_REGIONS
+
+// Statistics are kept for the regions created while they are enabled (see
+// HeapRegionEnableStatistics) and for the global region while they are,
+// and summed up in g_process_statistics.
+// If built with REGION_STATISTICS, they are enabled from the start, and
+// printed when each region is destroyed.
+#ifndef REGION_STATISTICS
+#define REGION_STATISTICS 0
+#endif
+
+typedef struct _region_counters {
+    region_statistics s;
+    int enabled;
+} region_counters;
 
-typedef struct _region_statistics {
-    size_t current_bytes;   // bytes currently allocated
-    size_t total_bytes;     // total of all allocations
-    size_t peak_bytes;      // max value of current_bytes
-    size_t allocation_count;// count of allocations made
-    size_t free_count;      // count of frees made
-    size_t allocation_failures; // count of allocation fails due to OOM
-} region_statistics;
+int g_region_statistics = REGION_STATISTICS;
+region_statistics g_process_statistics; // updated atomically
+
+#if IS_WINDOWS
+  #define ATOMIC_ADD(p, n) ((size_t)InterlockedExchangeAddSizeT((p), (n)) + (n))
+  #define ATOMIC_SUB(p, n) ((size_t)InterlockedExchangeAddSizeT((p), -(SSIZE_T)(n)) - (n))
+  #define ATOMIC_CAS(p, old, new) \
+    (InterlockedCompareExchangePointer((PVOID volatile*)(p), (PVOID)(new), (PVOID)(old)) == (PVOID)(old))
+  #define ATOMIC_LOAD(p) (*(volatile size_t*)(p))
+#else
+  #define ATOMIC_ADD(p, n) __atomic_add_fetch((p), (n), __ATOMIC_RELAXED)
+  #define ATOMIC_SUB(p, n) __atomic_sub_fetch((p), (n), __ATOMIC_RELAXED)
+  #define ATOMIC_CAS(p, old, new) \
+    __atomic_compare_exchange_n((p), &(old), (new), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+  #define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#endif
+
+#if REGION_STATISTICS
 
 #ifndef KRML_HOST_PRINTF
 #define KRML_HOST_PRINTF printf
 #endif
 
-void PrintRegionStatistics(HEAP_REGION rgn, region_statistics *stats)
+void PrintRegionStatistics(HEAP_REGION rgn, region_counters *counters)
 {
+    region_statistics *stats = &counters->s;
     KRML_HOST_PRINTF("==== Statistics for Region %p ====\n", rgn);
     KRML_HOST_PRINTF("Current bytes:    %p\n", (void*)stats->current_bytes);
     KRML_HOST_PRINTF("Peak bytes:       %p\n", (void*)stats->peak_bytes);
@@ -51,48 +76,231 @@ void PrintRegionStatistics(HEAP_REGION rgn, region_statistics *stats)
     KRML_HOST_PRINTF("Free count:       %p\n", (void*)stats->free_count);
     KRML_HOST_PRINTF("========\n");
 }
+#else
+#define PrintRegionStatistics(rgn, stats)
+#endif
 
-void UpdateStatisticsAfterMalloc(region_statistics *stats, void *pv, size_t cb)
+static void AddProcessCurrentBytes(size_t cb)
 {
+    size_t current = ATOMIC_ADD(&g_process_statistics.current_bytes, cb);
+    size_t peak = ATOMIC_LOAD(&g_process_statistics.peak_bytes);
+    while (peak < current && !ATOMIC_CAS(&g_process_statistics.peak_bytes, peak, current)) {
+        peak = ATOMIC_LOAD(&g_process_statistics.peak_bytes);
+    }
+}
+
+void UpdateStatisticsAfterMalloc(region_counters *counters, void *pv, size_t cb)
+{
+    if (!counters->enabled) {
+        return;
+    }
+    region_statistics *stats = &counters->s;
     stats->allocation_count++;
+    ATOMIC_ADD(&g_process_statistics.allocation_count, 1);
     if (pv) {
         stats->current_bytes += cb;
         stats->total_bytes += cb;
         if (stats->peak_bytes < stats->current_bytes) {
             stats->peak_bytes = stats->current_bytes;
         }
+        AddProcessCurrentBytes(cb);
+        ATOMIC_ADD(&g_process_statistics.total_bytes, cb);
     } else {
         stats->allocation_failures++;
+        ATOMIC_ADD(&g_process_statistics.allocation_failures, 1);
     }
 }
 
-void UpdateStatisticsAfterFree(region_statistics *stats, size_t cb)
+void UpdateStatisticsAfterFree(region_counters *counters, size_t cb)
 {
-    stats->current_bytes -= cb;
-    stats->free_count++;
+    if (!counters->enabled) {
+        return;
+    }
+    counters->s.current_bytes -= cb;
+    counters->s.free_count++;
+    ATOMIC_SUB(&g_process_statistics.current_bytes, cb);
+    ATOMIC_ADD(&g_process_statistics.free_count, 1);
 }
-#else
-#define UpdateStatisticsAfterMalloc(stats, pv, cb)
-#define UpdateStatisticsAfterFree(stats, cb)
-#define PrintRegionStatistics(rgn, stats)
 
-#endif
+// Memory still allocated in a destroyed region is no longer in use
+static void UpdateStatisticsAfterDestroy(region_counters *counters)
+{
+    if (counters->enabled && counters->s.current_bytes) {
+        ATOMIC_SUB(&g_process_statistics.current_bytes, counters->s.current_bytes);
+    }
+}
+
+// The global region lives as long as the process, so it follows
+// HeapRegionEnableStatistics. When counting starts, the current bytes of
+// its blocks are added; when it stops, they are removed, as on destroy.
+// Called with the lock of the region held.
+static void EnableGlobalCounters(region_counters *counters, int enable, size_t current_bytes)
+{
+    if (enable && !counters->enabled) {
+        counters->s.current_bytes = current_bytes;
+        if (counters->s.peak_bytes < current_bytes) {
+            counters->s.peak_bytes = current_bytes;
+        }
+        AddProcessCurrentBytes(current_bytes);
+    } else if (!enable && counters->enabled) {
+        UpdateStatisticsAfterDestroy(counters);
+    }
+    counters->enabled = enable;
+}
+
+// See HeapRegionSetOutOfMemoryHandler
+static void (*g_out_of_memory_handler)(void);
+
+static void OnOutOfMemory(void)
+{
+    void (*handler)(void) = g_out_of_memory_handler;
+    if (handler) {
+        handler();
+    }
+}
+
+#endif // USE_HEAP_REGIONS || USE_KERNEL_REGIONS
 
 #if USE_HEAP_REGIONS
 
+// Destroyed regions can be reset and kept in a pool, for reuse by later
+// connections, instead of being returned to the system.  The pool holds at
+// most REGION_POOL idle regions (overridden at HeapRegionInitialize() time
+// by the MITLS_REGION_POOL environment variable; 0 disables pooling).
+// Every REGION_POOL_TRIM_INTERVAL destroys, the idle regions that would not
+// have been needed to serve the high-water mark of regions in use since the
+// previous trim are freed.
+#ifndef REGION_POOL
+#define REGION_POOL 0
+#endif
+#define REGION_POOL_TRIM_INTERVAL 256
+
+typedef struct _region_pool {
+    void **idle;            // reset regions, most recently destroyed last
+    size_t idle_count;
+    size_t limit;           // capacity of idle, 0 if pooling is disabled
+    size_t live;            // regions created and not yet destroyed
+    size_t high_water;      // max of live since the last trim
+    unsigned destroyed;     // regions destroyed since the last trim
+} region_pool;
+
+region_pool g_region_pool;
+
+#if IS_WINDOWS
+SRWLOCK g_region_pool_lock = SRWLOCK_INIT;
+  #define POOL_LOCK() AcquireSRWLockExclusive(&g_region_pool_lock)
+  #define POOL_UNLOCK() ReleaseSRWLockExclusive(&g_region_pool_lock)
+#else
+pthread_mutex_t g_region_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+  #define POOL_LOCK() pthread_mutex_lock(&g_region_pool_lock)
+  #define POOL_UNLOCK() pthread_mutex_unlock(&g_region_pool_lock)
+#endif
+
+// Free a region that is not (or no longer) in the pool
+static void FreeRegion(void *p);
+
+static void PoolInitialize(void)
+{
+    const char *limit = getenv("MITLS_REGION_POOL");
+    memset(&g_region_pool, 0, sizeof(g_region_pool));
+    g_region_pool.limit = (limit == NULL) ? REGION_POOL : (size_t)strtoul(limit, NULL, 10);
+    if (g_region_pool.limit) {
+        g_region_pool.idle = malloc(g_region_pool.limit * sizeof(void*));
+        if (g_region_pool.idle == NULL) {
+            g_region_pool.limit = 0;
+        }
+    }
+}
+
+static void PoolCleanup(void)
+{
+    while (g_region_pool.idle_count) {
+        FreeRegion(g_region_pool.idle[--g_region_pool.idle_count]);
+    }
+    free(g_region_pool.idle);
+    memset(&g_region_pool, 0, sizeof(g_region_pool));
+}
+
+// Called with the pool lock held
+static void PoolCountLive(void)
+{
+    if (++g_region_pool.live > g_region_pool.high_water) {
+        g_region_pool.high_water = g_region_pool.live;
+    }
+}
+
+// Returns an idle region to reuse, or NULL: the caller then allocates a
+// new region, and counts it with PoolCreated once it has one
+static void *PoolTake(void)
+{
+    void *p = NULL;
+    if (g_region_pool.limit == 0) {
+        return NULL;
+    }
+    POOL_LOCK();
+    if (g_region_pool.idle_count) {
+        p = g_region_pool.idle[--g_region_pool.idle_count];
+        PoolCountLive();
+    }
+    POOL_UNLOCK();
+    return p;
+}
+
+// Counts a region allocated because the pool had none, as PoolPut will
+// count its destruction
+static void PoolCreated(void)
+{
+    if (g_region_pool.limit == 0) {
+        return;
+    }
+    POOL_LOCK();
+    PoolCountLive();
+    POOL_UNLOCK();
+}
+
+// Keeps a destroyed region, already reset, for reuse.
+// Returns 0 if the pool is full: the caller must free the region.
+static int PoolPut(void *p)
+{
+    void *trimmed[REGION_POOL_TRIM_INTERVAL];
+    size_t trimmed_count = 0;
+    int pooled = 0;
+
+    POOL_LOCK();
+    g_region_pool.live--;
+    if (g_region_pool.idle_count < g_region_pool.limit) {
+        g_region_pool.idle[g_region_pool.idle_count++] = p;
+        pooled = 1;
+    }
+    if (++g_region_pool.destroyed >= REGION_POOL_TRIM_INTERVAL) {
+        // Keep the idle regions that served the busiest point of the interval
+        size_t keep = g_region_pool.high_water - g_region_pool.live;
+        while (g_region_pool.idle_count > keep && trimmed_count < REGION_POOL_TRIM_INTERVAL) {
+            trimmed[trimmed_count++] = g_region_pool.idle[--g_region_pool.idle_count];
+        }
+        g_region_pool.destroyed = 0;
+        g_region_pool.high_water = g_region_pool.live;
+    }
+    POOL_UNLOCK();
+
+    while (trimmed_count) {
+        FreeRegion(trimmed[--trimmed_count]);
+    }
+    return pooled;
+}
+
 #if IS_WINDOWS
 typedef struct _region {
     HANDLE heap;
 #if !defined(_MSC_VER)
     jmp_buf *penv;
 #endif
-#if REGION_STATISTICS
-    region_statistics stats;
-#endif
+    region_counters stats;
 } region;
 
 DWORD g_region_heap_slot;
 region g_global_region;
+SRWLOCK g_global_region_lock = SRWLOCK_INIT; // its heap and statistics
 
 // Global initialization
 // returns 0 for error, nonzero for success
@@ -109,15 +317,22 @@ int HeapRegionInitialize()
     }
     memset(&g_global_region, 0, sizeof(g_global_region));
     g_global_region.heap = h;
+    g_global_region.stats.enabled = g_region_statistics;
+    PoolInitialize();
     return 1;
 }
     
 // Global termination.  Frees all memory in the global region.
 void HeapRegionCleanup(void)
 {
+    PoolCleanup();
     PrintRegionStatistics(NULL, &g_global_region.stats);
+    UpdateStatisticsAfterDestroy(&g_global_region.stats);
     TlsFree(g_region_heap_slot);
+    AcquireSRWLockExclusive(&g_global_region_lock);
     HeapDestroy(g_global_region.heap);
+    g_global_region.heap = NULL;
+    ReleaseSRWLockExclusive(&g_global_region_lock);
     g_region_heap_slot = 0;
 }
 
@@ -128,14 +343,26 @@ HEAP_REGION HeapRegionCreateAndRegister(HEAP_REGION *prgn
 #endif
 )
 {
-    // Allocate a heap with:
-    // - no internal locking
-    // - a minimal initial commit (4kb)
-    // - no maximum size - it can fill the entire address space if needed
-    HANDLE h = HeapCreate(HEAP_NO_SERIALIZE, 0, 0);
-    region *heap = HeapAlloc(h, 0, sizeof(region));
-    memset(heap, 0, sizeof(*heap));
-    heap->heap = h;
+    region *heap = PoolTake();
+    if (heap == NULL) {
+        // Allocate a heap with:
+        // - no internal locking
+        // - a minimal initial commit (4kb)
+        // - no maximum size - it can fill the entire address space if needed
+        HANDLE h = HeapCreate(HEAP_NO_SERIALIZE, 0, 0);
+        heap = (h == NULL) ? NULL : HeapAlloc(h, 0, sizeof(region));
+        if (heap == NULL) {
+            if (h != NULL) {
+                HeapDestroy(h);
+            }
+            *prgn = NULL;
+            return TlsGetValue(g_region_heap_slot);
+        }
+        memset(heap, 0, sizeof(*heap));
+        heap->heap = h;
+        PoolCreated();
+    }
+    heap->stats.enabled = g_region_statistics;
     // Make it the heap for this callgraph
     HEAP_REGION oldrgn = HeapRegionEnter(heap
 #if !defined(_MSC_VER)
@@ -147,13 +374,47 @@ HEAP_REGION HeapRegionCreateAndRegister(HEAP_REGION *prgn
     return oldrgn;
 }
 
+static void FreeRegion(void *p)
+{
+    HeapDestroy(((region*)p)->heap);
+}
+
+// Free all of the blocks of a heap but the region itself, keeping the
+// heap's committed memory for its next use.  HeapWalk cannot continue
+// across HeapFree, so the blocks are freed in batches.
+static void ResetRegion(region *heap)
+{
+    void *blocks[64];
+    size_t count;
+    do {
+        PROCESS_HEAP_ENTRY e;
+        e.lpData = NULL;
+        count = 0;
+        while (count < sizeof(blocks)/sizeof(blocks[0]) && HeapWalk(heap->heap, &e)) {
+            if ((e.wFlags & PROCESS_HEAP_ENTRY_BUSY) && e.lpData != heap) {
+                blocks[count++] = e.lpData;
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            HeapFree(heap->heap, 0, blocks[i]);
+        }
+    } while (count == sizeof(blocks)/sizeof(blocks[0]));
+    memset(&heap->stats, 0, sizeof(heap->stats));
+}
+
 // Destroy a heap region, freeing all of its allocations
 void HeapRegionDestroy(HEAP_REGION rgn)
 {
     region *heap = (region*)rgn;
-    HANDLE h = heap->heap;
     PrintRegionStatistics(heap, &heap->stats);
-    HeapDestroy(h);
+    UpdateStatisticsAfterDestroy(&heap->stats);
+    if (g_region_pool.limit) {
+        ResetRegion(heap);
+        if (PoolPut(heap)) {
+            return;
+        }
+    }
+    FreeRegion(heap);
 }
 
 void PrintHeapRegionStatistics(HEAP_REGION rgn)
@@ -193,12 +454,19 @@ void HeapRegionLeave(HEAP_REGION oldrgn)
 void* HeapRegionMalloc(size_t cb)
 {
     region *heap = (region*)TlsGetValue(g_region_heap_slot);
+    void *pv;
     if (heap == NULL) {
         heap = &g_global_region;
+        AcquireSRWLockExclusive(&g_global_region_lock);
+        pv = HeapAlloc(heap->heap, 0, cb);
+        UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
+        ReleaseSRWLockExclusive(&g_global_region_lock);
+    } else {
+        pv = HeapAlloc(heap->heap, 0, cb);
+        UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
     }
-    void *pv = HeapAlloc(heap->heap, 0, cb);
-    UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
     if (pv == NULL) {
+        OnOutOfMemory();
 #if defined(_MSC_VER)
         RaiseException((DWORD)MITLS_OUT_OF_MEMORY_EXCEPTION, EXCEPTION_NONCONTINUABLE, 0, NULL);
 #else
@@ -231,73 +499,343 @@ void HeapRegionFree(void* pv)
     region *heap = (region*)TlsGetValue(g_region_heap_slot);
     if (heap == NULL) {
         heap = &g_global_region;
+        AcquireSRWLockExclusive(&g_global_region_lock);
     }
-#if REGION_STATISTICS
-    size_t cb = HeapSize(heap->heap, 0, pv);
-    UpdateStatisticsAfterFree(&heap->stats, cb);
-#endif    
-    if (!HeapFree(heap->heap, 0, pv)) {
+    if (heap->stats.enabled) {
+        size_t cb = HeapSize(heap->heap, 0, pv);
+        UpdateStatisticsAfterFree(&heap->stats, cb);
+    }
+    BOOL freed = HeapFree(heap->heap, 0, pv);
+    if (heap == &g_global_region) {
+        ReleaseSRWLockExclusive(&g_global_region_lock);
+    }
+    if (!freed) {
         // This can happen if allocating from one region and freeing from another
         KRML_HOST_PRINTF("HeapRegionFree of %p from heap %p failed.\n", pv, heap);
     }
 }
 
+// Count the blocks of the global region from now on (or stop)
+static void EnableGlobalStatistics(int enable)
+{
+    AcquireSRWLockExclusive(&g_global_region_lock);
+    if (g_global_region.heap != NULL) {
+        size_t current_bytes = 0;
+        if (enable && !g_global_region.stats.enabled) {
+            PROCESS_HEAP_ENTRY e;
+            e.lpData = NULL;
+            while (HeapWalk(g_global_region.heap, &e)) {
+                if (e.wFlags & PROCESS_HEAP_ENTRY_BUSY) {
+                    current_bytes += e.cbData;
+                }
+            }
+        }
+        EnableGlobalCounters(&g_global_region.stats, enable, current_bytes);
+    }
+    ReleaseSRWLockExclusive(&g_global_region_lock);
+}
+
 #else // !IS_WINDOWS
-pthread_key_t g_region_heap_slot;
-pthread_mutex_t g_global_region_lock; 
+// Immediately precedes every block, in either mode, for HeapRegionFree
+typedef struct region_block {
+    struct region *owner;
+    size_t cb;
+} region_block;
 
 typedef struct region_allocation {
     LIST_ENTRY(region_allocation) entry;
-#if REGION_STATISTICS
-    size_t cb;
-    size_t pad; // pad so this size is a multiple of 16 on 64-bit machines
-#endif
+    region_block block;
 } region_allocation;
 
+// In arena mode, a region bump-allocates from a list of large chunks, and
+// destroying it frees the chunks. Freed blocks are only reclaimed then,
+// so the sub-regions of the global region always use entries.
+// Chunks double in size, from ARENA_FIRST_CHUNK up to ARENA_MAX_CHUNK;
+// larger allocations get a chunk of their own.  A pooled region keeps up
+// to ARENA_POOL_RESERVE bytes of its chunks, emptied, for its next use.
+// Once its chunks would exceed REGION_ARENA_MAX bytes, a region makes its
+// further allocations as entries, reclaimed on free, so that long-lived
+// connections do not grow without bound.
+#define ARENA_ALIGN 16
+#define ARENA_FIRST_CHUNK (8*1024)
+#define ARENA_MAX_CHUNK (256*1024)
+#define ARENA_POOL_RESERVE (256*1024)
+// Blocks are preceded by their region_block, padded to ARENA_HEADER
+#define ARENA_HEADER ARENA_ALIGN
+// Set in the cb of the blocks allocated from chunks
+#define ARENA_BLOCK ((size_t)1 << (8 * sizeof(size_t) - 1))
+
+typedef struct region_chunk {
+    struct region_chunk *next;
+    char *cur; // next free byte
+    char *end;
+    size_t pad; // pad so this size is a multiple of 16 on 64-bit machines
+} region_chunk;
+
 typedef struct region {
     LIST_HEAD(region_allocation_list, region_allocation) entries;
-    jmp_buf *penv;
-#if REGION_STATISTICS
-    region_statistics stats;
-#endif    
+    jmp_buf *penv;          // not global: global sub-regions use t_global_penv
+    int arena;              // allocate from chunks rather than entries
+    region_chunk *chunks;   // arena mode: the current chunk first
+    region_chunk *spare;    // arena mode: empty chunks kept by the pool, smallest first
+    size_t chunk_size;      // arena mode: size of the next chunk
+    size_t chunk_bytes;     // arena mode: total size of chunks and spare
+
+    // Part of the global region: blocks may be freed by any thread
+    int global;
+    pthread_mutex_t lock;   // global only, uncontended unless freeing across threads
+    struct region *next;    // global only, in g_global_regions
+    int orphaned;           // global only, its thread has exited
+    region_counters stats;
 } region;
 
-region g_global_region; // All allocations made at global scope go here
+// The global region, for allocations made at global scope, is split into
+// one sub-region per thread, so that threads allocating outside of a
+// connection do not contend on a single lock. All of them are freed by
+// HeapRegionCleanup. The sub-region of an exited thread is reused by the
+// next new thread.
+region g_global_region; // the sub-region of the thread calling HeapRegionInitialize
+region *g_global_regions; // all sub-regions
+pthread_mutex_t g_global_regions_lock; // guards g_global_regions and orphaned
+int g_global_regions_ready; // between HeapRegionInitialize and HeapRegionCleanup
+pthread_key_t g_global_region_exit; // orphans the sub-region on thread exit
+unsigned g_global_generation; // invalidates t_global_region after HeapRegionCleanup
+
+// The current region of this thread, or NULL for the global region
+static __thread region *t_region;
+static __thread region *t_global_region;
+static __thread unsigned t_global_generation;
+// Where this thread resumes when out of memory in the global region, as
+// several threads may share g_global_region
+static __thread jmp_buf *t_global_penv;
+
+// Arena mode is the default if built with REGION_ARENA, and can be
+// selected at runtime with MITLS_REGION_ARENA=1 (or 0)
+#ifndef REGION_ARENA
+#define REGION_ARENA 0
+#endif
+int g_region_arena;
+// The chunks of a region, MITLS_REGION_ARENA_MAX at runtime
+#ifndef REGION_ARENA_MAX
+#define REGION_ARENA_MAX (1024*1024)
+#endif
+size_t g_region_arena_max;
+
+static void InitRegion(region *p)
+{
+    memset(p, 0, sizeof(region));
+    LIST_INIT(&p->entries);
+    p->arena = g_region_arena;
+    p->chunk_size = ARENA_FIRST_CHUNK;
+    p->stats.enabled = g_region_statistics;
+}
+
+static int InitGlobalRegion(region *p)
+{
+    InitRegion(p);
+    // Global blocks live as long as the process, and are freed by any
+    // thread: they are reclaimed on free, so never from an arena
+    p->arena = 0;
+    p->global = 1;
+    if (pthread_mutex_init(&p->lock, NULL) != 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&g_global_regions_lock);
+    p->next = g_global_regions;
+    g_global_regions = p;
+    pthread_mutex_unlock(&g_global_regions_lock);
+    return 1;
+}
+
+static void OrphanGlobalRegion(void *p)
+{
+    pthread_mutex_lock(&g_global_regions_lock);
+    ((region*)p)->orphaned = 1;
+    pthread_mutex_unlock(&g_global_regions_lock);
+}
+
+// Free all of the memory of a region, but not the region itself
+static void FreeRegionMemory(region *p)
+{
+    while (p->entries.lh_first) {
+        struct region_allocation *a = p->entries.lh_first;
+        LIST_REMOVE(a, entry);
+        free(a);
+    }
+    while (p->chunks) {
+        region_chunk *c = p->chunks;
+        p->chunks = c->next;
+        free(c);
+    }
+    while (p->spare) {
+        region_chunk *c = p->spare;
+        p->spare = c->next;
+        free(c);
+    }
+}
+
+static void FreeRegion(void *p)
+{
+    FreeRegionMemory((region*)p);
+    free(p);
+}
+
+// Empty a region for reuse from the pool, keeping some of its chunks
+static void ResetRegion(region *p)
+{
+    while (p->entries.lh_first) {
+        struct region_allocation *a = p->entries.lh_first;
+        LIST_REMOVE(a, entry);
+        free(a);
+    }
+
+    // The chunks in use, oldest (smallest) first, then the unused spares
+    region_chunk *all = p->spare;
+    while (p->chunks) {
+        region_chunk *c = p->chunks;
+        p->chunks = c->next;
+        c->next = all;
+        all = c;
+    }
+    region_chunk **last = &p->spare;
+    size_t reserve = 0;
+    while (all) {
+        region_chunk *c = all;
+        all = c->next;
+        c->cur = (char*)(c + 1);
+        if (reserve + (size_t)(c->end - c->cur) <= ARENA_POOL_RESERVE) {
+            reserve += (size_t)(c->end - c->cur);
+            *last = c;
+            last = &c->next;
+        } else {
+            free(c);
+        }
+    }
+    *last = NULL;
+    p->arena = g_region_arena; // even if the last connection reached the cap
+    p->chunk_bytes = reserve;
+    memset(&p->stats, 0, sizeof(p->stats));
+}
+
+// The calling thread's sub-region of the global region
+static region *GlobalRegion(void)
+{
+    region *g = t_global_region;
+    if (g != NULL && t_global_generation == g_global_generation) {
+        return g;
+    }
+
+    pthread_mutex_lock(&g_global_regions_lock);
+    for (g = g_global_regions; g != NULL && !g->orphaned; g = g->next) {
+    }
+    if (g != NULL) {
+        g->orphaned = 0;
+    }
+    pthread_mutex_unlock(&g_global_regions_lock);
+    if (g == NULL) {
+        g = malloc(sizeof(region));
+        if (g == NULL || !InitGlobalRegion(g)) {
+            free(g);
+            return &g_global_region; // shared, but still locked
+        }
+    }
+    t_global_region = g;
+    t_global_generation = g_global_generation;
+    pthread_setspecific(g_global_region_exit, g);
+    return g;
+}
 
 // Global initialization  
 // returns 0 for error, nonzero for success
 int HeapRegionInitialize()
 {
-    if (pthread_mutex_init(&g_global_region_lock, NULL) != 0) {
+    const char *arena = getenv("MITLS_REGION_ARENA");
+    const char *arena_max = getenv("MITLS_REGION_ARENA_MAX");
+    g_region_arena = (arena == NULL) ? REGION_ARENA : (*arena != '0');
+    g_region_arena_max = (arena_max == NULL) ? REGION_ARENA_MAX : (size_t)strtoul(arena_max, NULL, 10);
+    if (pthread_mutex_init(&g_global_regions_lock, NULL) != 0) {
         return 0;
     }
-    if (pthread_key_create(&g_region_heap_slot, NULL) != 0) {
-        pthread_mutex_destroy(&g_global_region_lock);
+    if (pthread_key_create(&g_global_region_exit, OrphanGlobalRegion) != 0) {
+        pthread_mutex_destroy(&g_global_regions_lock);
         return 0;
     }
-    memset(&g_global_region, 0, sizeof(g_global_region));
-    LIST_INIT(&g_global_region.entries);
+    g_global_generation++;
+    g_global_regions = NULL;
+    PoolInitialize();
+    if (!InitGlobalRegion(&g_global_region)) {
+        pthread_key_delete(g_global_region_exit);
+        pthread_mutex_destroy(&g_global_regions_lock);
+        return 0;
+    }
+    t_global_region = &g_global_region;
+    t_global_generation = g_global_generation;
+    pthread_setspecific(g_global_region_exit, &g_global_region);
+    g_global_regions_ready = 1;
     return 1;
 }
     
-// Global termination
+// Global termination, freeing the global region
 void HeapRegionCleanup(void)
 {
-    HeapRegionDestroy((HEAP_REGION)&g_global_region);
-    pthread_key_delete(g_region_heap_slot);
-    pthread_mutex_destroy(&g_global_region_lock);
+    pthread_mutex_lock(&g_global_regions_lock);
+    g_global_regions_ready = 0;
+    pthread_mutex_unlock(&g_global_regions_lock);
+    PoolCleanup();
+    while (g_global_regions) {
+        region *p = g_global_regions;
+        g_global_regions = p->next;
+        PrintRegionStatistics(p, &p->stats);
+        UpdateStatisticsAfterDestroy(&p->stats);
+        FreeRegionMemory(p);
+        pthread_mutex_destroy(&p->lock);
+        if (p != &g_global_region) {
+            free(p);
+        }
+    }
+    g_global_generation++;
+    t_region = NULL;
+    pthread_key_delete(g_global_region_exit);
+    pthread_mutex_destroy(&g_global_regions_lock);
+}
+
+// Count the blocks of the global sub-regions from now on (or stop)
+static void EnableGlobalStatistics(int enable)
+{
+    pthread_mutex_lock(&g_global_regions_lock);
+    if (!g_global_regions_ready) {
+        pthread_mutex_unlock(&g_global_regions_lock);
+        return;
+    }
+    for (region *p = g_global_regions; p != NULL; p = p->next) {
+        pthread_mutex_lock(&p->lock);
+        size_t current_bytes = 0;
+        if (enable && !p->stats.enabled) {
+            struct region_allocation *a;
+            LIST_FOREACH(a, &p->entries, entry) {
+                current_bytes += a->block.cb;
+            }
+        }
+        EnableGlobalCounters(&p->stats, enable, current_bytes);
+        pthread_mutex_unlock(&p->lock);
+    }
+    pthread_mutex_unlock(&g_global_regions_lock);
 }
 
 // Create a new region and make it this thread's default
 HEAP_REGION HeapRegionCreateAndRegister(HEAP_REGION *prgn, jmp_buf *penv)
 {
-    HEAP_REGION oldrgn = (HEAP_REGION)pthread_getspecific(g_region_heap_slot);
-    region *p = malloc(sizeof(region));
+    HEAP_REGION oldrgn = (HEAP_REGION)t_region;
+    region *p = PoolTake();
+    if (p) {
+        p->stats.enabled = g_region_statistics;
+    } else if ((p = malloc(sizeof(region))) != NULL) {
+        InitRegion(p);
+        PoolCreated();
+    }
     if (p) {
-        memset(p, 0, sizeof(region));
-        LIST_INIT(&p->entries);
         p->penv = penv;
-        pthread_setspecific(g_region_heap_slot, p);
+        t_region = p;
     }
     *prgn = (HEAP_REGION)p;
     return oldrgn;
@@ -306,38 +844,40 @@ HEAP_REGION HeapRegionCreateAndRegister(HEAP_REGION *prgn, jmp_buf *penv)
 // Destroy a region and free all of its memory
 void HeapRegionDestroy(HEAP_REGION rgn)
 {
-    pthread_setspecific(g_region_heap_slot, NULL);
-    
-    // Free all of the entries in the linked-list
     region *p = (region *)rgn;   
+    t_region = NULL;
     PrintRegionStatistics(p, &p->stats);
-    while (p->entries.lh_first) {
-        struct region_allocation *a = p->entries.lh_first;
-        LIST_REMOVE(a, entry);
-        free(a);
-    }
-    if (p != &g_global_region) {
-        // Then free the list head itself
-        free(p);
+    UpdateStatisticsAfterDestroy(&p->stats);
+    if (g_region_pool.limit) {
+        ResetRegion(p);
+        if (PoolPut(p)) {
+            return;
+        }
     }
+    FreeRegion(p);
 }
 
 void PrintHeapRegionStatistics(HEAP_REGION rgn)
 {
     region *heap = (region*)rgn;
     if (heap == NULL) {
-        heap = &g_global_region;
+        pthread_mutex_lock(&g_global_regions_lock);
+        for (heap = g_global_regions; heap != NULL; heap = heap->next) {
+            PrintRegionStatistics(heap, &heap->stats);
+        }
+        pthread_mutex_unlock(&g_global_regions_lock);
+        return;
     }
     PrintRegionStatistics(heap, &heap->stats);
 }
 
 HEAP_REGION HeapRegionEnter(HEAP_REGION rgn, jmp_buf *penv)
 {
-    HEAP_REGION oldrgn = (HEAP_REGION)pthread_getspecific(g_region_heap_slot);
-    pthread_setspecific(g_region_heap_slot, rgn);
+    HEAP_REGION oldrgn = (HEAP_REGION)t_region;
     region *heap = (region*)rgn;
+    t_region = heap;
     if (heap == NULL) {
-        g_global_region.penv = penv;
+        t_global_penv = penv;
     } else {
         heap->penv = penv;
     }
@@ -346,39 +886,110 @@ HEAP_REGION HeapRegionEnter(HEAP_REGION rgn, jmp_buf *penv)
 
 void HeapRegionLeave(HEAP_REGION oldrgn)
 {
-    pthread_setspecific(g_region_heap_slot, oldrgn);
+    t_region = (region*)oldrgn;
 }
 
-// KRML_HOST_MALLOC
-void* HeapRegionMalloc(size_t cb)
+// Bump-allocate from the region's current chunk, or from a new one.
+// Returns NULL if out of memory, or with heap->arena cleared if a new
+// chunk would exceed g_region_arena_max.
+static void* ArenaMalloc(region *heap, size_t cb)
 {
-    size_t actual_cb = cb + sizeof(struct region_allocation);
-    if (actual_cb < cb) {
+    size_t header = ARENA_HEADER;
+    size_t actual_cb = (cb + header + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (actual_cb < cb || (cb & ARENA_BLOCK)) {
         return NULL; // Integer overflow
     }
-    void *pv = malloc(actual_cb);
-    region *heap = (region *)pthread_getspecific(g_region_heap_slot);
-    if (pv) {
-        struct region_allocation *e = (struct region_allocation*)pv;
-#if REGION_STATISTICS
-        e->cb = cb;
-#endif
-        if (heap == NULL) {
-            pthread_mutex_lock(&g_global_region_lock);
-            LIST_INSERT_HEAD(&g_global_region.entries, e, entry);
-            UpdateStatisticsAfterMalloc(&g_global_region.stats, pv, cb);
-            pthread_mutex_unlock(&g_global_region_lock);
+    region_chunk *c = heap->chunks;
+    if ((c == NULL || (size_t)(c->end - c->cur) < actual_cb)
+        && heap->spare != NULL && (size_t)(heap->spare->end - heap->spare->cur) >= actual_cb) {
+        // Reuse the chunks of the region's previous life first
+        region_chunk *n = heap->spare;
+        heap->spare = n->next;
+        n->next = c;
+        heap->chunks = n;
+        c = n;
+    }
+    if (c == NULL || (size_t)(c->end - c->cur) < actual_cb) {
+        size_t size = heap->chunk_size;
+        int dedicated = (actual_cb > size);
+        if (dedicated) {
+            size = actual_cb;
+        } else if (heap->chunk_size < ARENA_MAX_CHUNK) {
+            heap->chunk_size *= 2;
+        }
+        if (sizeof(region_chunk) + size < size) {
+            return NULL; // Integer overflow
+        }
+        if (heap->chunk_bytes + size > g_region_arena_max || heap->chunk_bytes + size < size) {
+            heap->arena = 0;
+            return NULL;
+        }
+        region_chunk *n = malloc(sizeof(region_chunk) + size);
+        if (n == NULL) {
+            return NULL;
+        }
+        heap->chunk_bytes += size;
+        n->cur = (char*)(n + 1);
+        n->end = n->cur + size;
+        if (dedicated && c != NULL) {
+            // Keep bump-allocating from the current chunk
+            n->next = c->next;
+            c->next = n;
         } else {
-            UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
-            LIST_INSERT_HEAD(&heap->entries, e, entry);
+            n->next = c;
+            heap->chunks = n;
         }
-        return (void*)(e + 1); // Return the address of the byte following the LIST_ENTRY
+        c = n;
     }
-    else {
-        UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
-        longjmp(*heap->penv, 1);
+    char *pv = c->cur + header;
+    c->cur += actual_cb;
+    region_block *b = (region_block*)pv - 1;
+    b->owner = heap;
+    b->cb = cb | ARENA_BLOCK;
+    return pv;
+}
+
+// Allocate a block linked into the region's list of entries.
+// Returns NULL if out of memory.
+static void* ListMalloc(region *heap, size_t cb)
+{
+    size_t actual_cb = cb + sizeof(struct region_allocation);
+    if (actual_cb < cb) {
+        return NULL; // Integer overflow
+    }
+    struct region_allocation *e = malloc(actual_cb);
+    if (e == NULL) {
         return NULL;
     }
+    e->block.owner = heap;
+    e->block.cb = cb;
+    LIST_INSERT_HEAD(&heap->entries, e, entry);
+    return (void*)(e + 1); // Return the address of the byte following the header
+}
+
+// KRML_HOST_MALLOC
+void* HeapRegionMalloc(size_t cb)
+{
+    region *heap = t_region;
+    if (heap == NULL) {
+        heap = GlobalRegion();
+    }
+    if (heap->global) {
+        pthread_mutex_lock(&heap->lock);
+    }
+    void *pv = heap->arena ? ArenaMalloc(heap, cb) : NULL;
+    if (!heap->arena) {
+        pv = ListMalloc(heap, cb); // also once the arena of the region is full
+    }
+    UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
+    if (heap->global) {
+        pthread_mutex_unlock(&heap->lock);
+    }
+    if (pv == NULL) {
+        OnOutOfMemory();
+        longjmp(*(heap->global ? t_global_penv : heap->penv), 1);
+    }
+    return pv;
 }
 
 // KRML_HOST_CALLOC
@@ -401,16 +1012,24 @@ void HeapRegionFree(void* pv)
     if (pv == NULL) {
         return;
     }
+    // The block may belong to another region than the current one, e.g.
+    // to another thread's sub-region of the global region
+    region_block *b = (region_block*)pv - 1;
+    region *heap = b->owner;
+    if (b->cb & ARENA_BLOCK) {
+        // The block is reclaimed when its region is destroyed
+        UpdateStatisticsAfterFree(&heap->stats, b->cb & ~ARENA_BLOCK);
+        return;
+    }
+
     region_allocation *e = ((region_allocation*)pv - 1);
-    region *heap = (region*)pthread_getspecific(g_region_heap_slot);
-    if (heap == NULL) {
-        pthread_mutex_lock(&g_global_region_lock);
-        LIST_REMOVE(e, entry);
-        UpdateStatisticsAfterFree(&g_global_region.stats, e->cb);
-        pthread_mutex_unlock(&g_global_region_lock);
-    } else {
-        LIST_REMOVE(e, entry);
-        UpdateStatisticsAfterFree(&heap->stats, e->cb);
+    if (heap->global) {
+        pthread_mutex_lock(&heap->lock);
+    }
+    LIST_REMOVE(e, entry);
+    UpdateStatisticsAfterFree(&heap->stats, e->block.cb);
+    if (heap->global) {
+        pthread_mutex_unlock(&heap->lock);
     }
     free(e);
 }
@@ -428,21 +1047,18 @@ FAST_MUTEX g_mapping_lock;
 
 typedef struct _region {
     LIST_ENTRY entries;
-#if REGION_STATISTICS
-    region_statistics stats;
-#endif    
+    region_counters stats;
 } region;
 
 typedef struct _region_allocation {
     LIST_ENTRY entry;
-#if REGION_STATISTICS
     size_t cb;
     size_t pad; // pad so this size is a multiple of 16 on 64-bit machines
-#endif
 } region_allocation;
 
 EX_PUSH_LOCK global_region_lock;
 region g_global_region; // All allocations made at global scope go here
+int g_global_region_ready; // between HeapRegionInitialize and HeapRegionCleanup
 
 // Global initialization
 // returns 0 for error, nonzero for success
@@ -453,6 +1069,8 @@ int HeapRegionInitialize()
     ExInitializePushLock(&global_region_lock);
     RtlZeroMemory(&g_global_region, sizeof(g_global_region));
     InitializeListHead(&g_global_region.entries);
+    g_global_region.stats.enabled = g_region_statistics;
+    g_global_region_ready = 1;
     return 1;
 }
     
@@ -461,14 +1079,35 @@ void HeapRegionCleanup(void)
 {
     // The mapping list should be empty
     NT_ASSERT(IsListEmpty(&g_mapping_list));
+    ExfAcquirePushLockExclusive(&global_region_lock);
+    g_global_region_ready = 0;
+    ExfReleasePushLockExclusive(&global_region_lock);
     HeapRegionDestroy(&g_global_region);
 }
 
+// Count the blocks of the global region from now on (or stop)
+static void EnableGlobalStatistics(int enable)
+{
+    if (!g_global_region_ready) {
+        return; // the lock is not initialized yet
+    }
+    ExfAcquirePushLockExclusive(&global_region_lock);
+    size_t current_bytes = 0;
+    if (enable && !g_global_region.stats.enabled) {
+        for (LIST_ENTRY *p = g_global_region.entries.Flink; p != &g_global_region.entries; p = p->Flink) {
+            current_bytes += CONTAINING_RECORD(p, region_allocation, entry)->cb;
+        }
+    }
+    EnableGlobalCounters(&g_global_region.stats, enable, current_bytes);
+    ExfReleasePushLockExclusive(&global_region_lock);
+}
+
 // Destroy a region, freeing all of its memory
 void HeapRegionDestroy(HEAP_REGION rgn)
 {
     region *heap = (region*)rgn;
-    PrintRegionStatistics(rgn, &g_global_region.stats);
+    PrintRegionStatistics(rgn, &heap->stats);
+    UpdateStatisticsAfterDestroy(&heap->stats);
     // Free all of the entries in the linked-list
     while (!IsListEmpty(&heap->entries)) {
         LIST_ENTRY *a = RemoveHeadList(&heap->entries);
@@ -485,7 +1124,9 @@ void HeapRegionCreateAndRegister(region_entry* pe, HEAP_REGION *prgn)
 {
     region *rgn = (region*)ExAllocatePoolWithTag(PagedPool, sizeof(region), MITLS_TAG);
     if (rgn) {
+        RtlZeroMemory(rgn, sizeof(region));
         InitializeListHead(&rgn->entries);
+        rgn->stats.enabled = g_region_statistics;
         HeapRegionRegister(pe, rgn);
     }
     *prgn = rgn;
@@ -546,22 +1187,21 @@ void* HeapRegionMalloc(size_t cb)
     void *pv = ExAllocatePoolWithTag(PagedPool, actual_cb, MITLS_TAG);
     if (pv) {
         region_allocation *e = (region_allocation*)pv;
-#if REGION_STATISTICS
         e->cb = cb;
-#endif
-        LIST_ENTRY *heap = HeapRegionFind();
+        region *heap = (region*)HeapRegionFind();
         if (heap == NULL) {
             ExfAcquirePushLockExclusive(&global_region_lock);
             InsertHeadList(&g_global_region.entries, &e->entry);
             UpdateStatisticsAfterMalloc(&g_global_region.stats, pv, cb);
             ExfReleasePushLockExclusive(&global_region_lock);
         } else {
-            InsertHeadList(heap, &e->entry);
+            InsertHeadList(&heap->entries, &e->entry);
             UpdateStatisticsAfterMalloc(&heap->stats, pv, cb);
         }
         return (void*)(e + 1); // Return the address of the byte following the LIST_ENTRY
     }
     else {
+        OnOutOfMemory();
         RtlRaiseStatus(MITLS_OUT_OF_MEMORY_EXCEPTION);
         return NULL;
     }
@@ -588,7 +1228,7 @@ void HeapRegionFree(void* pv)
         return;
     }
     region_allocation *e = ((region_allocation*)pv - 1);
-    LIST_ENTRY *heap = HeapRegionFind();
+    region *heap = (region*)HeapRegionFind();
 
     if (heap == NULL) {
         ExfAcquirePushLockExclusive(&global_region_lock);
@@ -682,3 +1322,50 @@ void HeapRegionFree(void* pv)
     free(pv);
 }
 #endif
+
+#if USE_HEAP_REGIONS || USE_KERNEL_REGIONS
+void HeapRegionSetOutOfMemoryHandler(void (*handler)(void))
+{
+    g_out_of_memory_handler = handler;
+}
+
+void HeapRegionEnableStatistics(int enable)
+{
+    g_region_statistics = (enable != 0);
+    EnableGlobalStatistics(g_region_statistics);
+}
+
+int HeapRegionGetStatistics(HEAP_REGION rgn, region_statistics *stats)
+{
+    region *heap = (region*)rgn;
+    if (heap == NULL) {
+        stats->current_bytes = ATOMIC_LOAD(&g_process_statistics.current_bytes);
+        stats->total_bytes = ATOMIC_LOAD(&g_process_statistics.total_bytes);
+        stats->peak_bytes = ATOMIC_LOAD(&g_process_statistics.peak_bytes);
+        stats->allocation_count = ATOMIC_LOAD(&g_process_statistics.allocation_count);
+        stats->free_count = ATOMIC_LOAD(&g_process_statistics.free_count);
+        stats->allocation_failures = ATOMIC_LOAD(&g_process_statistics.allocation_failures);
+        return 1;
+    }
+    if (!heap->stats.enabled) {
+        memset(stats, 0, sizeof(*stats));
+        return 0;
+    }
+    *stats = heap->stats.s;
+    return 1;
+}
+#else
+void HeapRegionSetOutOfMemoryHandler(void (*handler)(void))
+{
+}
+
+void HeapRegionEnableStatistics(int enable)
+{
+}
+
+int HeapRegionGetStatistics(HEAP_REGION rgn, region_statistics *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+}
+#endif
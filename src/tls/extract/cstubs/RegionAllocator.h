@@ -11,9 +11,28 @@ This file has multiple compilation options:
       allocations made via ExAllocatePoolWithTag().
     - default... no-op.  All allocations are made without region tracking.
     
-2.  REGION_STATISTICS.  If set, for both USE_HEAP_REGIONS and USE_KERNEL_REGIONS,
-    then the allocator maintains per-region statistics, for total bytes
-    allocated, peak bytes, count of allocations, etc.
+2.  REGION_STATISTICS.  For both USE_HEAP_REGIONS and USE_KERNEL_REGIONS,
+    the allocator can maintain per-region and process-wide statistics, for
+    total bytes allocated, peak bytes, count of allocations, etc.  They are
+    enabled at runtime by HeapRegionEnableStatistics().  If set, they are
+    enabled from the start and printed when each region is destroyed.
+
+3.  REGION_ARENA.  Linux USE_HEAP_REGIONS only.  If set, regions bump-allocate
+    from large chunks instead of making one malloc() per allocation; memory
+    freed within a region is only reclaimed when the region is destroyed.
+    The global region, which lives as long as the process, is never an arena.
+    The MITLS_REGION_ARENA environment variable (0 or 1) overrides it at
+    HeapRegionInitialize() time.  A region whose chunks would exceed
+    REGION_ARENA_MAX bytes (default 1MB, overridden by MITLS_REGION_ARENA_MAX)
+    makes its further allocations with malloc(), reclaimed on free, so that
+    long-lived connections stay bounded.
+
+4.  REGION_POOL.  USE_HEAP_REGIONS only.  The number of destroyed regions
+    kept, emptied but with their memory reserved (their heap on Windows,
+    some of their chunks in arena mode), for reuse by the next regions to be
+    created.  Idle regions beyond the high-water mark of regions in use are
+    periodically freed.  The MITLS_REGION_POOL environment variable
+    overrides it at HeapRegionInitialize() time.  Default 0 (no pooling).
 
 ******/
 
@@ -30,6 +49,28 @@ void HeapRegionCleanup(void);
 
 void PrintHeapRegionStatistics(HEAP_REGION rgn);
 
+typedef struct _region_statistics {
+    size_t current_bytes;   // bytes currently allocated
+    size_t total_bytes;     // total of all allocations
+    size_t peak_bytes;      // max value of current_bytes
+    size_t allocation_count;// count of allocations made
+    size_t free_count;      // count of frees made
+    size_t allocation_failures; // count of allocation fails due to OOM
+} region_statistics;
+
+// Keep statistics for the regions created from now on (or stop), and for
+// the global region
+void HeapRegionEnableStatistics(int enable);
+
+// Get the statistics of a region, or for a NULL region, the totals of the process
+// returns 0 if statistics were not kept for the region
+int HeapRegionGetStatistics(HEAP_REGION rgn, region_statistics *stats);
+
+// Set a function called on the thread that runs out of memory in a region,
+// before the exception unwinds to its ENTER_HEAP_REGION (used to release
+// the locks held by verified code, see Locks_release_held)
+void HeapRegionSetOutOfMemoryHandler(void (*handler)(void));
+
 // KRML_HOST_MALLOC/CALLOC/FREE plug-ins
 void* HeapRegionMalloc(size_t cb);
 void* HeapRegionCalloc(size_t num, size_t size);
@@ -0,0 +1,328 @@
+#include <string.h>
+
+#include "Hacl_AES.h"
+#include "EverCrypt_Hash.h"
+#include "evercrypt_hacl_stubs.h"
+
+/* Runtime dispatch of the AES block function onto AES-NI. Round keys are
+ * read straight from the byte-oriented expanded key w of Hacl_AES.c, whose
+ * layout is the one AES-NI expects, so keyExpansion and the sboxes are
+ * shared by both implementations. Kernel builds keep the portable code, as
+ * they would have to save the XMM state. */
+
+#if (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)) \
+  && !defined(_KERNEL_MODE)
+#define HACL_AES_AESNI 1
+#else
+#define HACL_AES_AESNI 0
+#endif
+
+static EverCrypt_Hacl_aes_impl aes_impl = EverCrypt_Hacl_AES_PORTABLE;
+
+#if HACL_AES_AESNI
+
+#include <wmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define AESNI_TARGET
+#else
+#include <cpuid.h>
+#define AESNI_TARGET __attribute__((target("sse2,aes")))
+#endif
+
+static bool cpu_has_aesni(void)
+{
+#if defined(_MSC_VER)
+  int r[4];
+  __cpuid(r, 1);
+  return (r[2] & (1 << 25)) != 0;
+#else
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ecx & bit_AES) != 0;
+#endif
+}
+
+/* nr is 10 for AES-128 and 14 for AES-256 */
+AESNI_TARGET
+static void aesni_cipher(uint8_t *out, uint8_t *input, uint8_t *w, uint32_t nr)
+{
+  __m128i b = _mm_loadu_si128((const __m128i *)input);
+  b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)w));
+  for (uint32_t i = 1U; i < nr; i++)
+    b = _mm_aesenc_si128(b, _mm_loadu_si128((const __m128i *)(w + 16U * i)));
+  b = _mm_aesenclast_si128(b, _mm_loadu_si128((const __m128i *)(w + 16U * nr)));
+  _mm_storeu_si128((__m128i *)out, b);
+}
+
+#else
+
+static bool cpu_has_aesni(void)
+{
+  return false;
+}
+
+static void aesni_cipher(uint8_t *out, uint8_t *input, uint8_t *w, uint32_t nr)
+{
+  KRML_HOST_EPRINTF("AES-NI isn't available on this platform.  Do not call.\n");
+  KRML_HOST_EXIT(255);
+}
+
+#endif
+
+void EverCrypt_Hacl_aes_init(void)
+{
+  aes_impl = cpu_has_aesni() ? EverCrypt_Hacl_AES_AESNI : EverCrypt_Hacl_AES_PORTABLE;
+}
+
+bool EverCrypt_Hacl_aes_select(EverCrypt_Hacl_aes_impl impl)
+{
+  if (impl == EverCrypt_Hacl_AES_AESNI && !cpu_has_aesni())
+    return false;
+  aes_impl = impl;
+  return true;
+}
+
+EverCrypt_Hacl_aes_impl EverCrypt_Hacl_aes_selected(void)
+{
+  return aes_impl;
+}
+
+/* From EverCrypt.Hacl.fsti */
+void EverCrypt_Hacl_aes128_cipher(uint8_t *cipher, uint8_t *plain, uint8_t *w, uint8_t *sb)
+{
+  if (aes_impl == EverCrypt_Hacl_AES_AESNI)
+    aesni_cipher(cipher, plain, w, 10U);
+  else
+    Crypto_Symmetric_AES128_cipher(cipher, plain, w, sb);
+}
+
+/* From EverCrypt.Hacl.fsti */
+void EverCrypt_Hacl_aes256_cipher(uint8_t *cipher, uint8_t *plain, uint8_t *w, uint8_t *sb)
+{
+  if (aes_impl == EverCrypt_Hacl_AES_AESNI)
+    aesni_cipher(cipher, plain, w, 14U);
+  else
+    Crypto_Symmetric_AES_cipher(cipher, plain, w, sb);
+}
+
+/* Keyed HMAC on top of EverCrypt.Hash, for HKDF-Expand and the TLS 1.0-1.2
+ * P_hash (the default of EverCrypt.fst; OpenSSL is only used when
+ * configured). As in evercrypt_openssl.c, the secret is keyed once: the
+ * state holds the hash states after key ^ ipad and key ^ opad, and each
+ * HMAC copies them into a scratch state, so each block only hashes its own
+ * input and nothing is allocated after hmac_create. The hash states are
+ * allocated by EverCrypt.Hash, the rest in the current heap region. A state
+ * is used by one thread at a time. */
+
+#define HACL_HMAC_MAX_BLOCK 128
+#define HACL_HMAC_MAX_HASH 64
+
+typedef struct {
+  Spec_Hash_Definitions_hash_alg a;
+  EverCrypt_Hash_state_s *inner;   // after key ^ ipad
+  EverCrypt_Hash_state_s *outer;   // after key ^ opad
+  EverCrypt_Hash_state_s *scratch; // the HMAC in progress
+  uint8_t buf[HACL_HMAC_MAX_BLOCK]; // its input not yet hashed
+  uint32_t buf_len;
+  uint64_t hashed;                  // its input hashed, with the pad block
+} hacl_hmac_state;
+
+static uint32_t hacl_hash_block(Spec_Hash_Definitions_hash_alg a)
+{
+  return (a == Spec_Hash_Definitions_SHA2_384 || a == Spec_Hash_Definitions_SHA2_512) ? 128 : 64;
+}
+
+static uint32_t hacl_hash_len(Spec_Hash_Definitions_hash_alg a)
+{
+  switch(a)
+  {
+    case Spec_Hash_Definitions_MD5: return 16;
+    case Spec_Hash_Definitions_SHA1: return 20;
+    case Spec_Hash_Definitions_SHA2_224: return 28;
+    case Spec_Hash_Definitions_SHA2_256: return 32;
+    case Spec_Hash_Definitions_SHA2_384: return 48;
+    case Spec_Hash_Definitions_SHA2_512: return 64;
+    default: return 0;
+  }
+}
+
+static void hacl_wipe(void *p, size_t len)
+{
+  volatile uint8_t *b = (volatile uint8_t*)p;
+  while (len--) *b++ = 0;
+}
+
+static void hacl_hmac_start(hacl_hmac_state *st)
+{
+  EverCrypt_Hash_copy(st->inner, st->scratch);
+  st->buf_len = 0;
+  st->hashed = hacl_hash_block(st->a);
+}
+
+static void hacl_hmac_update(hacl_hmac_state *st, uint8_t *in, uint32_t in_len)
+{
+  uint32_t block = hacl_hash_block(st->a);
+
+  while (in_len > 0)
+  {
+    if (st->buf_len == 0 && in_len >= block)
+    {
+      uint32_t n = in_len / block * block;
+      EverCrypt_Hash_update_multi(st->scratch, in, n);
+      st->hashed += n;
+      in += n;
+      in_len -= n;
+      continue;
+    }
+
+    uint32_t n = block - st->buf_len < in_len ? block - st->buf_len : in_len;
+    memcpy(st->buf + st->buf_len, in, n);
+    st->buf_len += n;
+    in += n;
+    in_len -= n;
+    if (st->buf_len == block)
+    {
+      EverCrypt_Hash_update(st->scratch, st->buf);
+      st->hashed += block;
+      st->buf_len = 0;
+    }
+  }
+}
+
+/* Writes the HMAC into out, hacl_hash_len bytes */
+static void hacl_hmac_finish(hacl_hmac_state *st, uint8_t *out)
+{
+  uint8_t ih[HACL_HMAC_MAX_HASH];
+  uint32_t hash_len = hacl_hash_len(st->a);
+
+  // buf_len < block, and hash_len < block for all algorithms
+  EverCrypt_Hash_update_last(st->scratch, st->hashed, st->buf, st->buf_len);
+  EverCrypt_Hash_finish(st->scratch, ih);
+
+  EverCrypt_Hash_copy(st->outer, st->scratch);
+  EverCrypt_Hash_update_last(st->scratch, hacl_hash_block(st->a), ih, hash_len);
+  EverCrypt_Hash_finish(st->scratch, out);
+
+  EverCrypt_Hash_init(st->scratch);
+  hacl_wipe(st->buf, sizeof(st->buf));
+  hacl_wipe(ih, sizeof(ih));
+}
+
+/* From EverCrypt.Hacl.fsti */
+void EverCrypt_Hacl_hmac_free(void* st)
+{
+  hacl_hmac_state *s = (hacl_hmac_state*)st;
+
+  // init overwrites the keyed hash states before they are freed
+  EverCrypt_Hash_init(s->inner);
+  EverCrypt_Hash_init(s->outer);
+  EverCrypt_Hash_free(s->inner);
+  EverCrypt_Hash_free(s->outer);
+  EverCrypt_Hash_free(s->scratch);
+  hacl_wipe(s, sizeof(hacl_hmac_state));
+  KRML_HOST_FREE(s);
+}
+
+/* From EverCrypt.Hacl.fsti */
+void* EverCrypt_Hacl_hmac_create(Spec_Hash_Definitions_hash_alg a, uint8_t *key, uint32_t key_len)
+{
+  hacl_hmac_state *st;
+  uint8_t k[HACL_HMAC_MAX_BLOCK], pad[HACL_HMAC_MAX_BLOCK];
+  uint32_t block = hacl_hash_block(a);
+
+  if (hacl_hash_len(a) == 0)
+  {
+    KRML_HOST_EPRINTF("Unsupported HMAC algorithm %d\n", (int)a);
+    return NULL;
+  }
+
+  if (!(st = KRML_HOST_MALLOC(sizeof(hacl_hmac_state))))
+    return NULL;
+  st->a = a;
+  st->inner = EverCrypt_Hash_create_in(a);
+  st->outer = EverCrypt_Hash_create_in(a);
+  st->scratch = EverCrypt_Hash_create_in(a);
+
+  // Keys longer than a block are hashed first (RFC 2104)
+  memset(k, 0, sizeof(k));
+  if (key_len > block)
+    EverCrypt_Hash_hash(a, k, key, key_len);
+  else
+    memcpy(k, key, key_len);
+
+  for (uint32_t i = 0; i < block; i++) pad[i] = k[i] ^ 0x36;
+  EverCrypt_Hash_init(st->inner);
+  EverCrypt_Hash_update(st->inner, pad);
+  for (uint32_t i = 0; i < block; i++) pad[i] = k[i] ^ 0x5c;
+  EverCrypt_Hash_init(st->outer);
+  EverCrypt_Hash_update(st->outer, pad);
+
+  hacl_wipe(k, sizeof(k));
+  hacl_wipe(pad, sizeof(pad));
+  return (void*)st;
+}
+
+/* From EverCrypt.Hacl.fsti
+ * T(i) = HMAC(PRK, T(i-1) | info | i) */
+void EverCrypt_Hacl_hkdf_expand(void* st, uint8_t *okm, uint8_t *info, uint32_t info_len, uint32_t len)
+{
+  hacl_hmac_state *s = (hacl_hmac_state*)st;
+  uint8_t t[HACL_HMAC_MAX_HASH];
+  uint32_t hash_len = hacl_hash_len(s->a), t_len = 0, pos = 0;
+  uint8_t counter = 1;
+
+  while (pos < len)
+  {
+    hacl_hmac_start(s);
+    hacl_hmac_update(s, t, t_len);
+    hacl_hmac_update(s, info, info_len);
+    hacl_hmac_update(s, &counter, 1);
+    hacl_hmac_finish(s, t);
+    t_len = hash_len;
+
+    uint32_t n = len - pos < t_len ? len - pos : t_len;
+    memcpy(okm + pos, t, n);
+    pos += n;
+    counter++;
+  }
+
+  hacl_wipe(t, sizeof(t));
+}
+
+/* From EverCrypt.Hacl.fsti
+ * A(i) = HMAC(secret, A(i-1)), with A(0) = seed;
+ * P_hash = HMAC(secret, A(1) | seed) | HMAC(secret, A(2) | seed) | ... */
+void EverCrypt_Hacl_p_hash(void* st, uint8_t *out, uint8_t *seed, uint32_t seed_len, uint32_t len)
+{
+  hacl_hmac_state *s = (hacl_hmac_state*)st;
+  uint8_t a[HACL_HMAC_MAX_HASH], p[HACL_HMAC_MAX_HASH];
+  uint32_t hash_len = hacl_hash_len(s->a), pos = 0;
+
+  hacl_hmac_start(s);
+  hacl_hmac_update(s, seed, seed_len);
+  hacl_hmac_finish(s, a);
+
+  while (pos < len)
+  {
+    hacl_hmac_start(s);
+    hacl_hmac_update(s, a, hash_len);
+    hacl_hmac_update(s, seed, seed_len);
+    hacl_hmac_finish(s, p);
+
+    uint32_t n = len - pos < hash_len ? len - pos : hash_len;
+    memcpy(out + pos, p, n);
+    pos += n;
+
+    if (pos < len)
+    {
+      hacl_hmac_start(s);
+      hacl_hmac_update(s, a, hash_len);
+      hacl_hmac_finish(s, a);
+    }
+  }
+
+  hacl_wipe(a, sizeof(a));
+  hacl_wipe(p, sizeof(p));
+}
@@ -0,0 +1,34 @@
+#ifndef HEADER_EVERCRYPT_HACL_STUBS_H
+#define HEADER_EVERCRYPT_HACL_STUBS_H
+
+// The AES block functions and the keyed HMAC of EverCrypt.Hacl.fsti,
+// implemented in evercrypt_hacl_stubs.c on top of the vendored Hacl_AES.c
+// and of EverCrypt.Hash
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Implementations of EverCrypt_Hacl_aes128_cipher and
+// EverCrypt_Hacl_aes256_cipher. Both use the expanded key of the Hacl_AES.c
+// keyExpansion, so a key expanded before a switch stays valid after it.
+typedef enum
+{
+  EverCrypt_Hacl_AES_PORTABLE,
+  EverCrypt_Hacl_AES_AESNI
+}
+EverCrypt_Hacl_aes_impl;
+
+// Select the fastest implementation supported by this CPU (CPUID);
+// called once by FFI_mitls_init. Until then the portable code is used.
+void EverCrypt_Hacl_aes_init(void);
+
+// Select impl, for benchmarks and tests; returns false, leaving the
+// current selection unchanged, if this CPU or build does not support it.
+bool EverCrypt_Hacl_aes_select(EverCrypt_Hacl_aes_impl impl);
+
+EverCrypt_Hacl_aes_impl EverCrypt_Hacl_aes_selected(void);
+
+void EverCrypt_Hacl_aes128_cipher(uint8_t *cipher, uint8_t *plain, uint8_t *w, uint8_t *sb);
+void EverCrypt_Hacl_aes256_cipher(uint8_t *cipher, uint8_t *plain, uint8_t *w, uint8_t *sb);
+
+#endif // HEADER_EVERCRYPT_HACL_STUBS_H
@@ -4,11 +4,17 @@
 #include <openssl/dh.h>
 #include <openssl/ec.h>
 #include <openssl/ecdh.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "krml/internal/target.h"
 #include "internal/EverCrypt_Lib.h"
+#include "keyshare_pool.h"
+#include "seal_pool.h"
 
 /* KB, BB, JP: for now, we just ignore internal errors since the HACL* interface
  * has enough preconditions to make sure that no errors ever happen; if the
@@ -165,40 +171,794 @@ uint32_t EverCrypt_OpenSSL_chacha20_poly1305_decrypt(uint8_t *key, uint8_t *iv,
 #endif
 }
 
+/* A keyed AEAD state holds one context per direction, so that a reader
+ * and a writer sharing the state (see AEADProvider.genReader) never
+ * interleave their use of a single context. Both are keyed once: the
+ * second context is a copy of the first, without a new key schedule.
+ * Each record then only sets its IV. */
+typedef struct {
+  EVP_CIPHER_CTX *dec;
+  EVP_CIPHER_CTX *enc;
+} openssl_aead_state;
+
+static const EVP_CIPHER *openssl_aead_cipher(uint8_t alg)
+{
+  if(alg == 0) return EVP_aes_128_gcm();
+  if(alg == 1) return EVP_aes_256_gcm();
+#ifndef OPENSSL_IS_BORINGSSL
+  if(alg == 2) return EVP_chacha20_poly1305();
+#endif
+  return NULL;
+}
+
 void* EverCrypt_OpenSSL_aead_create(uint8_t alg, uint8_t *key)
 {
   const EVP_CIPHER *a;
-  EVP_CIPHER_CTX *ctx;
+  openssl_aead_state *st;
   
-  if(alg == 0) a = EVP_aes_128_gcm();
-  else if(alg == 1) a = EVP_aes_256_gcm();
-#ifndef OPENSSL_IS_BORINGSSL
-  else if(alg == 2) a = EVP_chacha20_poly1305();
-#endif
-  else{ handleErrors(); return NULL; }
+  if(!(a = openssl_aead_cipher(alg))){ handleErrors(); return NULL; }
+
+  if (!(st = OPENSSL_malloc(sizeof(openssl_aead_state))))
+  {
+    handleErrors();
+    return NULL;
+  }
 
-  ctx = openssl_create(a, key);
-  if(ctx == NULL) handleErrors();
+  st->enc = openssl_create(a, key);
+  st->dec = EVP_CIPHER_CTX_new();
+  if (st->enc == NULL || st->dec == NULL || 1 != EVP_CIPHER_CTX_copy(st->dec, st->enc))
+  {
+    handleErrors();
+    openssl_free(st->enc);
+    openssl_free(st->dec);
+    OPENSSL_free(st);
+    return NULL;
+  }
 
-  return (void*)ctx;
+  return (void*)st;
 }
 
-void EverCrypt_OpenSSL_aead_encrypt(void* ctx, uint8_t *iv, uint8_t *aad, uint32_t aad_len,
+void EverCrypt_OpenSSL_aead_encrypt(void* st, uint8_t *iv, uint8_t *aad, uint32_t aad_len,
                                     uint8_t *plaintext, uint32_t plaintext_len, uint8_t *ciphertext, uint8_t *tag)
 {
-  if(!openssl_aead((EVP_CIPHER_CTX*)ctx, 1, iv, aad, aad_len, plaintext, plaintext_len, ciphertext, tag))
+  if(!openssl_aead(((openssl_aead_state*)st)->enc, 1, iv, aad, aad_len, plaintext, plaintext_len, ciphertext, tag))
     handleErrors();
 }
 
-uint32_t EverCrypt_OpenSSL_aead_decrypt(void* ctx, uint8_t *iv, uint8_t *aad, uint32_t aad_len,
+uint32_t EverCrypt_OpenSSL_aead_decrypt(void* st, uint8_t *iv, uint8_t *aad, uint32_t aad_len,
                                     uint8_t *plaintext, uint32_t plaintext_len, uint8_t *ciphertext, uint8_t *tag)
 {
-  return openssl_aead((EVP_CIPHER_CTX*)ctx, 0, iv, aad, aad_len, plaintext, plaintext_len, ciphertext, tag);
+  return openssl_aead(((openssl_aead_state*)st)->dec, 0, iv, aad, aad_len, plaintext, plaintext_len, ciphertext, tag);
+}
+
+void EverCrypt_OpenSSL_aead_free(void* st)
+{
+  if (st == NULL)
+    return;
+  openssl_free(((openssl_aead_state*)st)->enc);
+  openssl_free(((openssl_aead_state*)st)->dec);
+  OPENSSL_free(st);
+}
+
+/* Pool of threads sealing TLS 1.3 records, see seal_pool.h */
+
+#define SEAL_HEADER_LEN 5
+#define SEAL_TAG_LEN 16
+#define SEAL_MAX_FRAGMENT 16384
+
+typedef struct {
+  const EVP_CIPHER *cipher;
+  const uint8_t *key;
+  const uint8_t *iv;     // static IV
+  uint64_t seqn;         // of the first record
+  uint8_t ct;            // inner content type
+  const uint8_t *plain;
+  uint32_t len;
+  uint32_t fraglen;
+  uint32_t count;        // records
+  uint8_t *out;          // count records of SEAL_HEADER_LEN + fraglen + 1 + SEAL_TAG_LEN bytes, the last one shorter
+  uint32_t next;         // next record to seal, taken atomically
+  int failed;
+} seal_job;
+
+typedef struct {
+  pthread_t thread;
+  EVP_CIPHER_CTX *ctx;
+} seal_worker;
+
+static pthread_mutex_t seal_busy = PTHREAD_MUTEX_INITIALIZER; // held while a job runs, or the pool is resized
+static pthread_mutex_t seal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t seal_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t seal_done = PTHREAD_COND_INITIALIZER;
+static seal_worker seal_workers[SEAL_POOL_MAX_THREADS]; // [0] is used by the caller
+static uint32_t seal_started;   // workers running, seal_workers[1..seal_started]
+static uint32_t seal_threads;   // seal_started + 1, or 0 when stopped; read without the lock
+static uint64_t seal_generation; // one per job
+static uint32_t seal_active;    // workers still on the current job
+static int seal_stopping;
+static seal_job *seal_current;
+
+// Seals record k of job at its final offset: the header (also the
+// additional data), then the encrypted fragment and content type, then
+// the tag. The nonce is the static IV xored with the sequence number.
+static int seal_record(EVP_CIPHER_CTX *ctx, seal_job *job, uint32_t k)
+{
+  uint32_t off = k * job->fraglen;
+  uint32_t flen = job->len - off < job->fraglen ? job->len - off : job->fraglen;
+  uint32_t clen = flen + 1 + SEAL_TAG_LEN;
+  uint8_t *hdr = job->out + (size_t)k * (SEAL_HEADER_LEN + job->fraglen + 1 + SEAL_TAG_LEN);
+  uint8_t *cipher = hdr + SEAL_HEADER_LEN;
+  uint64_t seqn = job->seqn + k;
+  uint8_t iv[12];
+  int n;
+
+  hdr[0] = 0x17;
+  hdr[1] = 0x03;
+  hdr[2] = 0x03;
+  hdr[3] = (uint8_t)(clen >> 8);
+  hdr[4] = (uint8_t)clen;
+  memcpy(iv, job->iv, 12);
+  for (int j = 0; j < 8; j++) {
+    iv[4 + j] ^= (uint8_t)(seqn >> (56 - 8 * j));
+  }
+
+  return 1 == EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, 1)
+    && 1 == EVP_CipherUpdate(ctx, NULL, &n, hdr, SEAL_HEADER_LEN)
+    && (flen == 0 || 1 == EVP_CipherUpdate(ctx, cipher, &n, job->plain + off, flen))
+    && 1 == EVP_CipherUpdate(ctx, cipher + flen, &n, &job->ct, 1)
+    && 1 == EVP_CipherFinal_ex(ctx, cipher + flen + 1, &n)
+    && 1 == EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, SEAL_TAG_LEN, cipher + flen + 1);
+}
+
+// Seals records of job until there are none left. The key schedule is
+// wiped from the worker's context before returning, so that the idle
+// pool holds no traffic keys.
+static void seal_run(seal_job *job, seal_worker *w)
+{
+  if (1 != EVP_CipherInit_ex(w->ctx, job->cipher, NULL, job->key, NULL, 1)) {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+  } else {
+    for (;;) {
+      uint32_t k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+      if (k >= job->count) {
+        break;
+      }
+      if (!seal_record(w->ctx, job, k)) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  EVP_CIPHER_CTX_reset(w->ctx);
+}
+
+static void *seal_thread(void *arg)
+{
+  seal_worker *w = arg;
+  pthread_mutex_lock(&seal_lock);
+  uint64_t seen = seal_generation;
+  for (;;) {
+    while (!seal_stopping && seal_generation == seen) {
+      pthread_cond_wait(&seal_start, &seal_lock);
+    }
+    if (seal_stopping) {
+      break;
+    }
+    seen = seal_generation;
+    seal_job *job = seal_current;
+    pthread_mutex_unlock(&seal_lock);
+    seal_run(job, w);
+    pthread_mutex_lock(&seal_lock);
+    if (--seal_active == 0) {
+      pthread_cond_signal(&seal_done);
+    }
+  }
+  pthread_mutex_unlock(&seal_lock);
+  return NULL;
+}
+
+// Called with seal_busy held
+static void seal_stop(void)
+{
+  pthread_mutex_lock(&seal_lock);
+  seal_stopping = 1;
+  __atomic_store_n(&seal_threads, 0, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&seal_start);
+  pthread_mutex_unlock(&seal_lock);
+  for (uint32_t i = 1; i <= seal_started; i++) {
+    pthread_join(seal_workers[i].thread, NULL);
+    openssl_free(seal_workers[i].ctx);
+    seal_workers[i].ctx = NULL;
+  }
+  seal_started = 0;
+  seal_stopping = 0;
+}
+
+int SealPool_configure(uint32_t threads)
+{
+  if (threads > SEAL_POOL_MAX_THREADS) {
+    threads = SEAL_POOL_MAX_THREADS;
+  }
+  int r = 1;
+  pthread_mutex_lock(&seal_busy);
+  seal_stop();
+  if (threads > 1 && seal_workers[0].ctx == NULL) {
+    seal_workers[0].ctx = EVP_CIPHER_CTX_new();
+    r = (seal_workers[0].ctx != NULL);
+  }
+  for (uint32_t i = 1; r && i < threads; i++) {
+    seal_worker *w = &seal_workers[i];
+    if (!(w->ctx = EVP_CIPHER_CTX_new())) {
+      r = 0;
+    } else if (pthread_create(&w->thread, NULL, seal_thread, w) != 0) {
+      openssl_free(w->ctx);
+      w->ctx = NULL;
+      r = 0;
+    } else {
+      seal_started = i;
+    }
+  }
+  __atomic_store_n(&seal_threads, seal_started ? seal_started + 1 : 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&seal_busy);
+  return r;
+}
+
+void SealPool_cleanup(void)
+{
+  pthread_mutex_lock(&seal_busy);
+  seal_stop();
+  openssl_free(seal_workers[0].ctx);
+  seal_workers[0].ctx = NULL;
+  pthread_mutex_unlock(&seal_busy);
+}
+
+uint32_t EverCrypt_OpenSSL_aead_seal_threads()
+{
+  return __atomic_load_n(&seal_threads, __ATOMIC_RELAXED);
+}
+
+/* Seals plain, split into fragments of fraglen bytes with inner content
+ * type ct, as the TLS 1.3 records seqn, seqn+1, ... and returns the
+ * length of the records written to out, or 0 if the pool did not seal
+ * them (it is stopped or busy, or there is only one record): the caller
+ * then seals them itself. */
+uint32_t EverCrypt_OpenSSL_aead_seal_records(uint8_t alg, uint8_t *key, uint8_t *iv,
+  uint64_t seqn, uint8_t ct, uint8_t *plain, uint32_t len, uint32_t fraglen, uint8_t *out)
+{
+  const EVP_CIPHER *cipher = openssl_aead_cipher(alg);
+  if (cipher == NULL || fraglen == 0 || fraglen > SEAL_MAX_FRAGMENT
+      || len <= fraglen || __atomic_load_n(&seal_threads, __ATOMIC_RELAXED) < 2) {
+    return 0;
+  }
+  if (pthread_mutex_trylock(&seal_busy) != 0) {
+    return 0;
+  }
+  if (seal_started == 0) {
+    pthread_mutex_unlock(&seal_busy);
+    return 0;
+  }
+
+  seal_job job = {
+    .cipher = cipher, .key = key, .iv = iv, .seqn = seqn, .ct = ct,
+    .plain = plain, .len = len, .fraglen = fraglen,
+    .count = (len + fraglen - 1) / fraglen, .out = out,
+  };
+  pthread_mutex_lock(&seal_lock);
+  seal_current = &job;
+  seal_active = seal_started;
+  seal_generation++;
+  pthread_cond_broadcast(&seal_start);
+  pthread_mutex_unlock(&seal_lock);
+
+  seal_run(&job, &seal_workers[0]);
+
+  pthread_mutex_lock(&seal_lock);
+  while (seal_active > 0) {
+    pthread_cond_wait(&seal_done, &seal_lock);
+  }
+  seal_current = NULL;
+  pthread_mutex_unlock(&seal_lock);
+  pthread_mutex_unlock(&seal_busy);
+
+  if (job.failed) {
+    handleErrors();
+    return 0;
+  }
+  return len + job.count * (SEAL_HEADER_LEN + 1 + SEAL_TAG_LEN);
+}
+
+/* Keyed HMAC, for HKDF-Expand and the TLS 1.0-1.2 P_hash
+ *
+ * The secret is keyed once: the state holds the hash states after
+ * key ^ ipad and key ^ opad, so each block only hashes its own input.
+ * The state is allocated in the current heap region, like the rest of
+ * the key schedule, rather than by OpenSSL: an out-of-memory exit or a
+ * failure between create and free does not leak it. A state is used by
+ * one thread at a time. */
+
+typedef union {
+  MD5_CTX md5;
+  SHA_CTX sha1;
+  SHA256_CTX sha256; // and SHA-224
+  SHA512_CTX sha512; // and SHA-384
+} openssl_hash_ctx;
+
+typedef struct {
+  Spec_Hash_Definitions_hash_alg a;
+  openssl_hash_ctx inner;
+  openssl_hash_ctx outer;
+} openssl_hmac_state;
+
+#define HMAC_MAX_BLOCK 128
+
+static uint32_t openssl_hash_block(Spec_Hash_Definitions_hash_alg a)
+{
+  return (a == Spec_Hash_Definitions_SHA2_384 || a == Spec_Hash_Definitions_SHA2_512) ? 128 : 64;
+}
+
+static uint32_t openssl_hash_len(Spec_Hash_Definitions_hash_alg a)
+{
+  switch(a)
+  {
+    case Spec_Hash_Definitions_MD5: return MD5_DIGEST_LENGTH;
+    case Spec_Hash_Definitions_SHA1: return SHA_DIGEST_LENGTH;
+    case Spec_Hash_Definitions_SHA2_224: return SHA224_DIGEST_LENGTH;
+    case Spec_Hash_Definitions_SHA2_256: return SHA256_DIGEST_LENGTH;
+    case Spec_Hash_Definitions_SHA2_384: return SHA384_DIGEST_LENGTH;
+    case Spec_Hash_Definitions_SHA2_512: return SHA512_DIGEST_LENGTH;
+    default: return 0;
+  }
+}
+
+static int openssl_hash_init(Spec_Hash_Definitions_hash_alg a, openssl_hash_ctx *c)
+{
+  switch(a)
+  {
+    case Spec_Hash_Definitions_MD5: return MD5_Init(&c->md5);
+    case Spec_Hash_Definitions_SHA1: return SHA1_Init(&c->sha1);
+    case Spec_Hash_Definitions_SHA2_224: return SHA224_Init(&c->sha256);
+    case Spec_Hash_Definitions_SHA2_256: return SHA256_Init(&c->sha256);
+    case Spec_Hash_Definitions_SHA2_384: return SHA384_Init(&c->sha512);
+    case Spec_Hash_Definitions_SHA2_512: return SHA512_Init(&c->sha512);
+    default: return 0;
+  }
+}
+
+static int openssl_hash_update(Spec_Hash_Definitions_hash_alg a, openssl_hash_ctx *c, const uint8_t *in, size_t in_len)
+{
+  if (in_len == 0) return 1;
+  switch(a)
+  {
+    case Spec_Hash_Definitions_MD5: return MD5_Update(&c->md5, in, in_len);
+    case Spec_Hash_Definitions_SHA1: return SHA1_Update(&c->sha1, in, in_len);
+    case Spec_Hash_Definitions_SHA2_224: return SHA224_Update(&c->sha256, in, in_len);
+    case Spec_Hash_Definitions_SHA2_256: return SHA256_Update(&c->sha256, in, in_len);
+    case Spec_Hash_Definitions_SHA2_384: return SHA384_Update(&c->sha512, in, in_len);
+    case Spec_Hash_Definitions_SHA2_512: return SHA512_Update(&c->sha512, in, in_len);
+    default: return 0;
+  }
+}
+
+static int openssl_hash_final(Spec_Hash_Definitions_hash_alg a, openssl_hash_ctx *c, uint8_t *out)
+{
+  switch(a)
+  {
+    case Spec_Hash_Definitions_MD5: return MD5_Final(out, &c->md5);
+    case Spec_Hash_Definitions_SHA1: return SHA1_Final(out, &c->sha1);
+    case Spec_Hash_Definitions_SHA2_224: return SHA224_Final(out, &c->sha256);
+    case Spec_Hash_Definitions_SHA2_256: return SHA256_Final(out, &c->sha256);
+    case Spec_Hash_Definitions_SHA2_384: return SHA384_Final(out, &c->sha512);
+    case Spec_Hash_Definitions_SHA2_512: return SHA512_Final(out, &c->sha512);
+    default: return 0;
+  }
 }
 
-void EverCrypt_OpenSSL_aead_free(void* ctx)
+void EverCrypt_OpenSSL_hmac_free(void* st)
 {
-  openssl_free((EVP_CIPHER_CTX *)ctx);
+  OPENSSL_cleanse(st, sizeof(openssl_hmac_state));
+  KRML_HOST_FREE(st);
+}
+
+void* EverCrypt_OpenSSL_hmac_create(Spec_Hash_Definitions_hash_alg a, uint8_t *key, uint32_t key_len)
+{
+  openssl_hmac_state *st;
+  uint8_t k[HMAC_MAX_BLOCK], pad[HMAC_MAX_BLOCK];
+  uint32_t block = openssl_hash_block(a);
+  int ok;
+
+  if (openssl_hash_len(a) == 0)
+  {
+    handleErrors();
+    return NULL;
+  }
+
+  if (!(st = KRML_HOST_MALLOC(sizeof(openssl_hmac_state))))
+  {
+    handleErrors();
+    return NULL;
+  }
+  st->a = a;
+
+  // Keys longer than a block are hashed first (RFC 2104)
+  memset(k, 0, sizeof(k));
+  if (key_len > block)
+  {
+    ok = openssl_hash_init(a, &st->inner)
+      && openssl_hash_update(a, &st->inner, key, key_len)
+      && openssl_hash_final(a, &st->inner, k);
+  }
+  else
+  {
+    memcpy(k, key, key_len);
+    ok = 1;
+  }
+
+  for (uint32_t i = 0; i < block; i++) pad[i] = k[i] ^ 0x36;
+  ok = ok && openssl_hash_init(a, &st->inner) && openssl_hash_update(a, &st->inner, pad, block);
+  for (uint32_t i = 0; i < block; i++) pad[i] = k[i] ^ 0x5c;
+  ok = ok && openssl_hash_init(a, &st->outer) && openssl_hash_update(a, &st->outer, pad, block);
+
+  OPENSSL_cleanse(k, sizeof(k));
+  OPENSSL_cleanse(pad, sizeof(pad));
+  if (!ok)
+  {
+    handleErrors();
+    EverCrypt_OpenSSL_hmac_free(st);
+    return NULL;
+  }
+  return (void*)st;
+}
+
+/* HMAC(key, in1 | in2 | in3) with the key state of st */
+static int openssl_hmac3(openssl_hmac_state *st,
+  const uint8_t *in1, size_t in1_len,
+  const uint8_t *in2, size_t in2_len,
+  const uint8_t *in3, size_t in3_len,
+  uint8_t *out, unsigned int *out_len)
+{
+  Spec_Hash_Definitions_hash_alg a = st->a;
+  openssl_hash_ctx c = st->inner;
+  uint8_t ih[EVP_MAX_MD_SIZE];
+  int ok = openssl_hash_update(a, &c, in1, in1_len)
+    && openssl_hash_update(a, &c, in2, in2_len)
+    && openssl_hash_update(a, &c, in3, in3_len)
+    && openssl_hash_final(a, &c, ih);
+
+  c = st->outer;
+  ok = ok && openssl_hash_update(a, &c, ih, openssl_hash_len(a))
+    && openssl_hash_final(a, &c, out);
+  *out_len = openssl_hash_len(a);
+
+  OPENSSL_cleanse(&c, sizeof(c));
+  OPENSSL_cleanse(ih, sizeof(ih));
+  return ok;
+}
+
+/* T(i) = HMAC(PRK, T(i-1) | info | i) */
+void EverCrypt_OpenSSL_hkdf_expand(void* st, uint8_t *okm, uint8_t *info, uint32_t info_len, uint32_t len)
+{
+  openssl_hmac_state *ctx = (openssl_hmac_state*)st;
+  uint8_t t[EVP_MAX_MD_SIZE];
+  unsigned int t_len = 0;
+  uint8_t counter = 1;
+  uint32_t pos = 0;
+
+  while (pos < len)
+  {
+    if (!openssl_hmac3(ctx, t, t_len, info, info_len, &counter, 1, t, &t_len))
+    {
+      handleErrors();
+      break;
+    }
+
+    uint32_t n = len - pos < t_len ? len - pos : t_len;
+    memcpy(okm + pos, t, n);
+    pos += n;
+    counter++;
+  }
+
+  OPENSSL_cleanse(t, sizeof(t));
+}
+
+/* A(i) = HMAC(secret, A(i-1)), with A(0) = seed;
+ * P_hash = HMAC(secret, A(1) | seed) | HMAC(secret, A(2) | seed) | ... */
+void EverCrypt_OpenSSL_p_hash(void* st, uint8_t *out, uint8_t *seed, uint32_t seed_len, uint32_t len)
+{
+  openssl_hmac_state *ctx = (openssl_hmac_state*)st;
+  uint8_t a[EVP_MAX_MD_SIZE], p[EVP_MAX_MD_SIZE];
+  unsigned int a_len, p_len;
+  uint32_t pos = 0;
+
+  if (!openssl_hmac3(ctx, seed, seed_len, NULL, 0, NULL, 0, a, &a_len))
+  {
+    handleErrors();
+    return;
+  }
+
+  while (pos < len)
+  {
+    if (!openssl_hmac3(ctx, a, a_len, seed, seed_len, NULL, 0, p, &p_len))
+    {
+      handleErrors();
+      break;
+    }
+
+    uint32_t n = len - pos < p_len ? len - pos : p_len;
+    memcpy(out + pos, p, n);
+    pos += n;
+
+    if (pos < len && !openssl_hmac3(ctx, a, a_len, NULL, 0, NULL, 0, a, &a_len))
+    {
+      handleErrors();
+      break;
+    }
+  }
+
+  OPENSSL_cleanse(a, sizeof(a));
+  OPENSSL_cleanse(p, sizeof(p));
+}
+
+/* Pools of pre-generated key pairs, see keyshare_pool.h */
+
+typedef struct {
+  const char *name;
+  int nid;          // EC curve, or NID_undef for an FFDHE group
+  int dh_bits;      // FFDHE modulus size
+  DH *params;       // FFDHE parameters, copied at the first keygen in the group
+  void **keys;      // EC_KEY* or DH*, each taken once
+  uint32_t count;
+  uint32_t depth;
+  uint64_t hits, misses, generated;
+} keyshare_pool;
+
+static keyshare_pool keyshare_pools[] = {
+  { "P-256", NID_X9_62_prime256v1 },
+  { "P-384", NID_secp384r1 },
+  { "P-521", NID_secp521r1 },
+  { "FFDHE2048", NID_undef, 2048 },
+  { "FFDHE3072", NID_undef, 3072 },
+  { "FFDHE4096", NID_undef, 4096 },
+  { "FFDHE6144", NID_undef, 6144 },
+  { "FFDHE8192", NID_undef, 8192 },
+};
+#define KEYSHARE_POOL_COUNT (sizeof(keyshare_pools) / sizeof(keyshare_pools[0]))
+
+static pthread_mutex_t keyshare_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keyshare_refill = PTHREAD_COND_INITIALIZER;
+static pthread_t keyshare_thread;
+static int keyshare_thread_started;
+static int keyshare_stopping;
+static int keyshare_enabled; // some depth is nonzero; read without the lock
+
+static keyshare_pool *keyshare_find(const char *name)
+{
+  for (size_t i = 0; i < KEYSHARE_POOL_COUNT; i++) {
+    if (strcmp(keyshare_pools[i].name, name) == 0) {
+      return &keyshare_pools[i];
+    }
+  }
+  return NULL;
+}
+
+static void keyshare_free_key(keyshare_pool *p, void *key)
+{
+  if (p->nid != NID_undef) {
+    EC_KEY_free((EC_KEY*)key);
+  } else {
+    DH_free((DH*)key);
+  }
+}
+
+// Called without the lock: params is never freed while the thread runs
+static void *keyshare_generate(keyshare_pool *p, DH *params)
+{
+  if (p->nid != NID_undef) {
+    EC_KEY *k = EC_KEY_new_by_curve_name(p->nid);
+    if (k != NULL && EC_KEY_generate_key(k) != 1) {
+      EC_KEY_free(k);
+      k = NULL;
+    }
+    return k;
+  } else {
+    DH *dh = DHparams_dup(params);
+    if (dh != NULL && DH_generate_key(dh) != 1) {
+      DH_free(dh);
+      dh = NULL;
+    }
+    return dh;
+  }
+}
+
+// Called with the lock held: the emptiest pool that can be refilled
+static keyshare_pool *keyshare_next(void)
+{
+  keyshare_pool *next = NULL;
+  for (size_t i = 0; i < KEYSHARE_POOL_COUNT; i++) {
+    keyshare_pool *p = &keyshare_pools[i];
+    if (p->count < p->depth && (p->nid != NID_undef || p->params != NULL)
+        && (next == NULL || (uint64_t)p->count * next->depth < (uint64_t)next->count * p->depth)) {
+      next = p;
+    }
+  }
+  return next;
+}
+
+static void *keyshare_refill_thread(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&keyshare_lock);
+  while (!keyshare_stopping) {
+    keyshare_pool *p = keyshare_next();
+    if (p == NULL) {
+      pthread_cond_wait(&keyshare_refill, &keyshare_lock);
+      continue;
+    }
+    DH *params = p->params;
+    pthread_mutex_unlock(&keyshare_lock);
+    void *key = keyshare_generate(p, params);
+    pthread_mutex_lock(&keyshare_lock);
+    if (key != NULL && p->count < p->depth) {
+      p->keys[p->count++] = key;
+      p->generated++;
+    } else if (key != NULL) {
+      keyshare_free_key(p, key); // the pool was shrunk meanwhile
+    }
+  }
+  pthread_mutex_unlock(&keyshare_lock);
+  return NULL;
+}
+
+// Called with the lock held; the caller owns the returned key pair
+static void *keyshare_take(keyshare_pool *p)
+{
+  void *key = NULL;
+  if (p->count > 0) {
+    key = p->keys[--p->count];
+    p->hits++;
+  } else {
+    p->misses++;
+  }
+  pthread_cond_signal(&keyshare_refill);
+  return key;
+}
+
+static EC_KEY *keyshare_take_ec(EC_KEY *k)
+{
+  if (!__atomic_load_n(&keyshare_enabled, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  int nid = EC_GROUP_get_curve_name(EC_KEY_get0_group(k));
+  EC_KEY *key = NULL;
+  pthread_mutex_lock(&keyshare_lock);
+  for (size_t i = 0; i < KEYSHARE_POOL_COUNT; i++) {
+    keyshare_pool *p = &keyshare_pools[i];
+    if (p->nid == nid && nid != NID_undef && p->depth > 0) {
+      key = keyshare_take(p);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&keyshare_lock);
+  return key;
+}
+
+static DH *keyshare_take_dh(DH *dh)
+{
+  if (!__atomic_load_n(&keyshare_enabled, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  const BIGNUM *p, *q, *g;
+  DH_get0_pqg(dh, &p, &q, &g);
+  int bits = BN_num_bits(p);
+  DH *key = NULL;
+  pthread_mutex_lock(&keyshare_lock);
+  for (size_t i = 0; i < KEYSHARE_POOL_COUNT; i++) {
+    keyshare_pool *pool = &keyshare_pools[i];
+    if (pool->nid != NID_undef || pool->dh_bits != bits || pool->depth == 0) {
+      continue;
+    }
+    if (pool->params == NULL) {
+      // The FFDHE parameters are only known to the F* code: the pool of
+      // the group starts filling after this first, inline, keygen.
+      pool->params = DHparams_dup(dh);
+      pool->misses++;
+      pthread_cond_signal(&keyshare_refill);
+    } else {
+      // Only serve the exact same group (an explicit group may have the same size)
+      const BIGNUM *pp, *pq, *pg;
+      DH_get0_pqg(pool->params, &pp, &pq, &pg);
+      if (BN_cmp(p, pp) == 0 && BN_cmp(g, pg) == 0) {
+        key = keyshare_take(pool);
+      }
+    }
+    break;
+  }
+  pthread_mutex_unlock(&keyshare_lock);
+  return key;
+}
+
+int KeySharePool_configure(const char *group, uint32_t depth)
+{
+  keyshare_pool *p = keyshare_find(group);
+  if (p == NULL) {
+    return 0;
+  }
+  if (depth > KEYSHARE_POOL_MAX_DEPTH) {
+    depth = KEYSHARE_POOL_MAX_DEPTH;
+  }
+  int r = 1;
+  pthread_mutex_lock(&keyshare_lock);
+  while (p->count > depth) {
+    keyshare_free_key(p, p->keys[--p->count]);
+  }
+  if (depth == 0) {
+    free(p->keys);
+    p->keys = NULL;
+    p->depth = 0;
+  } else {
+    void **keys = realloc(p->keys, depth * sizeof(void*));
+    if (keys == NULL) {
+      r = 0;
+    } else {
+      p->keys = keys;
+      p->depth = depth;
+    }
+  }
+  int enabled = 0;
+  for (size_t i = 0; i < KEYSHARE_POOL_COUNT; i++) {
+    enabled |= (keyshare_pools[i].depth > 0);
+  }
+  __atomic_store_n(&keyshare_enabled, enabled, __ATOMIC_RELAXED);
+  if (enabled && !keyshare_thread_started) {
+    keyshare_stopping = 0;
+    keyshare_thread_started = (pthread_create(&keyshare_thread, NULL, keyshare_refill_thread, NULL) == 0);
+    r &= keyshare_thread_started;
+  }
+  pthread_cond_signal(&keyshare_refill);
+  pthread_mutex_unlock(&keyshare_lock);
+  return r;
+}
+
+int KeySharePool_get_stats(const char *group, mitls_keyshare_pool_stats *stats)
+{
+  keyshare_pool *p = keyshare_find(group);
+  if (p == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&keyshare_lock);
+  stats->depth = p->depth;
+  stats->available = p->count;
+  stats->hits = p->hits;
+  stats->misses = p->misses;
+  stats->generated = p->generated;
+  pthread_mutex_unlock(&keyshare_lock);
+  return 1;
+}
+
+void KeySharePool_cleanup(void)
+{
+  pthread_mutex_lock(&keyshare_lock);
+  int started = keyshare_thread_started;
+  keyshare_stopping = 1;
+  keyshare_thread_started = 0;
+  __atomic_store_n(&keyshare_enabled, 0, __ATOMIC_RELAXED);
+  pthread_cond_signal(&keyshare_refill);
+  pthread_mutex_unlock(&keyshare_lock);
+  if (started) {
+    pthread_join(keyshare_thread, NULL);
+  }
+
+  pthread_mutex_lock(&keyshare_lock);
+  for (size_t i = 0; i < KEYSHARE_POOL_COUNT; i++) {
+    keyshare_pool *p = &keyshare_pools[i];
+    while (p->count > 0) {
+      keyshare_free_key(p, p->keys[--p->count]);
+    }
+    free(p->keys);
+    p->keys = NULL;
+    p->depth = 0;
+    DH_free(p->params);
+    p->params = NULL;
+  }
+  pthread_mutex_unlock(&keyshare_lock);
 }
 
 /* Diffie-Hellman */
@@ -228,7 +988,14 @@ uint32_t EverCrypt_OpenSSL_dh_keygen(void *st, uint8_t *pub)
 {
   DH *dh = (DH*)st;
   const BIGNUM *opub, *opriv;
-  DH_generate_key(dh);
+  DH *pooled = keyshare_take_dh(dh);
+  if (pooled != NULL) {
+    DH_get0_key(pooled, &opub, &opriv);
+    DH_set0_key(dh, BN_dup(opub), BN_dup(opriv));
+    DH_free(pooled);
+  } else {
+    DH_generate_key(dh);
+  }
   DH_get0_key(dh, &opub, &opriv);
   BN_bn2bin(opub, pub);
   return BN_num_bytes(opub);
@@ -293,7 +1060,14 @@ void dump(const unsigned char buffer[], size_t len)
 void EverCrypt_OpenSSL_ecdh_keygen(void* st, uint8_t *outx, uint8_t *outy)
 {
   EC_KEY *k = (EC_KEY*)st;
-  EC_KEY_generate_key(k);
+  EC_KEY *pooled = keyshare_take_ec(k);
+  if (pooled != NULL) {
+    EC_KEY_set_private_key(k, EC_KEY_get0_private_key(pooled));
+    EC_KEY_set_public_key(k, EC_KEY_get0_public_key(pooled));
+    EC_KEY_free(pooled);
+  } else {
+    EC_KEY_generate_key(k);
+  }
   
   const EC_GROUP *g = EC_KEY_get0_group(k);
   const EC_POINT *p = EC_KEY_get0_public_key(k);
@@ -0,0 +1,28 @@
+#ifndef HEADER_KEYSHARE_POOL_H
+#define HEADER_KEYSHARE_POOL_H
+
+// Pools of pre-generated Diffie-Hellman key pairs, implemented in
+// evercrypt_openssl.c and controlled from mitlsffi.c.
+//
+// The OpenSSL keygen functions of EverCrypt (and so CommonDH.keygen, for
+// P-256, P-384, P-521 and the FFDHE groups) take a key pair from the pool
+// of their group when there is one, and generate it inline otherwise.
+// A background thread refills the pools to their configured depth.
+// Each key pair is moved out of its pool when taken: it is used once.
+
+#include "mitlsffi.h"
+
+#define KEYSHARE_POOL_MAX_DEPTH 4096
+
+// Set the depth of the pool of one group, by its FFI name ("P-256",
+// "FFDHE2048", ...); 0 disables the pool and frees its key pairs.
+// Returns 0 for an unknown group, or one that is not generated by OpenSSL
+int KeySharePool_configure(const char *group, uint32_t depth);
+
+// Returns 0 for an unknown group
+int KeySharePool_get_stats(const char *group, mitls_keyshare_pool_stats *stats);
+
+// Stop the refill thread and free all pooled key pairs
+void KeySharePool_cleanup(void);
+
+#endif // HEADER_KEYSHARE_POOL_H
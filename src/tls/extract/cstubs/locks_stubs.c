@@ -0,0 +1,107 @@
+#if defined(_MSC_VER)
+  #define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+  #endif
+#elif defined(__MINGW32__)
+  #define IS_WINDOWS 1
+  #include <windows.h>
+#else // Linux or gcc/cygwin
+  #define IS_WINDOWS 0
+  #include <pthread.h>
+#endif
+
+#include <stddef.h>
+#include "Locks.h"
+
+// Native implementation of Locks.fsti.
+//
+// One lock per mutable global table.  All locks are statically
+// initialized so that they are usable from krmlinit_globals() onwards,
+// and by the internal test, which does not call FFI_mitls_init().
+//
+// Each lock records the thread that holds it, so that Locks_release_held(),
+// which FFI_mitls_init() installs as the out-of-memory handler of the
+// region allocator, can release the locks of a thread that runs out of
+// memory in a critical section.
+
+#define LOCK_COUNT (Locks_FFITicketKey + 1)
+
+#if IS_WINDOWS
+  #ifdef _KERNEL_MODE
+    static EX_PUSH_LOCK locks[LOCK_COUNT]; // zero is the initial state
+    #define CURRENT_THREAD() ((void*)KeGetCurrentThread())
+
+    static void lock(Locks_lock_id l)
+    {
+        KeEnterCriticalRegion();
+        ExfAcquirePushLockExclusive(&locks[l]);
+    }
+
+    static void unlock(Locks_lock_id l)
+    {
+        ExfReleasePushLockExclusive(&locks[l]);
+        KeLeaveCriticalRegion();
+    }
+  #else
+    static SRWLOCK locks[LOCK_COUNT] = { SRWLOCK_INIT, SRWLOCK_INIT, SRWLOCK_INIT };
+    #define CURRENT_THREAD() ((void*)(ULONG_PTR)GetCurrentThreadId())
+
+    static void lock(Locks_lock_id l)
+    {
+        AcquireSRWLockExclusive(&locks[l]);
+    }
+
+    static void unlock(Locks_lock_id l)
+    {
+        ReleaseSRWLockExclusive(&locks[l]);
+    }
+  #endif
+#else
+  static pthread_mutex_t locks[LOCK_COUNT] = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+  };
+  static __thread char current_thread; // its address identifies the thread
+  #define CURRENT_THREAD() ((void*)&current_thread)
+
+  static void lock(Locks_lock_id l)
+  {
+      pthread_mutex_lock(&locks[l]);
+  }
+
+  static void unlock(Locks_lock_id l)
+  {
+      pthread_mutex_unlock(&locks[l]);
+  }
+#endif
+
+// The holder of each lock, NULL when free.  Only the holder sets it, and
+// other threads may only read another value than their own.
+static void * volatile owners[LOCK_COUNT];
+
+void Locks_acquire(Locks_lock_id l)
+{
+    lock(l);
+    owners[l] = CURRENT_THREAD();
+}
+
+void Locks_release(Locks_lock_id l)
+{
+    owners[l] = NULL;
+    unlock(l);
+}
+
+// FFITicketKey is held by mitlsffi.c around whole heap regions, and
+// released there also after an out-of-memory exception.
+void Locks_release_held(void)
+{
+    void *self = CURRENT_THREAD();
+    for (int l = 0; l < Locks_FFITicketKey; l++) {
+        if (owners[l] == self) {
+            Locks_release((Locks_lock_id)l);
+        }
+    }
+}
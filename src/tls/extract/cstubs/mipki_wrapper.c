@@ -154,36 +154,31 @@ PKI_select(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, Parsers_ProtocolVersion_protocol
   return dst;
 }
 
-static void* append(void* chain, size_t len, char **buf)
-{
-  #if DEBUG
-    printf("PKI| FORMAT::append adding %d bytes element\n", len);
-  #endif
-
-  *buf = KRML_HOST_MALLOC(len);
-
-  Prims_list__FStar_Bytes_bytes* cur = (Prims_list__FStar_Bytes_bytes*) chain;
-  Prims_list__FStar_Bytes_bytes* new = KRML_HOST_MALLOC(sizeof(Prims_list__FStar_Bytes_bytes));
-
-  new->tag = Prims_Nil;
-  cur->tag = Prims_Cons;
-
-  cur->hd = (FStar_Bytes_bytes){.length = len, .data = *buf};
-  cur->tl = new;
-  return (void*)new;
-}
-
 Prims_list__FStar_Bytes_bytes* PKI_format(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, uint64_t cert)
 {
   mipki_state *pki = (mipki_state*)cbs;
   mipki_chain chain = (mipki_chain)cert;
+  const char *const *certs;
+  const size_t *certs_len;
 
   #if DEBUG
     KRML_HOST_PRINTF("PKI| FORMAT <%08x> CHAIN <%08x>\n", pki, chain);
   #endif
 
+  // The DER certificates are encoded once by mipki_init and live as long
+  // as the PKI state: the list references them rather than copying them
+  size_t n = mipki_get_chain_der(pki, chain, &certs, &certs_len);
   Prims_list__FStar_Bytes_bytes *res = KRML_HOST_MALLOC(sizeof(Prims_list__FStar_Bytes_bytes));
-  mipki_format_alloc(pki, chain, (void*)res, append);
+  Prims_list__FStar_Bytes_bytes *cur = res;
+
+  for(size_t i = 0; i < n; i++)
+  {
+    cur->tag = Prims_Cons;
+    cur->hd = (FStar_Bytes_bytes){.length = certs_len[i], .data = certs[i]};
+    cur->tl = KRML_HOST_MALLOC(sizeof(Prims_list__FStar_Bytes_bytes));
+    cur = cur->tl;
+  }
+  cur->tag = Prims_Nil;
   return res;
 }
 
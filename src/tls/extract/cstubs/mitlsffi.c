@@ -1,3 +1,9 @@
+#if defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+// <ucontext.h> requires it, for the asynchronous certificate callbacks;
+// _DARWIN_C_SOURCE keeps the rest of the system headers visible
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE
+#endif
 #include <memory.h>
 #include <stdarg.h>
 #if __APPLE__
@@ -18,14 +24,36 @@
 #else
 #define IS_WINDOWS 0
 #include <pthread.h>
+// makecontext/swapcontext, for the asynchronous certificate callbacks:
+// glibc, Darwin and FreeBSD have them, musl does not. Build with
+// -DMITLS_ASYNC_UCONTEXT=0 or 1 to override
+#if !defined(MITLS_ASYNC_UCONTEXT)
+  #if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__)
+    #define MITLS_ASYNC_UCONTEXT 1
+  #else
+    #define MITLS_ASYNC_UCONTEXT 0
+  #endif
+#endif
+#if MITLS_ASYNC_UCONTEXT
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #endif
 
 #include "EverCrypt.h"
 #include "Spec.h"
 #include "FFI.h"
 #include "QUIC.h"
+#include "Locks.h"
 #include "mitlsffi.h"
 #include "RegionAllocator.h"
+#include "session_cache_stubs.h"
+#include "evercrypt_hacl_stubs.h"
+#if !defined(_MSC_VER)
+#include "keyshare_pool.h" // with evercrypt_openssl.c, not in the MSVC build
+#include "seal_pool.h"
+#endif
 
 // Code was written against old auto-generated names
 #define FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_signatureScheme Negotiation_certNego
@@ -46,30 +74,99 @@ typedef void (*p_log)(const char *fmt, ...);
 p_log g_LogPrint;
 #endif
 
+// Application transport callbacks of a connection created by
+// FFI_mitls_connect/accept_connected. While corked, the records
+// written are gathered in cork[0..cork_len) and sent in one call, or
+// in several calls of at most CORK_MAX_LEN bytes.
+// With read-ahead, each recv asks for up to ahead_cap bytes, and the
+// bytes not yet consumed by the record layer are ahead[ahead_pos..ahead_len).
+typedef struct {
+  void* send_recv_ctx;
+  pfn_FFI_send send;
+  pfn_FFI_recv recv;
+
+  int corked;
+  unsigned char *cork;
+  size_t cork_len;
+  size_t cork_cap;
+
+  unsigned char *ahead;
+  size_t ahead_pos;
+  size_t ahead_len;
+  size_t ahead_cap;
+} wrapped_transport_cb;
+
+// Corked records are sent once they would exceed this many bytes, so that
+// a large corked send does not grow the buffer without bound. Larger than
+// a handshake flight with a typical certificate chain.
+#define CORK_MAX_LEN (64 * 1024)
+
+// Buffers of a connection created by FFI_mitls_engine_connect/accept,
+// in place of the application-provided send and receive callbacks
+typedef struct {
+  const unsigned char *input; // ciphertext being processed by FFI_mitls_process
+  size_t input_len;
+  size_t input_pos;
+
+  unsigned char *output;      // queued ciphertext: output[output_pos..output_len)
+  size_t output_pos;
+  size_t output_len;
+  size_t output_cap;
+
+  uint16_t flags;             // sticky TFLAG_COMPLETE and TFLAG_CLOSED
+
+  // Results of the last engine_step
+  uint16_t step_flags;        // TFLAG_WANT_READ or TFLAG_DATA
+  uint16_t tls_error;
+  int failed;
+} engine_io;
+
+// The stack on which the handshake of a connection configured with
+// FFI_mitls_configure_async_cert_callbacks runs, see async_run
+typedef struct async_step async_step;
+
+#if IS_WINDOWS
+typedef volatile LONG refcount_t;
+#define REFCOUNT_INCREMENT(p) InterlockedIncrement(p)
+#define REFCOUNT_DECREMENT(p) InterlockedDecrement(p)
+#else
+typedef volatile long refcount_t;
+#define REFCOUNT_INCREMENT(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define REFCOUNT_DECREMENT(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#endif
+
+// An immutable configuration, in its own region, shared by the connections
+// created from it. The region is destroyed with the last reference.
+struct mitls_config_template {
+  HEAP_REGION rgn;
+  TLSConstants_config cfg;
+  uint8_t is_quic;
+  uint8_t is_server; // QUIC only
+  refcount_t refcount;
+  struct mitls_config_template *parent; // referenced by cfg, or NULL
+};
+
 struct mitls_state {
   HEAP_REGION rgn;
   TLSConstants_config cfg;
+  mitls_config_template *tmpl; // shared by cfg, or NULL
   Connection_connection cxn;
+  wrapped_transport_cb *tcb; // NULL unless created by FFI_mitls_connect/accept_connected
+  engine_io *io; // NULL unless the connection is driven by FFI_mitls_process
+  async_step *async; // NULL unless pending certificate callbacks are enabled
+  struct wrapped_cert_cb *cert_cbs; // of FFI_mitls_configure_cert_callbacks, or NULL
+  size_t read_ahead; // of FFI_mitls_configure_read_ahead, or 0
+
+  // Received application data not yet delivered: plaintext[plaintext_pos..)
+  FStar_Bytes_bytes plaintext;
+  size_t plaintext_pos;
 };
 
-// BUGBUG: temporary global lock to protect global
-//         mutable variables in mitls.  Remove when
-//         the variables have their own protection.
-#if IS_WINDOWS
-  #ifdef _KERNEL_MODE
-    FAST_MUTEX lock;
-    #define LOCK_MUTEX(x) ExAcquireFastMutex (x)
-    #define UNLOCK_MUTEX(x) ExReleaseFastMutex (x)
-  #else
-    CRITICAL_SECTION lock;
-    #define LOCK_MUTEX(x) EnterCriticalSection(x)
-    #define UNLOCK_MUTEX(x) LeaveCriticalSection(x)
-  #endif
-#else
-static pthread_mutex_t lock;
-#define LOCK_MUTEX(x) pthread_mutex_lock(x)
-#define UNLOCK_MUTEX(x) pthread_mutex_unlock(x)
-#endif
+// There is no global FFI lock: distinct connections may be used
+// concurrently from distinct threads, but calls on the same connection
+// must be serialized by the caller. The few mutable globals of miTLS
+// (ticket keys, PSK and ticket tables) are protected individually,
+// see Locks.fsti.
 
 static Prims_string CopyPrimsString(const char *src)
 {
@@ -135,22 +232,25 @@ int MITLS_CALLCONV FFI_mitls_init(void)
   if (HeapRegionInitialize() == 0) {
       return 0;
   }
+  // Verified code may run out of memory while holding one of the Locks
+  HeapRegionSetOutOfMemoryHandler(Locks_release_held);
 
   if (Random_init() != 1) {
       HeapRegionCleanup();
       return 0;
   }
 
+  // Selects AES-NI for the AES block function, if the CPU has it
+  EverCrypt_Hacl_aes_init();
+
   #if IS_WINDOWS
     #ifdef _KERNEL_MODE
-    ExInitializeFastMutex(&lock);
       #if LOG_TO_CHOICE
       if (!g_LogPrint) {
         g_LogPrint = (p_log)DbgPrint;
       }
       #endif
     #else /* _KERNEL_MODE */
-    InitializeCriticalSection(&lock);
       #if LOG_TO_CHOICE
       if (!g_LogPrint) {
         if (GetEnvironmentVariableA("MITLS_LOG", NULL, 0) == 0) {
@@ -162,10 +262,6 @@ int MITLS_CALLCONV FFI_mitls_init(void)
       #endif
     #endif /* _KERNEL_MODE */
   #else /* IS_WINDOWS */
-  if (pthread_mutex_init(&lock, NULL) != 0) {
-    HeapRegionCleanup();
-    return 0;
-  }
   #if LOG_TO_CHOICE
     if (!g_LogPrint) {
       if (getenv("MITLS_LOG") == NULL) {
@@ -179,6 +275,7 @@ int MITLS_CALLCONV FFI_mitls_init(void)
 
   ENTER_GLOBAL_HEAP_REGION();
   krmlinit_globals();
+  FFI_ffiInit();
   LEAVE_GLOBAL_HEAP_REGION();
   
   if (HAD_OUT_OF_MEMORY) {
@@ -192,15 +289,11 @@ int MITLS_CALLCONV FFI_mitls_init(void)
 void MITLS_CALLCONV FFI_mitls_cleanup(void)
 {
   Random_cleanup();
-    
-#if IS_WINDOWS
-  #ifndef _KERNEL_MODE
-  DeleteCriticalSection(&lock);
-  #endif
-#else
-  pthread_mutex_destroy(&lock);
+#if !defined(_MSC_VER)
+  KeySharePool_cleanup();
+  SealPool_cleanup();
 #endif
-
+  SessionCache_flush();
   HeapRegionCleanup();
 }
 
@@ -224,6 +317,7 @@ int MITLS_CALLCONV FFI_mitls_configure(mitls_state **state, const char *tls_vers
 
     // Allocate space on the heap, to store an OCaml value
     mitls_state *s = (mitls_state*)KRML_HOST_MALLOC(sizeof(mitls_state));
+    memset(s, 0, sizeof(*s));
     s->cfg = config;
     s->rgn = rgn;
     *state = s;
@@ -237,32 +331,49 @@ int MITLS_CALLCONV FFI_mitls_configure(mitls_state **state, const char *tls_vers
     return ret;
 }
 
-int MITLS_CALLCONV FFI_mitls_set_ticket_key(const char *alg, const unsigned char *tk, size_t klen)
+// The ticket key last set by FFI_mitls_quic_create/template, so that
+// connections configured with the same key do not set it again.
+// Under Locks_FFITicketKey, as is every call to FFI_ffiSetTicketKey
+#define QUIC_TICKET_KEY_MAX 64
+static struct {
+    int valid;
+    char alg[32];
+    unsigned char key[QUIC_TICKET_KEY_MAX];
+    size_t key_len;
+} quic_ticket_key;
+
+// Called under Locks_FFITicketKey
+static int set_ticket_key(const char *alg, const unsigned char *tk, size_t klen)
 {
     int b = 0;
-    LOCK_MUTEX(&lock);
     ENTER_GLOBAL_HEAP_REGION();
     FStar_Bytes_bytes key;
     MakeFStar_Bytes_bytes(&key, tk, klen);
     b = FFI_ffiSetTicketKey(alg, key);
     LEAVE_GLOBAL_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
     return (b) ? 1 : 0;
 }
 
+int MITLS_CALLCONV FFI_mitls_set_ticket_key(const char *alg, const unsigned char *tk, size_t klen)
+{
+    Locks_acquire(Locks_FFITicketKey);
+    quic_ticket_key.valid = 0;
+    int b = set_ticket_key(alg, tk, klen);
+    Locks_release(Locks_FFITicketKey);
+    return b;
+}
+
 int MITLS_CALLCONV FFI_mitls_set_sealing_key(const char *alg, const unsigned char *tk, size_t klen)
 {
     int b = 0;
-    LOCK_MUTEX(&lock);
     ENTER_GLOBAL_HEAP_REGION();
     FStar_Bytes_bytes key;
     MakeFStar_Bytes_bytes(&key, tk, klen);
     b = FFI_ffiSetSealingKey(alg, key);
     LEAVE_GLOBAL_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
@@ -491,12 +602,13 @@ int MITLS_CALLCONV FFI_mitls_configure_nego_callback(mitls_state *state, void *c
   return 1;
 }
 
-typedef struct {
+typedef struct wrapped_cert_cb {
   void* cb_state;
   pfn_FFI_cert_select_cb select;
   pfn_FFI_cert_format_cb format;
   pfn_FFI_cert_sign_cb sign;
   pfn_FFI_cert_verify_cb verify;
+  pfn_FFI_cert_chain_cb chain; // NULL unless configured, replaces format
 } wrapped_cert_cb;
 
 static Parsers_SignatureScheme_signatureScheme_tags tls_of_pki(mitls_signature_scheme sa)
@@ -575,6 +687,322 @@ static size_t list_sa_len(Parsers_SignatureSchemeList_signatureSchemeList l)
   return 0;
 }
 
+static TLSConstants_alpn wrapped_format(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, uint64_t cert)
+{
+  wrapped_cert_cb* s = (wrapped_cert_cb*)cbs;
+
+  if (s->chain) {
+    // The list references the certificates of the application
+    const unsigned char *const *certs;
+    const size_t *certs_len;
+    size_t n = s->chain(s->cb_state, (const void *)(size_t)cert, &certs, &certs_len);
+    TLSConstants_alpn res = KRML_HOST_MALLOC(sizeof(TLSConstants_alpn_gc));
+    TLSConstants_alpn cur = res;
+    for (size_t i = 0; i < n; i++) {
+      cur->tag = Prims_Cons;
+      cur->hd = (FStar_Bytes_bytes){.length = certs_len[i], .data = (const char*)certs[i]};
+      cur->tl = KRML_HOST_MALLOC(sizeof(TLSConstants_alpn_gc));
+      cur = cur->tl;
+    }
+    cur->tag = Prims_Nil;
+    return res;
+  }
+
+  unsigned char *buffer = KRML_HOST_MALLOC(MAX_CHAIN_LEN);
+  size_t r = s->format(s->cb_state, (const void *)(size_t)cert, buffer);
+  FStar_Bytes_bytes b = {.length = r, .data = (const char*)buffer};
+  return FFI_ffiSplitChain(b);
+}
+
+
+// Asynchronous certificate callbacks.
+//
+// The handshake code cannot return half-way through a callback, so a
+// connection with pending callbacks enabled runs each FFI_mitls_process
+// (or FFI_mitls_quic_process) step on a stack of its own: a ucontext on
+// POSIX, a fiber on Windows. When its select, sign or verify callback
+// returns pending, wrapped_select/sign/verify switch back to the stack of
+// the caller, which reports TFLAG_PENDING; once the result is passed to
+// FFI_mitls_complete_select/sign/verify, the next call switches back in
+// and the callback returns it. Kernel mode has neither, nor do C libraries
+// without makecontext (MITLS_ASYNC_UCONTEXT): they do not support it.
+//
+// The step may be resumed from another thread than the one that started
+// it: nothing on the step's stack caches thread-local state across a
+// switch (async_suspend takes the step by argument, not from t_async).
+
+#if defined(_KERNEL_MODE) || (!IS_WINDOWS && !MITLS_ASYNC_UCONTEXT)
+  #define HAS_ASYNC_STEP 0
+#else
+  #define HAS_ASYNC_STEP 1
+  #if defined(_MSC_VER)
+    #define THREAD_LOCAL __declspec(thread)
+  #else
+    #define THREAD_LOCAL __thread
+  #endif
+#endif
+
+#define ASYNC_STACK_SIZE (256 * 1024)
+
+typedef enum {
+  ASYNC_SELECT,
+  ASYNC_SIGN,
+  ASYNC_VERIFY
+} async_op;
+
+typedef enum {
+  ASYNC_RUNNING,  // on its stack, or not started
+  ASYNC_WAITING,  // suspended until FFI_mitls_complete_select/sign/verify
+  ASYNC_READY     // completed, resumed by the next process call
+} async_status;
+
+struct async_step {
+  HEAP_REGION rgn;
+  void (*run)(void *arg);
+  void *arg;
+  int started;         // run has not returned yet
+  int failed;          // run ran out of memory
+  async_status status;
+
+  // The pending callback and its result
+  async_op op;
+  const void *cert;    // selected certificate, NULL if none
+  mitls_signature_scheme selected;
+  unsigned char *sig;  // the MAX_SIGNATURE_LEN buffer of wrapped_sign
+  size_t sig_len;      // 0 if signing failed
+  int valid;
+
+#if HAS_ASYNC_STEP
+#if IS_WINDOWS
+  LPVOID fiber;
+  LPVOID caller;
+#else
+  ucontext_t context;
+  ucontext_t caller;
+  char *stack_map;     // a PROT_NONE guard page, then the stack
+  size_t stack_map_len;
+#endif
+#if USE_HEAP_REGIONS && !defined(_MSC_VER)
+  jmp_buf *penv;       // the out-of-memory exit of async_body
+#endif
+#endif
+};
+
+#if HAS_ASYNC_STEP
+static THREAD_LOCAL async_step *t_async; // the step running on this thread, if any
+
+// Runs on the step's stack. It has its own out-of-memory exit, as
+// the caller's cannot be reached by a longjmp from another stack.
+static void async_body(async_step *a)
+{
+  ENTER_HEAP_REGION(a->rgn);
+#if USE_HEAP_REGIONS && !defined(_MSC_VER)
+  a->penv = &jmp_buf_out_of_memory;
+#endif
+  a->run(a->arg);
+  LEAVE_HEAP_REGION();
+  a->failed = HAD_OUT_OF_MEMORY;
+  a->started = 0;
+}
+
+#if IS_WINDOWS
+static VOID CALLBACK async_fiber(PVOID p)
+{
+  async_step *a = (async_step*)p;
+  for (;;) {
+    async_body(a);
+    SwitchToFiber(a->caller);
+  }
+}
+#else
+static void async_entry(void)
+{
+  async_body(t_async);
+} // returns to a->caller, through uc_link
+#endif
+
+// Called by wrapped_select/sign/verify on the step's stack, when their
+// callback returned pending
+static void async_suspend(async_step *a, async_op op)
+{
+  a->op = op;
+  a->status = ASYNC_WAITING;
+#if IS_WINDOWS
+  SwitchToFiber(a->caller);
+#else
+  swapcontext(&a->context, &a->caller);
+#endif
+#if USE_HEAP_REGIONS && !defined(_MSC_VER)
+  // The resuming call entered the region with its own exit
+  HeapRegionEnter(a->rgn, a->penv);
+#endif
+}
+
+// Start run(arg) on the step's stack, or resume it if suspended.
+// Returns 0 if it is suspended on return, 1 if it has returned.
+static int async_run(async_step *a, void (*run)(void *arg), void *arg)
+{
+  if (a->started && a->status == ASYNC_WAITING) {
+    return 0; // not completed yet
+  }
+  if (!a->started) {
+    a->run = run;
+    a->arg = arg;
+    a->failed = 0;
+#if !IS_WINDOWS
+    getcontext(&a->context);
+    a->context.uc_stack.ss_sp = a->stack_map + (a->stack_map_len - ASYNC_STACK_SIZE);
+    a->context.uc_stack.ss_size = ASYNC_STACK_SIZE;
+    a->context.uc_link = &a->caller;
+    makecontext(&a->context, async_entry, 0);
+#endif
+    a->started = 1;
+  }
+  a->status = ASYNC_RUNNING;
+  t_async = a;
+#if IS_WINDOWS
+  int converted = 0;
+  if (!IsThreadAFiber()) {
+    if (ConvertThreadToFiber(NULL) == NULL) {
+      t_async = NULL;
+      a->started = 0;
+      a->failed = 1;
+      return 1;
+    }
+    converted = 1;
+  }
+  a->caller = GetCurrentFiber();
+  SwitchToFiber(a->fiber);
+  if (converted) {
+    ConvertFiberToThread();
+  }
+#else
+  swapcontext(&a->caller, &a->context);
+#endif
+  t_async = NULL;
+  return !a->started;
+}
+#else
+static void async_suspend(async_step *a, async_op op)
+{
+  // Unreachable: without steps, async_current returns NULL
+  (void)a;
+  (void)op;
+}
+#endif // HAS_ASYNC_STEP
+
+// Runs run(arg) directly if the connection has no step
+static int run_step(async_step *a, void (*run)(void *arg), void *arg)
+{
+#if HAS_ASYNC_STEP
+  if (a != NULL) {
+    return async_run(a, run, arg);
+  }
+#endif
+  run(arg);
+  return 1;
+}
+
+static int step_suspended(async_step *a)
+{
+  return a != NULL && a->started;
+}
+
+// The step of the callback, if it can be suspended
+static async_step *async_current(void)
+{
+#if HAS_ASYNC_STEP
+  return t_async;
+#else
+  return NULL;
+#endif
+}
+
+// Called with the region of the connection entered
+static async_step *async_create(HEAP_REGION rgn)
+{
+#if HAS_ASYNC_STEP
+  async_step *a = KRML_HOST_MALLOC(sizeof(async_step));
+  memset(a, 0, sizeof(*a));
+  a->rgn = rgn;
+#if IS_WINDOWS
+  // Only the stack actually used is committed
+  a->fiber = CreateFiber(ASYNC_STACK_SIZE, async_fiber, a);
+  if (a->fiber == NULL) {
+    KRML_HOST_FREE(a);
+    return NULL;
+  }
+#else
+  // Mapped outside of the region, so that it is returned to the system,
+  // with a guard page below it: the stack grows down, and an overflow
+  // faults instead of overwriting other memory
+  long page = sysconf(_SC_PAGESIZE);
+  a->stack_map_len = ASYNC_STACK_SIZE + (size_t)(page > 0 ? page : 4096);
+  a->stack_map = mmap(NULL, a->stack_map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (a->stack_map == MAP_FAILED) {
+    KRML_HOST_FREE(a);
+    return NULL;
+  }
+  if (mprotect(a->stack_map, a->stack_map_len - ASYNC_STACK_SIZE, PROT_NONE) != 0) {
+    munmap(a->stack_map, a->stack_map_len);
+    KRML_HOST_FREE(a);
+    return NULL;
+  }
+#endif
+  return a;
+#else
+  return NULL;
+#endif
+}
+
+// A suspended step is abandoned; the region is about to be destroyed
+static void async_free(async_step *a)
+{
+#if HAS_ASYNC_STEP
+  if (a != NULL) {
+#if IS_WINDOWS
+    DeleteFiber(a->fiber);
+#else
+    munmap(a->stack_map, a->stack_map_len);
+#endif
+  }
+#endif
+}
+
+static int async_complete_select(async_step *a, const void *cert, mitls_signature_scheme selected)
+{
+  if (a == NULL || !a->started || a->status != ASYNC_WAITING || a->op != ASYNC_SELECT) {
+    return 0;
+  }
+  a->cert = cert;
+  a->selected = selected;
+  a->status = ASYNC_READY;
+  return 1;
+}
+
+static int async_complete_sign(async_step *a, const unsigned char *sig, size_t sig_len)
+{
+  if (a == NULL || !a->started || a->status != ASYNC_WAITING || a->op != ASYNC_SIGN || sig_len > MAX_SIGNATURE_LEN) {
+    return 0;
+  }
+  if (sig_len) {
+    memcpy(a->sig, sig, sig_len);
+  }
+  a->sig_len = sig_len;
+  a->status = ASYNC_READY;
+  return 1;
+}
+
+static int async_complete_verify(async_step *a, int valid)
+{
+  if (a == NULL || !a->started || a->status != ASYNC_WAITING || a->op != ASYNC_VERIFY) {
+    return 0;
+  }
+  a->valid = (valid != 0);
+  a->status = ASYNC_READY;
+  return 1;
+}
+
 static FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_signatureScheme
   wrapped_select(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, Parsers_ProtocolVersion_protocolVersion pv,
     FStar_Bytes_bytes sni, FStar_Bytes_bytes alpn,
@@ -598,6 +1026,16 @@ static FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_sign
     (const unsigned char*)alpn.data, alpn.length,
     sigalgs, sigalgs_len, &selected);
 
+  if (chain == MITLS_SELECT_PENDING) {
+    async_step *a = async_current();
+    chain = NULL; // no certificate, unless the handshake can be suspended
+    if (a != NULL) {
+      async_suspend(a, ASYNC_SELECT);
+      chain = (void*)a->cert;
+      selected = a->selected;
+    }
+  }
+
   if(chain == NULL) {
     res.tag = FStar_Pervasives_Native_None;
   } else {
@@ -612,16 +1050,6 @@ static FStar_Pervasives_Native_option__K___uint64_t_Parsers_SignatureScheme_sign
   return res;
 }
 
-static TLSConstants_alpn wrapped_format(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, uint64_t cert)
-{
-  wrapped_cert_cb* s = (wrapped_cert_cb*)cbs;
-  unsigned char *buffer = KRML_HOST_MALLOC(MAX_CHAIN_LEN);
-  size_t r = s->format(s->cb_state, (const void *)(size_t)cert, buffer);
-  FStar_Bytes_bytes b = {.length = r, .data = (const char*)buffer};
-  return FFI_ffiSplitChain(b);
-}
-
-
 static FStar_Pervasives_Native_option__FStar_Bytes_bytes wrapped_sign(
   FStar_Dyn_dyn cbs, FStar_Dyn_dyn st, uint64_t cert,
   Parsers_SignatureScheme_signatureScheme sa, FStar_Bytes_bytes tbs)
@@ -634,6 +1062,16 @@ static FStar_Pervasives_Native_option__FStar_Bytes_bytes wrapped_sign(
   size_t slen = s->sign(s->cb_state, (const void *)(size_t)cert, sigalg,
     (const unsigned char*)tbs.data, tbs.length, sig);
 
+  if (slen == MITLS_SIGN_PENDING) {
+    async_step *a = async_current();
+    slen = 0; // a failure, unless the handshake can be suspended
+    if (a != NULL) {
+      a->sig = sig;
+      async_suspend(a, ASYNC_SIGN);
+      slen = a->sig_len;
+    }
+  }
+
   if(slen > 0) {
     res.tag = FStar_Pervasives_Native_Some;
     res.v = (FStar_Bytes_bytes){.length = slen, .data = (const char*)sig};
@@ -650,12 +1088,21 @@ static bool wrapped_verify(FStar_Dyn_dyn cbs, FStar_Dyn_dyn st,
   FStar_Bytes_bytes chain = Cert_certificateListBytes(certs);
   mitls_signature_scheme sigalg = pki_of_tls(sa.tag);
 
-  int r = (s->verify(s->cb_state,
+  int r = s->verify(s->cb_state,
     (const unsigned char*)chain.data, chain.length, sigalg,
     (const unsigned char*)tbs.data, tbs.length,
-    (const unsigned char*)sig.data, sig.length) != 0);
+    (const unsigned char*)sig.data, sig.length);
+
+  if (r == MITLS_VERIFY_PENDING) {
+    async_step *a = async_current();
+    r = 0;
+    if (a != NULL) {
+      async_suspend(a, ASYNC_VERIFY);
+      r = a->valid;
+    }
+  }
 
-  return r;
+  return r != 0;
 }
 
 int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *state, void *cb_state, mitls_cert_cb *cert_cb)
@@ -668,6 +1115,7 @@ int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *stat
   cbs->format = cert_cb->format;
   cbs->sign = cert_cb->sign;
   cbs->verify = cert_cb->verify;
+  cbs->chain = NULL;
 
   TLSConstants_cert_cb cb = {
     .app_context = (void*)cbs,
@@ -686,101 +1134,459 @@ int MITLS_CALLCONV FFI_mitls_configure_cert_callbacks(/* in */ mitls_state *stat
   if (HAD_OUT_OF_MEMORY) {
     return 0;
   }
+  state->cert_cbs = cbs;
   return 1;
 }
 
-int MITLS_CALLCONV FFI_mitls_configure_early_data(/* in */ mitls_state *state, uint32_t max_early_data)
+int MITLS_CALLCONV FFI_mitls_configure_cert_chain_callback(/* in */ mitls_state *state, pfn_FFI_cert_chain_cb chain)
 {
-    ENTER_HEAP_REGION(state->rgn);
-    state->cfg = FFI_ffiSetEarlyData(state->cfg, max_early_data);
-    LEAVE_HEAP_REGION();
-    if (HAD_OUT_OF_MEMORY) {
-        return 0;
-    }
-    return 1;
+  if (state->cert_cbs == NULL) {
+    return 0; // no certificate callbacks, or a connection created from a template
+  }
+  state->cert_cbs->chain = chain;
+  return 1;
 }
 
-// Called by the host app to free a mitls_state allocated by FFI_mitls_configure()
-void MITLS_CALLCONV FFI_mitls_close(mitls_state *state)
+int MITLS_CALLCONV FFI_mitls_configure_async_cert_callbacks(/* in */ mitls_state *state)
 {
-    if (state) {
-        HEAP_REGION rgn = state->rgn;
-        KRML_HOST_FREE(state);
-        DESTROY_HEAP_REGION(rgn);
+  if (state->async == NULL) {
+    ENTER_HEAP_REGION(state->rgn);
+    state->async = async_create(state->rgn);
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+      state->async = NULL;
     }
+  }
+  return state->async != NULL;
 }
 
-void MITLS_CALLCONV FFI_mitls_free(/* in */ mitls_state *state, void* pv)
+int MITLS_CALLCONV FFI_mitls_complete_select(/* in */ mitls_state *state, const void *cert, mitls_signature_scheme selected)
 {
-    ENTER_HEAP_REGION(state->rgn);
-    KRML_HOST_FREE(pv);
-    LEAVE_HEAP_REGION();
+  return async_complete_select(state->async, cert, selected);
 }
 
-typedef struct {
-  void* send_recv_ctx;
-  pfn_FFI_send send;
-  pfn_FFI_recv recv;
-} wrapped_transport_cb;
-
-static int32_t wrapped_send(void* ctx, uint8_t* buffer, uint32_t buffer_size)
+int MITLS_CALLCONV FFI_mitls_complete_sign(/* in */ mitls_state *state, const unsigned char *sig, size_t sig_len)
 {
-  wrapped_transport_cb* tcb = (wrapped_transport_cb*) ctx;
-  return (int32_t)tcb->send(tcb->send_recv_ctx, (const void*)buffer, (size_t)buffer_size);
+  return async_complete_sign(state->async, sig, sig_len);
 }
 
-static int32_t wrapped_recv(void* ctx, uint8_t* buffer, uint32_t len)
+int MITLS_CALLCONV FFI_mitls_complete_verify(/* in */ mitls_state *state, int valid)
 {
-  wrapped_transport_cb* tcb = (wrapped_transport_cb*) ctx;
-  return (int32_t)tcb->recv(tcb->send_recv_ctx, (void*)buffer, (size_t)len);
+  return async_complete_verify(state->async, valid);
 }
 
-// Called by the host app to create a TLS connection.
-int MITLS_CALLCONV FFI_mitls_connect(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state)
+int MITLS_CALLCONV FFI_mitls_configure_early_data(/* in */ mitls_state *state, uint32_t max_early_data)
 {
-    int ret = 0;
-    LOCK_MUTEX(&lock);
     ENTER_HEAP_REGION(state->rgn);
-
-    wrapped_transport_cb* tcb = KRML_HOST_MALLOC(sizeof(wrapped_transport_cb));
-    tcb->send_recv_ctx = send_recv_ctx;
-    tcb->send = psend;
-    tcb->recv = precv;
-
-    K___Connection_connection_krml_checked_int_t result = FFI_connect((FStar_Dyn_dyn)tcb, wrapped_send, wrapped_recv, state->cfg);
-    state->cxn = result.fst;
-    ret = (result.snd == 0);
-
+    state->cfg = FFI_ffiSetEarlyData(state->cfg, max_early_data);
     LEAVE_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
     if (HAD_OUT_OF_MEMORY) {
         return 0;
     }
-    return ret;
+    return 1;
 }
 
-// Called by the host server app, after a client has connected to a socket and the calling server has accepted the TCP connection.
-int MITLS_CALLCONV FFI_mitls_accept_connected(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state)
+// Drop a reference to a template, and to the templates it was built from
+static void template_release(mitls_config_template *tmpl)
 {
-    int ret = 0;
-    LOCK_MUTEX(&lock);
-    ENTER_HEAP_REGION(state->rgn);
+    while (tmpl && REFCOUNT_DECREMENT(&tmpl->refcount) == 0) {
+        mitls_config_template *parent = tmpl->parent;
+        HEAP_REGION rgn = tmpl->rgn;
+        KRML_HOST_FREE(tmpl);
+        DESTROY_HEAP_REGION(rgn);
+        tmpl = parent;
+    }
+}
 
-    wrapped_transport_cb* tcb = KRML_HOST_MALLOC(sizeof(wrapped_transport_cb));
-    tcb->send_recv_ctx = send_recv_ctx;
-    tcb->send = psend;
-    tcb->recv = precv;
+// Called by the host app to turn a configured, unconnected mitls_state
+// into a template. The state is consumed, even on failure.
+int MITLS_CALLCONV FFI_mitls_configure_template(/* out */ mitls_config_template **tmpl, /* in */ mitls_state *state)
+{
+    mitls_config_template *t = NULL;
 
-    K___Connection_connection_krml_checked_int_t result = FFI_ffiAcceptConnected((FStar_Dyn_dyn)tcb, wrapped_send, wrapped_recv, state->cfg);
-    state->cxn = result.fst;
-    ret = (result.snd == 0) ? 1 : 0; // return success (1) if result.snd is 0.
+    *tmpl = NULL;
+    if (state->tcb != NULL || state->io != NULL) {
+        FFI_mitls_close(state);
+        return 0; // already connected
+    }
 
+    ENTER_HEAP_REGION(state->rgn);
+    t = KRML_HOST_MALLOC(sizeof(mitls_config_template));
+    memset(t, 0, sizeof(*t));
+    t->rgn = state->rgn;
+    t->cfg = state->cfg;
+    t->refcount = 1;
+    t->parent = state->tmpl;
+    // As in FFI_mitls_close; the region lives on with the template
+    if (state->async != NULL) {
+        async_free(state->async);
+        KRML_HOST_FREE(state->async);
+    }
+    KRML_HOST_FREE(state);
     LEAVE_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
     if (HAD_OUT_OF_MEMORY) {
+        FFI_mitls_close(state);
         return 0;
     }
-    return ret;
+    *tmpl = t;
+    return 1;
+}
+
+// Called by the host app to create a mitls_state sharing the configuration
+// of tmpl, in place of FFI_mitls_configure. The host name overrides the
+// template's, unless NULL.
+int MITLS_CALLCONV FFI_mitls_configure_from_template(/* out */ mitls_state **state, /* in */ mitls_config_template *tmpl, const char *host_name)
+{
+    mitls_state *s = NULL;
+    *state = NULL;
+    if (tmpl->is_quic) {
+        return 0;
+    }
+
+    HEAP_REGION rgn;
+    CREATE_HEAP_REGION(&rgn);
+    if (!VALID_HEAP_REGION(rgn)) {
+        return 0; // out of memory
+    }
+
+    s = (mitls_state*)KRML_HOST_MALLOC(sizeof(mitls_state));
+    memset(s, 0, sizeof(*s));
+    s->rgn = rgn;
+    s->cfg = tmpl->cfg;
+    if (host_name != NULL) {
+        Prims_string host = CopyPrimsString(host_name);
+        s->cfg = FFI_ffiSetPeerName(s->cfg, (FStar_Bytes_bytes){.data=host,.length=strlen(host_name)});
+    }
+
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        DESTROY_HEAP_REGION(rgn);
+        return 0;
+    }
+    REFCOUNT_INCREMENT(&tmpl->refcount);
+    s->tmpl = tmpl;
+    *state = s;
+    return 1;
+}
+
+// Called by the host app to drop its reference to a template. Connections
+// created from it keep the template alive until they are freed.
+void MITLS_CALLCONV FFI_mitls_template_free(mitls_config_template *tmpl)
+{
+    template_release(tmpl);
+}
+
+// Called by the host app to free a mitls_state allocated by FFI_mitls_configure()
+void MITLS_CALLCONV FFI_mitls_close(mitls_state *state)
+{
+    if (state) {
+        HEAP_REGION rgn = state->rgn;
+        mitls_config_template *tmpl = state->tmpl;
+        async_free(state->async);
+        KRML_HOST_FREE(state);
+        DESTROY_HEAP_REGION(rgn);
+        template_release(tmpl);
+    }
+}
+
+void MITLS_CALLCONV FFI_mitls_free(/* in */ mitls_state *state, void* pv)
+{
+    ENTER_HEAP_REGION(state->rgn);
+    KRML_HOST_FREE(pv);
+    LEAVE_HEAP_REGION();
+}
+
+void MITLS_CALLCONV FFI_mitls_enable_memory_stats(int enable)
+{
+    HeapRegionEnableStatistics(enable);
+}
+
+static int get_memory_stats(HEAP_REGION rgn, /* out */ mitls_memory_stats *stats)
+{
+    region_statistics s;
+    int r = HeapRegionGetStatistics(rgn, &s);
+
+    stats->current_bytes = s.current_bytes;
+    stats->peak_bytes = s.peak_bytes;
+    stats->total_bytes = s.total_bytes;
+    stats->allocation_count = s.allocation_count;
+    stats->free_count = s.free_count;
+    stats->allocation_failures = s.allocation_failures;
+    return r;
+}
+
+int MITLS_CALLCONV FFI_mitls_get_memory_stats(/* in */ mitls_state *state, /* out */ mitls_memory_stats *stats)
+{
+    return get_memory_stats(state ? state->rgn : NULL, stats);
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_session_cache(size_t capacity, uint32_t lifetime)
+{
+    return SessionCache_configure(capacity, lifetime);
+}
+
+int MITLS_CALLCONV FFI_mitls_get_session_cache_stats(/* out */ mitls_session_cache_stats *tickets, /* out */ mitls_session_cache_stats *ticket_psks, /* out */ mitls_session_cache_stats *sessions12)
+{
+    if (tickets) {
+        SessionCache_get_stats(SessionCache_Tickets13, tickets);
+    }
+    if (ticket_psks) {
+        SessionCache_get_stats(SessionCache_TicketPSKs13, ticket_psks);
+    }
+    if (sessions12) {
+        SessionCache_get_stats(SessionCache_Sessions12, sessions12);
+    }
+    return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_keyshare_pool(const char *groups, uint32_t depth)
+{
+#if defined(_MSC_VER)
+    return 0;
+#else
+    int r = 1;
+    while (*groups) {
+        char name[16];
+        size_t len = strcspn(groups, ":");
+        if (len < sizeof(name)) {
+            memcpy(name, groups, len);
+            name[len] = '\0';
+            r &= KeySharePool_configure(name, depth);
+        } else {
+            r = 0;
+        }
+        groups += len;
+        if (*groups == ':') {
+            groups++;
+        }
+    }
+    return r;
+#endif
+}
+
+int MITLS_CALLCONV FFI_mitls_get_keyshare_pool_stats(const char *group, /* out */ mitls_keyshare_pool_stats *stats)
+{
+#if defined(_MSC_VER)
+    return 0;
+#else
+    return KeySharePool_get_stats(group, stats);
+#endif
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_seal_threads(uint32_t threads)
+{
+#if defined(_MSC_VER)
+    return 0;
+#else
+    return SealPool_configure(threads);
+#endif
+}
+
+// Send the corked records, if any, in a single call
+static int wrapped_flush(wrapped_transport_cb* tcb)
+{
+  size_t len = tcb->cork_len;
+
+  tcb->cork_len = 0;
+  if (len == 0) {
+    return 1;
+  }
+  return tcb->send(tcb->send_recv_ctx, tcb->cork, len) == (int)len;
+}
+
+static int32_t wrapped_send(void* ctx, uint8_t* buffer, uint32_t buffer_size)
+{
+  wrapped_transport_cb* tcb = (wrapped_transport_cb*) ctx;
+
+  if (!tcb->corked && tcb->cork_len == 0) {
+    return (int32_t)tcb->send(tcb->send_recv_ctx, (const void*)buffer, (size_t)buffer_size);
+  }
+  if (tcb->cork_len + buffer_size > CORK_MAX_LEN) {
+    if (!wrapped_flush(tcb)) {
+      return -1;
+    }
+    if (buffer_size >= CORK_MAX_LEN) {
+      return (int32_t)tcb->send(tcb->send_recv_ctx, (const void*)buffer, (size_t)buffer_size);
+    }
+  }
+  if (tcb->cork_len + buffer_size > tcb->cork_cap) {
+    size_t cap = (tcb->cork_cap) ? tcb->cork_cap : 4096;
+    while (cap < tcb->cork_len + buffer_size) {
+      cap *= 2;
+    }
+    unsigned char *cork = KRML_HOST_MALLOC(cap);
+    if (cork == NULL) {
+      return -1;
+    }
+    if (tcb->cork_len) {
+      memcpy(cork, tcb->cork, tcb->cork_len);
+    }
+    KRML_HOST_FREE(tcb->cork);
+    tcb->cork = cork;
+    tcb->cork_cap = cap;
+  }
+  memcpy(tcb->cork + tcb->cork_len, buffer, buffer_size);
+  tcb->cork_len += buffer_size;
+  if (!tcb->corked && !wrapped_flush(tcb)) {
+    return -1; // uncorked with data left over from MITLS_SEND_MORE
+  }
+  return (int32_t)buffer_size;
+}
+
+// Records written by the connection are kept until uncork. Nested calls
+// are counted; engine connections always queue their output.
+static void cork(mitls_state *state)
+{
+  if (state->tcb) {
+    state->tcb->corked++;
+  }
+}
+
+// Unless flush is 0, the corked records are sent in a single call once
+// the last cork is removed. Returns 0 if they could not all be sent.
+static int uncork(mitls_state *state, int flush)
+{
+  wrapped_transport_cb* tcb = state->tcb;
+  if (tcb == NULL || tcb->corked == 0) {
+    return 1;
+  }
+  tcb->corked--;
+  return (tcb->corked || !flush) ? 1 : wrapped_flush(tcb);
+}
+
+// The corks of a connection when an FFI call starts
+typedef struct {
+  int corked;
+  size_t cork_len;
+} cork_mark;
+
+static cork_mark cork_save(mitls_state *state)
+{
+  wrapped_transport_cb* tcb = state->tcb;
+  cork_mark m = {0, 0};
+  if (tcb != NULL) {
+    m.corked = tcb->corked;
+    m.cork_len = tcb->cork_len;
+  }
+  return m;
+}
+
+// Error path of uncork, after an out-of-memory exception skipped the
+// uncork matching a cork taken by the call: restore the corks the call
+// started with, and drop the records it held back, an incomplete flight.
+static void uncork_on_error(mitls_state *state, cork_mark m)
+{
+  wrapped_transport_cb* tcb = state->tcb;
+  if (tcb != NULL) {
+    tcb->corked = m.corked;
+    if (tcb->cork_len > m.cork_len) {
+      tcb->cork_len = m.cork_len;
+    }
+  }
+}
+
+static wrapped_transport_cb* wrap_transport(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, size_t read_ahead)
+{
+  wrapped_transport_cb* tcb = KRML_HOST_MALLOC(sizeof(wrapped_transport_cb));
+  memset(tcb, 0, sizeof(*tcb));
+  tcb->send_recv_ctx = send_recv_ctx;
+  tcb->send = psend;
+  tcb->recv = precv;
+  if (read_ahead) {
+    tcb->ahead = KRML_HOST_MALLOC(read_ahead);
+    tcb->ahead_cap = (tcb->ahead) ? read_ahead : 0; // or read exactly
+  }
+  return tcb;
+}
+
+// Record.read asks for exactly the rest of the current record header or
+// body. With read-ahead, it is served from the bytes left over by the
+// previous recv, and only calls the application when there are none:
+// the records that arrived together are then read with a single callback.
+static int32_t wrapped_recv(void* ctx, uint8_t* buffer, uint32_t len)
+{
+  wrapped_transport_cb* tcb = (wrapped_transport_cb*) ctx;
+  if (tcb->ahead_pos == tcb->ahead_len) {
+    if (!wrapped_flush(tcb)) {
+      return -1; // the peer may be waiting for our output
+    }
+    if (len >= tcb->ahead_cap) {
+      // no read-ahead, or a record body that fills it: no copy
+      return (int32_t)tcb->recv(tcb->send_recv_ctx, (void*)buffer, (size_t)len);
+    }
+    int r = tcb->recv(tcb->send_recv_ctx, tcb->ahead, tcb->ahead_cap);
+    if (r <= 0) {
+      return (int32_t)r;
+    }
+    tcb->ahead_pos = 0;
+    tcb->ahead_len = (size_t)r;
+  }
+  size_t n = tcb->ahead_len - tcb->ahead_pos;
+  if (n > len) {
+    n = len;
+  }
+  memcpy(buffer, tcb->ahead + tcb->ahead_pos, n);
+  tcb->ahead_pos += n;
+  return (int32_t)n;
+}
+
+int MITLS_CALLCONV FFI_mitls_configure_read_ahead(/* in */ mitls_state *state, size_t len)
+{
+  if (state->tcb != NULL || state->io != NULL || len > INT32_MAX) {
+    return 0; // already connected
+  }
+  state->read_ahead = len;
+  return 1;
+}
+
+// Called by the host app to create a TLS connection.
+int MITLS_CALLCONV FFI_mitls_connect(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state)
+{
+    int ret = 0;
+    cork_mark mark = cork_save(state);
+    ENTER_HEAP_REGION(state->rgn);
+
+    wrapped_transport_cb* tcb = wrap_transport(send_recv_ctx, psend, precv, state->read_ahead);
+    state->tcb = tcb;
+
+    // Each flight is sent in one call, flushed before reading the reply
+    cork(state);
+    K___Connection_connection_krml_checked_int_t result = FFI_connect((FStar_Dyn_dyn)tcb, wrapped_send, wrapped_recv, state->cfg);
+    state->cxn = result.fst;
+    ret = (result.snd == 0);
+    ret = uncork(state, 1) && ret;
+
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        uncork_on_error(state, mark);
+        return 0;
+    }
+    return ret;
+}
+
+// Called by the host server app, after a client has connected to a socket and the calling server has accepted the TCP connection.
+int MITLS_CALLCONV FFI_mitls_accept_connected(void *send_recv_ctx, pfn_FFI_send psend, pfn_FFI_recv precv, /* in */ mitls_state *state)
+{
+    int ret = 0;
+    cork_mark mark = cork_save(state);
+    ENTER_HEAP_REGION(state->rgn);
+
+    wrapped_transport_cb* tcb = wrap_transport(send_recv_ctx, psend, precv, state->read_ahead);
+    state->tcb = tcb;
+
+    // Each flight is sent in one call, flushed before reading the reply
+    cork(state);
+    K___Connection_connection_krml_checked_int_t result = FFI_ffiAcceptConnected((FStar_Dyn_dyn)tcb, wrapped_send, wrapped_recv, state->cfg);
+    state->cxn = result.fst;
+    ret = (result.snd == 0) ? 1 : 0; // return success (1) if result.snd is 0.
+    ret = uncork(state, 1) && ret;
+
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        uncork_on_error(state, mark);
+        return 0;
+    }
+    return ret;
 }
 
 // Called by the host app transmit a packet
@@ -789,9 +1595,7 @@ int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned ch
     int ret;
 
     ENTER_HEAP_REGION(state->rgn);
-    LOCK_MUTEX(&lock);
     ret = FFI_ffiSend(state->cxn, (FStar_Bytes_bytes){.data = (const char*)buffer, .length = buffer_size});
-    UNLOCK_MUTEX(&lock);
     LEAVE_HEAP_REGION();
     if (HAD_OUT_OF_MEMORY) {
         return 0;
@@ -800,6 +1604,89 @@ int MITLS_CALLCONV FFI_mitls_send(/* in */ mitls_state *state, const unsigned ch
     return 1;
 }
 
+// Records are filled from up to this many bytes of application data at
+// a time, and sent in one call. A multiple of the maximum fragment length.
+#define SENDV_CHUNK_LEN (16 * 16384)
+
+// Called by the host app to transmit non-contiguous data. Records are
+// filled across iovec boundaries, and handed to the send callback in
+// batches of SENDV_CHUNK_LEN, rather than one call per record. With
+// MITLS_SEND_MORE, the last batch is kept until the next send.
+int MITLS_CALLCONV FFI_mitls_sendv(/* in */ mitls_state *state, const mitls_iovec *iov, size_t iovcnt, int flags)
+{
+    int ret = 1;
+    wrapped_transport_cb *tcb = state->tcb;
+    unsigned char *staging = NULL;
+    size_t total = 0, i = 0, pos = 0; // pos is the offset in iov[i]
+
+    for (size_t j = 0; j < iovcnt; j++) {
+        total += iov[j].len;
+    }
+
+    cork_mark mark = cork_save(state);
+    ENTER_HEAP_REGION(state->rgn);
+    cork(state);
+    while (ret && total) {
+        const unsigned char *data;
+        size_t n;
+
+        while (iov[i].len == pos) {
+            i++;
+            pos = 0;
+        }
+        if (iov[i].len - pos >= SENDV_CHUNK_LEN || iov[i].len - pos == total) {
+            // Encrypt directly from the application buffer
+            n = (iov[i].len - pos < SENDV_CHUNK_LEN) ? iov[i].len - pos : SENDV_CHUNK_LEN;
+            data = iov[i].base + pos;
+            pos += n;
+        } else {
+            // Gather the next chunk, across iovec boundaries
+            size_t max = (total < SENDV_CHUNK_LEN) ? total : SENDV_CHUNK_LEN;
+            if (staging == NULL) {
+                staging = KRML_HOST_MALLOC(SENDV_CHUNK_LEN);
+            }
+            for (n = 0; n < max; ) {
+                size_t chunk = iov[i].len - pos;
+                if (chunk > max - n) {
+                    chunk = max - n;
+                }
+                memcpy(staging + n, iov[i].base + pos, chunk);
+                n += chunk;
+                pos += chunk;
+                if (pos == iov[i].len && n < max) {
+                    i++;
+                    pos = 0;
+                }
+            }
+            data = staging;
+        }
+        ret = FFI_ffiSend(state->cxn, (FStar_Bytes_bytes){.data = (const char*)data, .length = n}) == 0;
+        total -= n;
+        if (ret && tcb && total) {
+            ret = wrapped_flush(tcb);
+        }
+    }
+    KRML_HOST_FREE(staging);
+    ret = uncork(state, ret && !(flags & MITLS_SEND_MORE)) && ret;
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        uncork_on_error(state, mark);
+        return 0;
+    }
+    return ret;
+}
+
+// Called by the host app to batch the records of several sends
+void MITLS_CALLCONV FFI_mitls_cork(/* in */ mitls_state *state)
+{
+    cork(state);
+}
+
+int MITLS_CALLCONV FFI_mitls_uncork(/* in */ mitls_state *state)
+{
+    return uncork(state, 1);
+}
+
 // Called by the host app to receive a packet
 unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /* out */ size_t *packet_size)
 {
@@ -807,23 +1694,262 @@ unsigned char *MITLS_CALLCONV FFI_mitls_receive(/* in */ mitls_state *state, /*
     FStar_Bytes_bytes ret = {.data=NULL,.length=0};
     *packet_size = 0;
 
-    LOCK_MUTEX(&lock);
+    cork_mark mark = cork_save(state);
     ENTER_HEAP_REGION(state->rgn);
 
-    ret = FFI_ffiRecv(state->cxn);
+    if (state->plaintext.length) {
+      // Deliver what FFI_mitls_receive_into left of its last record first
+      ret.data = state->plaintext.data + state->plaintext_pos;
+      ret.length = state->plaintext.length - state->plaintext_pos;
+      state->plaintext = (FStar_Bytes_bytes){.data = NULL, .length = 0};
+      state->plaintext_pos = 0;
+    } else {
+      cork(state); // post-handshake messages and alerts written while reading
+      ret = FFI_ffiRecv(state->cxn);
+      uncork(state, 1);
+    }
     if (ret.length) {
       p = KRML_HOST_MALLOC(ret.length);
       memcpy((char*)p, ret.data, ret.length);
     }
     LEAVE_HEAP_REGION();
-    UNLOCK_MUTEX(&lock);
     if (HAD_OUT_OF_MEMORY) {
+        uncork_on_error(state, mark);
         return NULL;
     }
     *packet_size = ret.length;
     return p;
 }
 
+// Copy as much pending plaintext as fits into buffer; the rest of the
+// record stays where the record layer decrypted it, for the next call
+static size_t deliver_plaintext(mitls_state *state, unsigned char *buffer, size_t buffer_size)
+{
+    size_t n = state->plaintext.length - state->plaintext_pos;
+
+    if (n > buffer_size || buffer == NULL) {
+        n = (buffer == NULL) ? 0 : buffer_size;
+    }
+    if (n) {
+        memcpy(buffer, state->plaintext.data + state->plaintext_pos, n);
+        state->plaintext_pos += n;
+    }
+    if (state->plaintext_pos == state->plaintext.length) {
+        state->plaintext = (FStar_Bytes_bytes){.data = NULL, .length = 0};
+        state->plaintext_pos = 0;
+    }
+    return n;
+}
+
+// Called by the host app to receive application data into its own buffer,
+// without the allocation and copy of FFI_mitls_receive. A record larger
+// than the buffer is returned across several calls.
+int MITLS_CALLCONV FFI_mitls_receive_into(/* in */ mitls_state *state, unsigned char *buffer, size_t buffer_size, /* out */ size_t *received)
+{
+    int ret = 1;
+    *received = 0;
+
+    if (state->plaintext.length == 0) {
+        cork_mark mark = cork_save(state);
+        ENTER_HEAP_REGION(state->rgn);
+        FFI_read_result r;
+        cork(state);
+        do {
+            r = FFI_read(state->cxn);
+        } while (r.tag == FFI_Received && r.val.case_Received.length == 0);
+        ret = uncork(state, 1);
+        if (r.tag == FFI_Received) {
+            state->plaintext = r.val.case_Received;
+            state->plaintext_pos = 0;
+        } else if (r.tag == FFI_Errno && r.val.case_Errno != 0) {
+            ret = 0; // fatal alert; 0 is a close_notify
+        }
+        LEAVE_HEAP_REGION();
+        if (HAD_OUT_OF_MEMORY) {
+            uncork_on_error(state, mark);
+            return 0;
+        }
+    }
+    *received = deliver_plaintext(state, buffer, buffer_size);
+    return ret;
+}
+
+static int32_t engine_send(void* ctx, uint8_t* buffer, uint32_t buffer_size)
+{
+  engine_io *io = (engine_io*)ctx;
+
+  if (io->output_pos == io->output_len) {
+    io->output_pos = io->output_len = 0;
+  }
+  if (io->output_len + buffer_size > io->output_cap) {
+    size_t pending = io->output_len - io->output_pos;
+    size_t cap = (io->output_cap) ? io->output_cap : 4096;
+    while (cap < pending + buffer_size) {
+      cap *= 2;
+    }
+    unsigned char *output = KRML_HOST_MALLOC(cap);
+    if (output == NULL) {
+      return -1;
+    }
+    if (pending) {
+      memcpy(output, io->output + io->output_pos, pending);
+    }
+    KRML_HOST_FREE(io->output);
+    io->output = output;
+    io->output_pos = 0;
+    io->output_len = pending;
+    io->output_cap = cap;
+  }
+  memcpy(io->output + io->output_len, buffer, buffer_size);
+  io->output_len += buffer_size;
+  return (int32_t)buffer_size;
+}
+
+// Returns 0 once the input is exhausted, which TLS reports as ReadWouldBlock
+static int32_t engine_recv(void* ctx, uint8_t* buffer, uint32_t len)
+{
+  engine_io *io = (engine_io*)ctx;
+  size_t n = io->input_len - io->input_pos;
+
+  if (n > len) {
+    n = len;
+  }
+  if (n) {
+    memcpy(buffer, io->input + io->input_pos, n);
+    io->input_pos += n;
+  }
+  return (int32_t)n;
+}
+
+static int engine_create(mitls_state *state, bool is_server)
+{
+    ENTER_HEAP_REGION(state->rgn);
+    engine_io *io = KRML_HOST_MALLOC(sizeof(engine_io));
+    memset(io, 0, sizeof(*io));
+    state->cxn = FFI_create((FStar_Dyn_dyn)io, engine_send, engine_recv, state->cfg, is_server);
+    state->io = io;
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+        state->io = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Called by the host app to create a non-blocking client connection
+int MITLS_CALLCONV FFI_mitls_engine_connect(/* in */ mitls_state *state)
+{
+    return engine_create(state, false);
+}
+
+// Called by the host app to create a non-blocking server connection
+int MITLS_CALLCONV FFI_mitls_engine_accept(/* in */ mitls_state *state)
+{
+    return engine_create(state, true);
+}
+
+static void engine_deliver(mitls_state *state, mitls_process_ctx *ctx)
+{
+  ctx->plaintext_len = deliver_plaintext(state, ctx->plaintext, ctx->plaintext_len);
+  ctx->flags |= TFLAG_DATA;
+}
+
+// Process the input until it is exhausted or a record of application data
+// is received, on the stack of state->async if any
+static void engine_step(void *arg)
+{
+  mitls_state *state = (mitls_state*)arg;
+  engine_io *io = state->io;
+
+  io->step_flags = 0;
+  io->tls_error = 0;
+  io->failed = 0;
+  while (!(io->flags & TFLAG_CLOSED)) {
+    FFI_process_result res = FFI_process(state->cxn);
+    if (res.tag == FFI_ProcessWouldBlock) {
+      io->step_flags |= TFLAG_WANT_READ;
+      break;
+    } else if (res.tag == FFI_ProcessComplete) {
+      io->flags |= TFLAG_COMPLETE;
+    } else if (res.tag == FFI_ProcessData) {
+      state->plaintext = res.val.case_ProcessData;
+      state->plaintext_pos = 0;
+      io->step_flags |= TFLAG_DATA;
+      break;
+    } else if (res.tag == FFI_ProcessClosed) {
+      io->flags |= TFLAG_CLOSED;
+    } else {
+      // A fatal alert; the local one, if any, is queued as output
+      krml_checked_int_t err = res.val.case_ProcessError;
+      io->tls_error = (err > 0) ? (uint16_t)err : 0x0250; // internal_error
+      io->flags |= TFLAG_CLOSED;
+      io->failed = 1;
+    }
+  }
+}
+
+int MITLS_CALLCONV FFI_mitls_process(/* in */ mitls_state *state, mitls_process_ctx *ctx)
+{
+  int r = 1;
+  engine_io *io = state->io;
+
+  ctx->flags = 0;
+  ctx->tls_error = 0;
+  ctx->consumed_bytes = 0;
+  if (io == NULL) {
+    return 0; // not created by FFI_mitls_engine_connect/accept
+  }
+
+  ENTER_HEAP_REGION(state->rgn);
+  io->input = ctx->input;
+  io->input_len = (ctx->input == NULL) ? 0 : ctx->input_len;
+  io->input_pos = 0;
+
+  if (state->plaintext.length) {
+    // Finish delivering the last application data record first
+    engine_deliver(state, ctx);
+  } else if (!run_step(state->async, engine_step, state)) {
+    ctx->flags |= TFLAG_PENDING;
+  } else if (state->async != NULL && state->async->failed) {
+    r = 0; // out of memory on the step's stack
+  } else {
+    ctx->tls_error = io->tls_error;
+    if (io->step_flags & TFLAG_DATA) {
+      engine_deliver(state, ctx);
+    }
+    ctx->flags |= io->step_flags;
+    r = !io->failed;
+  }
+  if (!(ctx->flags & TFLAG_DATA)) {
+    ctx->plaintext_len = 0;
+  }
+  ctx->consumed_bytes = io->input_pos;
+  io->input = NULL;
+  io->input_len = io->input_pos = 0;
+
+  // Hand over as much queued output as fits
+  size_t n = io->output_len - io->output_pos;
+  if (n > ctx->output_len || ctx->output == NULL) {
+    n = (ctx->output == NULL) ? 0 : ctx->output_len;
+  }
+  if (n) {
+    memcpy(ctx->output, io->output + io->output_pos, n);
+    io->output_pos += n;
+  }
+  ctx->output_len = n;
+  ctx->to_be_written = io->output_len - io->output_pos;
+  if (ctx->to_be_written) {
+    ctx->flags |= TFLAG_WANT_WRITE;
+  }
+  ctx->flags |= io->flags;
+  LEAVE_HEAP_REGION();
+
+  if (HAD_OUT_OF_MEMORY) {
+    return 0;
+  }
+  return r;
+}
+
 static int get_exporter(Connection_connection cxn, int early, /* out */ mitls_secret *secret)
 {
   FStar_Pervasives_Native_option__Spec_Hash_Definitions_hash_alg___EverCrypt_aead_alg___FStar_Bytes_bytes ret;
@@ -880,6 +2006,15 @@ typedef struct quic_state {
    uint8_t is_complete;
    uint8_t is_post_hs;
    Old_Handshake_hs hs;
+   mitls_config_template *tmpl; // shared by the configuration of hs, or NULL
+
+   // The current FFI_mitls_quic_process step, see quic_step
+   async_step *async; // NULL unless pending certificate callbacks are enabled
+   QUIC_hs_in in;
+   char *in_buf;      // in.input, when the step may suspend; grown as needed
+   size_t in_buf_len;
+   QUIC_hs_result res;
+   K___Prims_int_Prims_int epochs; // as of the last step that returned
 } quic_state;
 
 static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_config *cfg)
@@ -922,15 +2057,6 @@ static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_co
       }
     }
 
-    if(cfg->ticket_enc_alg && cfg->ticket_key) {
-        FStar_Bytes_bytes key;
-        bool b;
-        MakeFStar_Bytes_bytes(&key, cfg->ticket_key, cfg->ticket_key_len);
-        LOCK_MUTEX(&lock);
-        FFI_ffiSetTicketKey(cfg->ticket_enc_alg, key);
-        UNLOCK_MUTEX(&lock);
-    }
-
     if(cfg->server_ticket && cfg->server_ticket->ticket_len > 0) {
       FStar_Bytes_bytes tid, si;
       MakeFStar_Bytes_bytes(&tid, cfg->server_ticket->ticket, cfg->server_ticket->ticket_len);
@@ -960,6 +2086,7 @@ static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_co
       cbs->format = cfg->cert_callbacks->format;
       cbs->sign = cfg->cert_callbacks->sign;
       cbs->verify = cfg->cert_callbacks->verify;
+      cbs->chain = NULL;
 
       TLSConstants_cert_cb cb = {
         .app_context = (void*)cbs,
@@ -979,12 +2106,38 @@ static TLSConstants_config quic_set_config(TLSConstants_config c0, const quic_co
     return c;
 }
 
+// The ticket key is global: it is set in the global region, only when
+// cfg has another key than the last one set, rather than for every connection
+static void quic_set_ticket_key(const quic_config *cfg)
+{
+    const char *alg = cfg->ticket_enc_alg;
+    const unsigned char *tk = (const unsigned char*)cfg->ticket_key;
+    size_t klen = cfg->ticket_key_len;
+
+    if (alg == NULL || tk == NULL) {
+        return;
+    }
+    Locks_acquire(Locks_FFITicketKey);
+    if (!quic_ticket_key.valid || strcmp(quic_ticket_key.alg, alg) != 0
+        || quic_ticket_key.key_len != klen || memcmp(quic_ticket_key.key, tk, klen) != 0) {
+        quic_ticket_key.valid = set_ticket_key(alg, tk, klen)
+            && strlen(alg) < sizeof(quic_ticket_key.alg) && klen <= QUIC_TICKET_KEY_MAX;
+        if (quic_ticket_key.valid) {
+            strcpy(quic_ticket_key.alg, alg);
+            memcpy(quic_ticket_key.key, tk, klen);
+            quic_ticket_key.key_len = klen;
+        }
+    }
+    Locks_release(Locks_FFITicketKey);
+}
+
 int MITLS_CALLCONV FFI_mitls_quic_create(quic_state **state, const quic_config *cfg)
 {
     quic_state* st = NULL;
     *state = NULL;
     HEAP_REGION rgn;
 
+    quic_set_ticket_key(cfg);
     CREATE_HEAP_REGION(&rgn);
     if (!VALID_HEAP_REGION(rgn)) {
         return 0; // out of memory
@@ -999,6 +2152,7 @@ int MITLS_CALLCONV FFI_mitls_quic_create(quic_state **state, const quic_config *
     
     config = quic_set_config(config, cfg);
     st->hs = QUIC_create_hs(st->is_server, config);
+    st->epochs = QUIC_get_epochs(st->hs);
 
     LEAVE_HEAP_REGION();
     if (HAD_OUT_OF_MEMORY || st == NULL) {
@@ -1011,37 +2165,122 @@ int MITLS_CALLCONV FFI_mitls_quic_create(quic_state **state, const quic_config *
     return 1;
 }
 
-#ifdef _KERNEL_MODE
-typedef struct {
-    quic_state *state;
-    QUIC_hs_in *in;
-    QUIC_hs_result *r;
-} quic_process_state;
+int MITLS_CALLCONV FFI_mitls_quic_template(mitls_config_template **tmpl, const quic_config *cfg)
+{
+    mitls_config_template *t = NULL;
+    *tmpl = NULL;
+    HEAP_REGION rgn;
+
+    quic_set_ticket_key(cfg);
+    CREATE_HEAP_REGION(&rgn);
+    if (!VALID_HEAP_REGION(rgn)) {
+        return 0; // out of memory
+    }
+
+    t = KRML_HOST_MALLOC(sizeof(mitls_config_template));
+    memset(t, 0, sizeof(*t));
+    t->is_quic = 1;
+    t->is_server = cfg->is_server;
+    t->refcount = 1;
+
+    Prims_string host_name = CopyPrimsString(cfg->host_name != NULL ? cfg->host_name : "");
+    TLSConstants_config config = QUIC_ffiConfig((FStar_Bytes_bytes){.data=host_name,.length=strlen(host_name)});
+    t->cfg = quic_set_config(config, cfg);
+
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+      DESTROY_HEAP_REGION(rgn);
+      return 0;
+    }
+
+    t->rgn = rgn;
+    *tmpl = t;
+    return 1;
+}
+
+int MITLS_CALLCONV FFI_mitls_quic_create_from_template(quic_state **state, mitls_config_template *tmpl, const char *host_name)
+{
+    quic_state* st = NULL;
+    *state = NULL;
+    HEAP_REGION rgn;
+
+    if (!tmpl->is_quic) {
+        return 0;
+    }
+    CREATE_HEAP_REGION(&rgn);
+    if (!VALID_HEAP_REGION(rgn)) {
+        return 0; // out of memory
+    }
+
+    st = KRML_HOST_MALLOC(sizeof(quic_state));
+    memset(st, 0, sizeof(*st));
+    st->is_server = tmpl->is_server;
+
+    TLSConstants_config config = tmpl->cfg;
+    if (host_name != NULL) {
+      Prims_string host = CopyPrimsString(host_name);
+      config = FFI_ffiSetPeerName(config, (FStar_Bytes_bytes){.data=host,.length=strlen(host_name)});
+    }
+    st->hs = QUIC_create_hs(st->is_server, config);
+    st->epochs = QUIC_get_epochs(st->hs);
+
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+      DESTROY_HEAP_REGION(rgn);
+      return 0;
+    }
 
+    REFCOUNT_INCREMENT(&tmpl->refcount);
+    st->tmpl = tmpl;
+    st->rgn = rgn;
+    *state = st;
+    return 1;
+}
+
+// Run on the stack of st->async if any
+static void quic_step(void *arg)
+{
+  quic_state *st = (quic_state*)arg;
+  st->res = QUIC_process_hs(st->hs, st->in);
+}
+
+#ifdef _KERNEL_MODE
 static VOID quic_process_callout(PVOID Parameter)
 {
-    quic_process_state *s = (quic_process_state*)Parameter;
-    *s->r = QUIC_process_hs(s->state->hs, *s->in);
+    quic_step(Parameter);
 }
 #endif
 
 int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
 {
   int r = 0;
+  int returned = 1;
   ENTER_HEAP_REGION(st->rgn);
-  unsigned char z = 0;
-  
-  QUIC_hs_in in;
-  in.input = (FStar_Bytes_bytes){
-    .data = (char*)(ctx->input == NULL ? &z : ctx->input),
-    .length = ctx->input_len
-  };
-  in.max_output = ctx->output_len;  
+  static unsigned char z = 0;
+
+  if (!step_suspended(st->async)) {
+    st->in.input = (FStar_Bytes_bytes){
+      .data = (char*)(ctx->input == NULL ? &z : ctx->input),
+      .length = ctx->input_len
+    };
+    st->in.max_output = ctx->output_len;
+    if (st->async != NULL && ctx->input_len) {
+      // The step may return in a later call, with other buffers, and
+      // what it parsed so far references its input in place
+      if (st->in_buf_len < ctx->input_len) {
+        KRML_HOST_FREE(st->in_buf);
+        st->in_buf = NULL; // in case of out of memory
+        st->in_buf_len = 0;
+        st->in_buf = KRML_HOST_MALLOC(ctx->input_len);
+        st->in_buf_len = ctx->input_len;
+      }
+      memcpy(st->in_buf, ctx->input, ctx->input_len);
+      st->in.input.data = st->in_buf;
+    }
+  }
 
 #ifdef _KERNEL_MODE
-  QUIC_hs_result res;
-  quic_process_state s = {.state = st, .in = &in, .r = &res };
-  NTSTATUS status = KeExpandKernelStackAndCallout(quic_process_callout, &s, MAXIMUM_EXPANSION_SIZE);
+  NTSTATUS status = KeExpandKernelStackAndCallout(quic_process_callout, st, MAXIMUM_EXPANSION_SIZE);
   
   if (!NT_SUCCESS(status)) {
     KRML_HOST_PRINTF("KeExpandKernelCallstackAndCallout for quic_process_callout failed st=%x", status);
@@ -1049,35 +2288,51 @@ int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
     return 0;
   }
 #else
-  QUIC_hs_result res = QUIC_process_hs(st->hs, in);
+  returned = run_step(st->async, quic_step, st);
 #endif
 
   ctx->flags = 0;
-  if(res.tag == QUIC_HS_SUCCESS)
-  {
-    QUIC_hs_out out = res.val.case_HS_SUCCESS;
-    ctx->consumed_bytes = out.consumed;
-    ctx->to_be_written = out.to_be_written;
-    ctx->output_len = out.output.length;
-    if(ctx->output != NULL && ctx->output_len)
-      memcpy(ctx->output, out.output.data, ctx->output_len);
-    
-    if(out.is_complete) st->is_complete = 1;
-    if(out.is_writable) ctx->flags |= QFLAG_APPLICATION_KEY;
-    if(out.is_early_rejected) ctx->flags |= QFLAG_REJECTED_0RTT;
-    if(out.is_post_handshake) st->is_post_hs = 1;
-    r = 1;
-  }
-  else
-  {
-    ctx->tls_error = res.val.case_HS_ERROR;
-    ctx->output_len = 0;
+  if (!returned) {
+    // Nothing is consumed or written until the callback completes
+    ctx->flags |= QFLAG_PENDING;
     ctx->consumed_bytes = 0;
+    ctx->to_be_written = 0;
+    ctx->output_len = 0;
+    r = 1;
+  } else {
+    QUIC_hs_result res = st->res;
+    if (st->async != NULL && st->async->failed) {
+      ctx->tls_error = 0x0350; // Internal error: out of memory on the step's stack
+      ctx->output_len = 0;
+      ctx->consumed_bytes = 0;
+    }
+    else if(res.tag == QUIC_HS_SUCCESS && (ctx->output == NULL || ctx->output_len >= res.val.case_HS_SUCCESS.output.length))
+    {
+      QUIC_hs_out out = res.val.case_HS_SUCCESS;
+      ctx->consumed_bytes = out.consumed;
+      ctx->to_be_written = out.to_be_written;
+      ctx->output_len = out.output.length;
+      if(ctx->output != NULL && ctx->output_len)
+        memcpy(ctx->output, out.output.data, ctx->output_len);
+    
+      if(out.is_complete) st->is_complete = 1;
+      if(out.is_writable) ctx->flags |= QFLAG_APPLICATION_KEY;
+      if(out.is_early_rejected) ctx->flags |= QFLAG_REJECTED_0RTT;
+      if(out.is_post_handshake) st->is_post_hs = 1;
+      r = 1;
+    }
+    else
+    {
+      // An error, or a resuming output buffer smaller than that of the suspended call
+      ctx->tls_error = (res.tag == QUIC_HS_SUCCESS) ? 0x0350 : res.val.case_HS_ERROR;
+      ctx->output_len = 0;
+      ctx->consumed_bytes = 0;
+    }
+    st->epochs = QUIC_get_epochs(st->hs);
   }
 
-  K___Prims_int_Prims_int epochs = QUIC_get_epochs(st->hs);
-  ctx->cur_reader_key = epochs.fst;
-  ctx->cur_writer_key = epochs.snd;
+  ctx->cur_reader_key = st->epochs.fst;
+  ctx->cur_writer_key = st->epochs.snd;
   if(st->is_complete) ctx->flags |= QFLAG_COMPLETE;
   if(st->is_post_hs) ctx->flags |= QFLAG_POST_HANDSHAKE;
   
@@ -1085,6 +2340,34 @@ int MITLS_CALLCONV FFI_mitls_quic_process(quic_state *st, quic_process_ctx *ctx)
   return r;
 }
 
+int MITLS_CALLCONV FFI_mitls_quic_configure_async_cert_callbacks(quic_state *st)
+{
+  if (st->async == NULL) {
+    ENTER_HEAP_REGION(st->rgn);
+    st->async = async_create(st->rgn);
+    LEAVE_HEAP_REGION();
+    if (HAD_OUT_OF_MEMORY) {
+      st->async = NULL;
+    }
+  }
+  return st->async != NULL;
+}
+
+int MITLS_CALLCONV FFI_mitls_quic_complete_select(quic_state *st, const void *cert, mitls_signature_scheme selected)
+{
+  return async_complete_select(st->async, cert, selected);
+}
+
+int MITLS_CALLCONV FFI_mitls_quic_complete_sign(quic_state *st, const unsigned char *sig, size_t sig_len)
+{
+  return async_complete_sign(st->async, sig, sig_len);
+}
+
+int MITLS_CALLCONV FFI_mitls_quic_complete_verify(quic_state *st, int valid)
+{
+  return async_complete_verify(st->async, valid);
+}
+
 int MITLS_CALLCONV FFI_mitls_quic_get_record_key(quic_state *st, quic_raw_key *key, int32_t epoch, quic_direction rw)
 {
   int res = 0;
@@ -1143,13 +2426,21 @@ int MITLS_CALLCONV FFI_mitls_quic_send_ticket(quic_state *st, const unsigned cha
   return r;
 }
 
+int MITLS_CALLCONV FFI_mitls_quic_get_memory_stats(quic_state *state, /* out */ mitls_memory_stats *stats)
+{
+    return get_memory_stats(state->rgn, stats);
+}
+
 void MITLS_CALLCONV FFI_mitls_quic_free(quic_state *state)
 {
     HEAP_REGION rgn = state->rgn;
+    mitls_config_template *tmpl = state->tmpl;
+    async_free(state->async);
     ENTER_HEAP_REGION(state->rgn);
     KRML_HOST_FREE(state);
     LEAVE_HEAP_REGION();
     DESTROY_HEAP_REGION(rgn);
+    template_release(tmpl);
 }
 
 
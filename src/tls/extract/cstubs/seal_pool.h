@@ -0,0 +1,27 @@
+#ifndef HEADER_SEAL_POOL_H
+#define HEADER_SEAL_POOL_H
+
+// A pool of threads sealing consecutive TLS 1.3 records, implemented in
+// evercrypt_openssl.c and controlled from mitlsffi.c.
+//
+// AEADProvider.seal_records hands the records of one large send to
+// EverCrypt_OpenSSL_aead_seal_records, with their sequence numbers
+// already reserved by StreamAE. The nonce of each record only depends on
+// its sequence number, so the caller and the workers take records in any
+// order and each writes its record at its final offset in the output:
+// the records are emitted in order. Each thread has its own OpenSSL
+// context, keyed only while it seals a send. The pool runs one send at a
+// time; a send that finds it busy seals its records inline.
+
+#include <stdint.h>
+
+#define SEAL_POOL_MAX_THREADS 64
+
+// Seal with this many threads, the calling thread included; 0 or 1 stops
+// the workers. Returns 0 if some worker could not be started
+int SealPool_configure(uint32_t threads);
+
+// Stop the workers and free their contexts
+void SealPool_cleanup(void);
+
+#endif // HEADER_SEAL_POOL_H
@@ -0,0 +1,373 @@
+#if defined(_MSC_VER)
+  #define IS_WINDOWS 1
+  #ifdef _KERNEL_MODE
+    #include <nt.h>
+    #include <ntrtl.h>
+  #else
+    #include <windows.h>
+    #include <stdlib.h>
+  #endif
+#elif defined(__MINGW32__)
+  #define IS_WINDOWS 1
+  #include <windows.h>
+  #include <stdlib.h>
+#else // Linux or gcc/cygwin
+  #define IS_WINDOWS 0
+  #include <pthread.h>
+  #include <stdlib.h>
+  #include <time.h>
+#endif
+#include <string.h>
+
+#include "session_cache_stubs.h"
+
+// Native implementation of SessionCache.fsti.
+//
+// Each cache is split into SHARD_COUNT shards by key hash, each with its
+// own lock, chained hash table and least-recently-used list, and a bound
+// of capacity/SHARD_COUNT entries.  Entries are allocated outside of the
+// heap regions, as they outlive the connection that inserts them; lookup
+// copies the value into the current region.  Expired entries are dropped
+// when found by a lookup or when they reach the tail of the LRU list.
+// Values hold master secrets: entries are wiped before they are freed.
+//
+// A capacity of 0 disables the caches: insert stores nothing.
+//
+// Keys (session IDs, tickets) may be chosen by the peer, so the hash is
+// seeded per process; in any case chains are bounded by the shard size.
+//
+// All locks are statically initialized, as for locks_stubs.c.
+
+#define SHARD_BITS  4
+#define SHARD_COUNT (1 << SHARD_BITS)
+#define CACHE_COUNT (SessionCache_TicketPSKs13 + 1)
+
+#if IS_WINDOWS
+  #ifdef _KERNEL_MODE
+    #define MITLS_TAG 'LTmi'
+    #define CACHE_ALLOC(cb) ExAllocatePoolWithTag(PagedPool, (cb), MITLS_TAG)
+    #define CACHE_FREE(pv) ExFreePoolWithTag((pv), MITLS_TAG)
+    #define CACHE_WIPE(pv, cb) RtlSecureZeroMemory((pv), (cb))
+    typedef EX_PUSH_LOCK shard_lock; // zero is the initial state
+    #define SHARD_LOCK_INIT 0
+    #define SHARD_LOCK(s)   do { KeEnterCriticalRegion(); ExfAcquirePushLockExclusive(&(s)->lock); } while (0)
+    #define SHARD_UNLOCK(s) do { ExfReleasePushLockExclusive(&(s)->lock); KeLeaveCriticalRegion(); } while (0)
+
+    static uint64_t now_seconds(void)
+    {
+        return KeQueryInterruptTime() / 10000000; // 100ns units
+    }
+  #else
+    #define CACHE_ALLOC(cb) malloc(cb)
+    #define CACHE_FREE(pv) free(pv)
+    #define CACHE_WIPE(pv, cb) SecureZeroMemory((pv), (cb))
+    typedef SRWLOCK shard_lock;
+    #define SHARD_LOCK_INIT SRWLOCK_INIT
+    #define SHARD_LOCK(s)   AcquireSRWLockExclusive(&(s)->lock)
+    #define SHARD_UNLOCK(s) ReleaseSRWLockExclusive(&(s)->lock)
+
+    static uint64_t now_seconds(void)
+    {
+        return GetTickCount64() / 1000;
+    }
+  #endif
+#else
+  #define CACHE_ALLOC(cb) malloc(cb)
+  #define CACHE_FREE(pv) free(pv)
+  #define CACHE_WIPE(pv, cb) wipe((pv), (cb))
+  typedef pthread_mutex_t shard_lock;
+  #define SHARD_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+  #define SHARD_LOCK(s)   pthread_mutex_lock(&(s)->lock)
+  #define SHARD_UNLOCK(s) pthread_mutex_unlock(&(s)->lock)
+
+  // Not optimized away, unlike a memset of memory about to be freed
+  static void wipe(void *pv, size_t cb)
+  {
+      volatile uint8_t *p = (volatile uint8_t*)pv;
+      while (cb--) {
+          *p++ = 0;
+      }
+  }
+
+  static uint64_t now_seconds(void)
+  {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (uint64_t)ts.tv_sec;
+  }
+#endif
+
+typedef struct cache_entry {
+    struct cache_entry *chain;            // next in the hash bucket
+    struct cache_entry *newer, *older;    // LRU list
+    uint64_t hash;
+    uint64_t expires;
+    uint32_t key_length;
+    uint32_t value_length;
+    uint8_t data[];    // key then value
+} cache_entry;
+
+typedef struct {
+    shard_lock lock;
+    cache_entry **buckets;  // allocated at the first insertion
+    size_t bucket_mask;
+    cache_entry *newest, *oldest;
+    size_t count;
+    uint64_t hits, misses, insertions, evictions, expirations;
+} cache_shard;
+
+#define S1  { SHARD_LOCK_INIT }
+#define S4  S1, S1, S1, S1
+#define S16 S4, S4, S4, S4
+static cache_shard caches[CACHE_COUNT][SHARD_COUNT] = { { S16 }, { S16 }, { S16 } };
+
+// Only written by SessionCache_configure, with all shard locks held
+static size_t shard_capacity = (SESSION_CACHE_DEFAULT_CAPACITY + SHARD_COUNT - 1) / SHARD_COUNT;
+static uint64_t lifetime_seconds = SESSION_CACHE_DEFAULT_LIFETIME;
+
+static uint64_t hash_key(const uint8_t *key, size_t length)
+{
+    // FNV-1a, keyed by the (ASLR-randomized) address of the caches,
+    // and finalized so that both low and high bits are well mixed
+    uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t)(uintptr_t)caches * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ key[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static cache_shard *shard_of(SessionCache_cache_id c, uint64_t hash)
+{
+    return &caches[c][hash >> (64 - SHARD_BITS)];
+}
+
+static void free_entry(cache_entry *e)
+{
+    CACHE_WIPE(e, sizeof(cache_entry) + e->key_length + e->value_length);
+    CACHE_FREE(e);
+}
+
+// Called with the shard lock held
+static void unlink_entry(cache_shard *s, cache_entry *e)
+{
+    cache_entry **p = &s->buckets[e->hash & s->bucket_mask];
+    while (*p != e) {
+        p = &(*p)->chain;
+    }
+    *p = e->chain;
+
+    if (e->newer) e->newer->older = e->older; else s->newest = e->older;
+    if (e->older) e->older->newer = e->newer; else s->oldest = e->newer;
+
+    s->count--;
+    free_entry(e);
+}
+
+// Called with the shard lock held
+static void push_newest(cache_shard *s, cache_entry *e)
+{
+    e->newer = NULL;
+    e->older = s->newest;
+    if (s->newest) s->newest->newer = e; else s->oldest = e;
+    s->newest = e;
+}
+
+// Called with the shard lock held
+static void flush_shard(cache_shard *s)
+{
+    while (s->oldest) {
+        unlink_entry(s, s->oldest);
+    }
+    if (s->buckets) {
+        CACHE_FREE(s->buckets);
+        s->buckets = NULL;
+    }
+}
+
+// Called with the shard lock held: the live entry for the key, if any
+static cache_entry *find_entry(cache_shard *s, uint64_t hash, FStar_Bytes_bytes key)
+{
+    cache_entry *e = NULL;
+    if (s->buckets) {
+        for (e = s->buckets[hash & s->bucket_mask]; e; e = e->chain) {
+            if (e->hash == hash && e->key_length == key.length &&
+                memcmp(e->data, key.data, key.length) == 0) {
+                break;
+            }
+        }
+    }
+    if (e && e->expires <= now_seconds()) {
+        s->expirations++;
+        unlink_entry(s, e);
+        e = NULL;
+    }
+    return e;
+}
+
+FStar_Pervasives_Native_option__FStar_Bytes_bytes
+SessionCache_lookup(SessionCache_cache_id c, FStar_Bytes_bytes key)
+{
+    FStar_Pervasives_Native_option__FStar_Bytes_bytes r = { .tag = FStar_Pervasives_Native_None };
+    uint64_t hash = hash_key((const uint8_t*)key.data, key.length);
+    cache_shard *s = shard_of(c, hash);
+    char *v = NULL;
+    size_t v_length = 0;
+
+    // The copy is allocated outside of the lock, as an out-of-memory exit
+    // from the current region would not release it: find the length of the
+    // value, allocate, then copy under the lock if it still fits.
+    for (;;) {
+        SHARD_LOCK(s);
+        cache_entry *e = find_entry(s, hash, key);
+        if (e == NULL) {
+            s->misses++;
+            SHARD_UNLOCK(s);
+            KRML_HOST_FREE(v);
+            return r;
+        }
+        if (v != NULL && e->value_length <= v_length) {
+            s->hits++;
+            if (e->newer) {
+                // Move to the head of the LRU list
+                e->newer->older = e->older;
+                if (e->older) e->older->newer = e->newer; else s->oldest = e->newer;
+                push_newest(s, e);
+            }
+            memcpy(v, e->data + e->key_length, e->value_length);
+            r.tag = FStar_Pervasives_Native_Some;
+            r.v = (FStar_Bytes_bytes){ .length = e->value_length, .data = v };
+            SHARD_UNLOCK(s);
+            return r;
+        }
+        v_length = e->value_length; // replaced by a larger value since, if v != NULL
+        SHARD_UNLOCK(s);
+        KRML_HOST_FREE(v);
+        v = KRML_HOST_MALLOC(v_length ? v_length : 1);
+    }
+}
+
+void SessionCache_insert(SessionCache_cache_id c, FStar_Bytes_bytes key, FStar_Bytes_bytes value)
+{
+    uint64_t hash = hash_key((const uint8_t*)key.data, key.length);
+    cache_shard *s = shard_of(c, hash);
+    cache_entry *e = CACHE_ALLOC(sizeof(cache_entry) + key.length + value.length);
+    if (e == NULL) {
+        return; // caching is best-effort
+    }
+    e->hash = hash;
+    e->key_length = key.length;
+    e->value_length = value.length;
+    memcpy(e->data, key.data, key.length);
+    memcpy(e->data + key.length, value.data, value.length);
+
+    SHARD_LOCK(s);
+    if (shard_capacity == 0) {
+        SHARD_UNLOCK(s);
+        free_entry(e);
+        return;
+    }
+    if (s->buckets == NULL) {
+        size_t n = 1;
+        while (n < shard_capacity) {
+            n <<= 1;
+        }
+        s->buckets = CACHE_ALLOC(n * sizeof(cache_entry*));
+        if (s->buckets == NULL) {
+            SHARD_UNLOCK(s);
+            free_entry(e);
+            return;
+        }
+        memset(s->buckets, 0, n * sizeof(cache_entry*));
+        s->bucket_mask = n - 1;
+    }
+
+    uint64_t now = now_seconds();
+    e->expires = now + lifetime_seconds;
+
+    // Replace any previous value for the key
+    for (cache_entry *old = s->buckets[hash & s->bucket_mask]; old; old = old->chain) {
+        if (old->hash == hash && old->key_length == key.length &&
+            memcmp(old->data, key.data, key.length) == 0) {
+            unlink_entry(s, old);
+            break;
+        }
+    }
+
+    // Make room, dropping expired entries first: they are the oldest
+    while (s->oldest && (s->count >= shard_capacity || s->oldest->expires <= now)) {
+        if (s->oldest->expires <= now) {
+            s->expirations++;
+        } else {
+            s->evictions++;
+        }
+        unlink_entry(s, s->oldest);
+    }
+
+    cache_entry **bucket = &s->buckets[hash & s->bucket_mask];
+    e->chain = *bucket;
+    *bucket = e;
+    push_newest(s, e);
+    s->count++;
+    s->insertions++;
+    SHARD_UNLOCK(s);
+}
+
+int SessionCache_configure(size_t capacity, uint32_t lifetime)
+{
+    if (lifetime == 0) {
+        return 0;
+    }
+    // Take every lock, in a fixed order, as the bounds are shared
+    for (int c = 0; c < CACHE_COUNT; c++) {
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            SHARD_LOCK(&caches[c][i]);
+        }
+    }
+    shard_capacity = (capacity + SHARD_COUNT - 1) / SHARD_COUNT;
+    lifetime_seconds = lifetime;
+    for (int c = CACHE_COUNT - 1; c >= 0; c--) {
+        for (int i = SHARD_COUNT - 1; i >= 0; i--) {
+            flush_shard(&caches[c][i]);
+            SHARD_UNLOCK(&caches[c][i]);
+        }
+    }
+    return 1;
+}
+
+void SessionCache_get_stats(SessionCache_cache_id c, mitls_session_cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        cache_shard *s = &caches[c][i];
+        SHARD_LOCK(s);
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->insertions += s->insertions;
+        stats->evictions += s->evictions;
+        stats->expirations += s->expirations;
+        stats->entries += s->count;
+        SHARD_UNLOCK(s);
+    }
+}
+
+uint32_t SessionCache_entries(SessionCache_cache_id c)
+{
+    mitls_session_cache_stats stats;
+    SessionCache_get_stats(c, &stats);
+    return (uint32_t)stats.entries;
+}
+
+void SessionCache_flush(void)
+{
+    for (int c = 0; c < CACHE_COUNT; c++) {
+        for (int i = 0; i < SHARD_COUNT; i++) {
+            cache_shard *s = &caches[c][i];
+            SHARD_LOCK(s);
+            flush_shard(s);
+            SHARD_UNLOCK(s);
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef HEADER_SESSION_CACHE_STUBS_H
+#define HEADER_SESSION_CACHE_STUBS_H
+
+// C-only controls of the caches of SessionCache.fsti, for mitlsffi.c
+
+#include "SessionCache.h"
+#include "mitlsffi.h"
+
+#define SESSION_CACHE_DEFAULT_CAPACITY 10000  // entries per cache
+#define SESSION_CACHE_DEFAULT_LIFETIME 86400  // seconds
+
+// Empty the caches and set their bounds; capacity 0 disables them.
+// Existing entries are dropped, but the counters are kept.
+// Returns 0, leaving the caches unchanged, if lifetime is 0
+int SessionCache_configure(size_t capacity, uint32_t lifetime);
+
+void SessionCache_get_stats(SessionCache_cache_id c, mitls_session_cache_stats *stats);
+
+// Free all entries, at process cleanup
+void SessionCache_flush(void);
+
+#endif // HEADER_SESSION_CACHE_STUBS_H
@@ -0,0 +1,12 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Native part of the internal test (Test.Main), compiled with it only.
+
+// Test.KeySchedule runs its microbenchmark after its test vectors when
+// MITLS_BENCH is set, as by make bench: it takes about 16 seconds
+bool Test_KeySchedule_bench_enabled(void)
+{
+  const char *s = getenv("MITLS_BENCH");
+  return s != NULL && *s != 0 && *s != '0';
+}
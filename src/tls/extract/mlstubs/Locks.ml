@@ -0,0 +1,9 @@
+(* The OCaml build of miTLS is single-threaded: locks are no-ops *)
+type lock_id =
+  | TicketKeys
+  | PSKTables
+  | FFITicketKey
+
+let acquire : lock_id -> unit = fun _ -> ()
+let release : lock_id -> unit = fun _ -> ()
+let release_held : unit -> unit = fun _ -> ()
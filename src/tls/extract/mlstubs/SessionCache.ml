@@ -0,0 +1,67 @@
+(* The OCaml build of miTLS is single-threaded: one bounded table per cache,
+   evicting the oldest insertion when full, and entries expiring after their
+   lifetime, both set by configure as in session_cache_stubs.c *)
+type cache_id =
+  | Tickets13
+  | Sessions12
+  | TicketPSKs13
+
+let default_capacity = 10000
+let default_lifetime = 86400
+
+(* per cache, unlike the C version, which shards it *)
+let capacity = ref default_capacity
+let lifetime = ref default_lifetime
+
+(* key -> (value, expiry, serial); the queue holds (key, serial) in insertion
+   order, so that a key removed then inserted again is not evicted early *)
+let tables = [| Hashtbl.create 64; Hashtbl.create 64; Hashtbl.create 64 |]
+let order = [| Queue.create (); Queue.create (); Queue.create () |]
+let serial = ref 0
+
+let index = function Tickets13 -> 0 | Sessions12 -> 1 | TicketPSKs13 -> 2
+
+let lookup : cache_id -> FStar_Bytes.bytes -> FStar_Bytes.bytes FStar_Pervasives_Native.option =
+  fun c k ->
+  let t = tables.(index c) in
+  let k = FStar_Bytes.hex_of_bytes k in
+  match Hashtbl.find_opt t k with
+  | Some (v, expires, _) when Unix.gettimeofday () < expires -> FStar_Pervasives_Native.Some v
+  | Some _ -> Hashtbl.remove t k; FStar_Pervasives_Native.None
+  | None -> FStar_Pervasives_Native.None
+
+let rec evict t q =
+  if Hashtbl.length t >= !capacity && not (Queue.is_empty q) then begin
+    let (k, n) = Queue.pop q in
+    (match Hashtbl.find_opt t k with
+     | Some (_, _, n') when n = n' -> Hashtbl.remove t k
+     | _ -> ());
+    evict t q
+  end
+
+let insert : cache_id -> FStar_Bytes.bytes -> FStar_Bytes.bytes -> unit =
+  fun c k v ->
+  if !capacity > 0 then begin
+    let t = tables.(index c) and q = order.(index c) in
+    let k = FStar_Bytes.hex_of_bytes k in
+    let expires = Unix.gettimeofday () +. float_of_int !lifetime in
+    match Hashtbl.find_opt t k with
+    | Some (_, _, n) -> Hashtbl.replace t k (v, expires, n)
+    | None ->
+      evict t q;
+      incr serial;
+      Queue.push (k, !serial) q;
+      Hashtbl.replace t k (v, expires, !serial)
+  end
+
+let entries : cache_id -> FStar_UInt32.t =
+  fun c -> FStar_UInt32.uint_to_t (Prims.of_int (Hashtbl.length tables.(index c)))
+
+(* Empty the caches and set their bounds; capacity 0 disables them *)
+let configure : int -> int -> unit =
+  fun cap life ->
+  if life <= 0 then invalid_arg "SessionCache.configure: lifetime";
+  capacity := cap;
+  lifetime := life;
+  Array.iter Hashtbl.reset tables;
+  Array.iter Queue.clear order
@@ -6,6 +6,8 @@ all: libevercrypt.dll libevercrypt.lib
 #  remove evercrypt_openssl
 #  add a couple missing ones... looks like make-source-drop is more
 #  authoritative
+#  add evercrypt_hacl_stubs from miTLS (AES-NI dispatch and keyed HMAC of
+#  EverCrypt.Hacl, used by EverCrypt.c)
 SOURCES = \
   EverCrypt.c \
   EverCrypt_AEAD.c \
@@ -33,6 +35,7 @@ SOURCES = \
   Hacl_Ed25519.c \
   Hacl_Hash.c \
   Hacl_AES.c \
+  evercrypt_hacl_stubs.c \
   Hacl_SHA3.c \
   Hacl_Poly1305_32.c \
   Hacl_Poly1305_128.c \
@@ -21,6 +21,8 @@ SOURCES = \
   HandshakeMessages.c \
   Hashing.c \
   krmlinit.c \
+  locks_stubs.c \
+  session_cache_stubs.c \
   LowParse.c \
   Mem.c \
   mitlsffi.c \
@@ -47,6 +49,9 @@ SOURCES = \
 libmitls_code.lib: $(SOURCES:.c=.obj) $(PLATFORM_OBJS)
   lib /nologo /out:libmitls_code.lib $**
   
+# evercrypt_hacl_stubs.c is built into libevercrypt, whose EverCrypt.c uses
+# the AES implementation it selects: mitlsffi.c calls its exported
+# EverCrypt_Hacl_aes_init rather than a second copy of it
 libmitls.dll: libmitls_code.lib libmitls.def dllmain.obj ../krmllib/libkrmllib.lib ../evercrypt/libevercrypt.lib
   link /nologo /dll /debug:full /out:libmitls.dll libmitls_code.lib dllmain.obj /def:libmitls.def ntdll.lib advapi32.lib bcrypt.lib ../krmllib/libkrmllib.lib ../evercrypt/libevercrypt.lib /OPT:ICF /OPT:REF
 